@@ -0,0 +1,245 @@
+#include "alias_table.hpp"
+
+#include <vector>
+#include <span>
+#include <algorithm>
+
+AliasTable::AliasTable(std::span<const float> w) {
+	build(w);
+}
+
+void AliasTable::build(std::span<const float> w) {
+	weights.assign(w.begin(), w.end());
+	rebuild();
+}
+
+void AliasTable::rebuild() {
+	segments.clear();
+	prob.resize(weights.size());
+	alias.resize(weights.size());
+	if (!weights.empty()) {
+		segments.push_back({ 0, static_cast<uint32_t>(weights.size()), 0.0f, true });
+		build_segment(segments.back());
+	}
+	update_total();
+}
+
+void AliasTable::build_segment(Segment& segment) {
+	// Vose's method: split the entries in buckets that are under- and overfull and pair them up
+	const size_t n = segment.count;
+	const uint32_t first = segment.first;
+	segment.aliased = true;
+
+	double sum = 0.0;
+	for (size_t i = 0; i < n; i++) {
+		sum += weights[first + i];
+	}
+	segment.weight = static_cast<float>(sum);
+
+	for (size_t i = 0; i < n; i++) {
+		prob[first + i] = 1.0f;
+		alias[first + i] = static_cast<uint32_t>(first + i);
+	}
+
+	if (sum <= 0.0) {
+		// Degenerate distribution, fall back to uniform sampling
+		return;
+	}
+
+	std::vector<double> scaled(n);
+	std::vector<uint32_t> small;
+	std::vector<uint32_t> large;
+	small.reserve(n);
+	large.reserve(n);
+
+	for (size_t i = 0; i < n; i++) {
+		scaled[i] = weights[first + i] * static_cast<double>(n) / sum;
+		if (scaled[i] < 1.0) {
+			small.push_back(static_cast<uint32_t>(i));
+		}
+		else {
+			large.push_back(static_cast<uint32_t>(i));
+		}
+	}
+
+	while (!small.empty() && !large.empty()) {
+		const uint32_t s = small.back();
+		small.pop_back();
+		const uint32_t l = large.back();
+
+		prob[first + s] = static_cast<float>(scaled[s]);
+		alias[first + s] = first + l;
+
+		scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+		if (scaled[l] < 1.0) {
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+
+	// Whatever is left over is (up to rounding errors) exactly full
+	for (const uint32_t i : large) {
+		prob[first + i] = 1.0f;
+	}
+	for (const uint32_t i : small) {
+		prob[first + i] = 1.0f;
+	}
+}
+
+void AliasTable::update_total() {
+	total = 0.0f;
+	for (const Segment& segment : segments) {
+		total += segment.weight;
+	}
+}
+
+void AliasTable::push_back(const float weight) {
+	if (segments.empty() || segments.back().aliased) {
+		segments.push_back({ static_cast<uint32_t>(weights.size()), 0, 0.0f, false });
+	}
+
+	weights.push_back(weight);
+	prob.push_back(1.0f);
+	alias.push_back(static_cast<uint32_t>(weights.size() - 1));
+
+	Segment& tail = segments.back();
+	tail.count++;
+	tail.weight += weight;
+	if (tail.count > MAX_TAIL) {
+		// Sealing the list adds an aliased segment, merge them all like append does
+		if (segments.size() > MAX_SEGMENTS) {
+			rebuild();
+			return;
+		}
+		build_segment(tail);
+	}
+	update_total();
+}
+
+void AliasTable::append(std::span<const float> w) {
+	if (w.size() <= MAX_TAIL) {
+		for (const float weight : w) {
+			push_back(weight);
+		}
+		return;
+	}
+
+	const uint32_t first = static_cast<uint32_t>(weights.size());
+	weights.insert(weights.end(), w.begin(), w.end());
+	prob.resize(weights.size());
+	alias.resize(weights.size());
+
+	if (segments.size() >= MAX_SEGMENTS) {
+		rebuild();
+		return;
+	}
+	segments.push_back({ first, static_cast<uint32_t>(w.size()), 0.0f, true });
+	build_segment(segments.back());
+	update_total();
+}
+
+void AliasTable::erase(const size_t first, const size_t count) {
+	if (count == 0 || first + count > weights.size()) return;
+	const size_t end = first + count;
+
+	// The entries have to cover whole segments, or be the end of the list at the back
+	size_t begin_segment = 0;
+	while (begin_segment < segments.size() && segments[begin_segment].first + segments[begin_segment].count <= first) {
+		begin_segment++;
+	}
+	size_t end_segment = begin_segment;
+	while (end_segment < segments.size() && segments[end_segment].first < end) {
+		end_segment++;
+	}
+
+	const bool whole_segments = begin_segment < segments.size() && segments[begin_segment].first == first &&
+		segments[end_segment - 1].first + segments[end_segment - 1].count == end;
+	const bool end_of_tail = end == weights.size() && !segments[begin_segment].aliased &&
+		begin_segment + 1 == segments.size();
+
+	weights.erase(weights.begin() + first, weights.begin() + end);
+	prob.erase(prob.begin() + first, prob.begin() + end);
+	alias.erase(alias.begin() + first, alias.begin() + end);
+
+	if (whole_segments) {
+		segments.erase(segments.begin() + begin_segment, segments.begin() + end_segment);
+		for (size_t s = begin_segment; s < segments.size(); s++) {
+			Segment& segment = segments[s];
+			segment.first -= static_cast<uint32_t>(count);
+			for (uint32_t i = segment.first; i < segment.first + segment.count; i++) {
+				alias[i] -= static_cast<uint32_t>(count);
+			}
+		}
+	}
+	else if (end_of_tail) {
+		Segment& tail = segments.back();
+		tail.count -= static_cast<uint32_t>(count);
+		tail.weight = 0.0f;
+		for (uint32_t i = tail.first; i < tail.first + tail.count; i++) {
+			tail.weight += weights[i];
+		}
+		if (tail.count == 0) {
+			segments.pop_back();
+		}
+	}
+	else {
+		rebuild();
+		return;
+	}
+	update_total();
+}
+
+void AliasTable::clear() {
+	weights.clear();
+	prob.clear();
+	alias.clear();
+	segments.clear();
+	total = 0.0f;
+}
+
+uint32_t AliasTable::sample(const float u1, const float u2) const {
+	const size_t n = weights.size();
+
+	if (total <= 0.0f) {
+		return static_cast<uint32_t>(std::min(static_cast<size_t>(u1 * n), n - 1));
+	}
+
+	// Pick a segment, u1 is scaled back to [0, 1) inside it
+	float target = u1 * total;
+	size_t s = 0;
+	for (size_t k = 0; k < segments.size(); k++) {
+		if (segments[k].weight <= 0.0f) {
+			continue;
+		}
+		s = k;
+		if (target < segments[k].weight) {
+			break;
+		}
+		target -= segments[k].weight;
+	}
+	const Segment& segment = segments[s];
+
+	if (segment.aliased) {
+		const float u = std::clamp(target / segment.weight, 0.0f, 1.0f);
+		const size_t bucket = segment.first + std::min(static_cast<size_t>(u * segment.count), static_cast<size_t>(segment.count - 1));
+		return u2 < prob[bucket] ? static_cast<uint32_t>(bucket) : alias[bucket];
+	}
+
+	// Search the list
+	float remaining = u2 * segment.weight;
+	for (uint32_t i = segment.first; i < segment.first + segment.count; i++) {
+		remaining -= weights[i];
+		if (remaining < 0.0f) {
+			return i;
+		}
+	}
+	return segment.first + segment.count - 1;
+}
+
+float AliasTable::pdf(const uint32_t i) const {
+	if (total <= 0.0f) {
+		return 1.0f / static_cast<float>(weights.size());
+	}
+
+	return weights[i] / total;
+}
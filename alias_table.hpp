@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vector>
+#include <span>
+#include <cstdint>
+
+// Walker/Vose alias table for O(1) sampling of a discrete distribution.
+//
+// The entries are split into consecutive segments that are sampled on their own: a segment is picked
+// proportional to its weight by a linear search, then an entry inside it. A segment is either an alias
+// table or, for a few entries pushed one by one, a short list that is searched linearly. Appending a
+// range of weights adds an alias table for just that range, and erasing exactly a segment (or entries
+// of the list at the end) only moves the entries after it, so editing the distribution does not
+// require an O(n) rebuild. The list is turned into an alias table once it grows past MAX_TAIL entries.
+class AliasTable {
+public:
+    AliasTable() = default;
+    explicit AliasTable(std::span<const float> weights);
+
+    void build(std::span<const float> weights);
+
+    void push_back(const float weight);
+    // Add the weights as a segment of their own
+    void append(std::span<const float> weights);
+    // Remove the entries [first, first + count), the ones after them move down by count
+    void erase(const size_t first, const size_t count);
+    void clear();
+
+    // Sample an index using two uniform numbers in [0, 1)
+    [[nodiscard]] uint32_t sample(const float u1, const float u2) const;
+
+    // Probability of sampling index i
+    [[nodiscard]] float pdf(const uint32_t i) const;
+
+    inline size_t size() const {
+        return weights.size();
+    }
+
+    inline bool empty() const {
+        return weights.empty();
+    }
+
+    inline float total_weight() const {
+        return total;
+    }
+
+private:
+    static constexpr size_t MAX_TAIL = 256;
+    static constexpr size_t MAX_SEGMENTS = 32; // Beyond this, everything is merged into a single alias table
+
+    struct Segment {
+        uint32_t first;
+        uint32_t count;
+        float weight;
+        bool aliased; // Alias table, otherwise a list searched linearly
+    };
+
+    std::vector<float> weights;  // Weight of every entry
+    std::vector<float> prob;     // Probability of keeping the bucket, per entry of an aliased segment
+    std::vector<uint32_t> alias; // Alias of the bucket (an index into weights), per entry of an aliased segment
+    std::vector<Segment> segments;
+
+    float total = 0.0f;
+
+    // Build the alias table of the segment over its entries
+    void build_segment(Segment& segment);
+    void update_total();
+    void rebuild();
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+constexpr std::size_t CACHE_LINE_SIZE = 64;
+
+// Allocator that places the start of every allocation on an Alignment-byte boundary,
+// so flat arrays start on a cache line and can be loaded with aligned SIMD loads.
+template <typename T, std::size_t Alignment = CACHE_LINE_SIZE>
+struct AlignedAllocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() noexcept = default;
+
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) noexcept {}
+
+    T* allocate(const std::size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+    }
+
+    void deallocate(T* p, const std::size_t) noexcept {
+        ::operator delete(p, std::align_val_t(Alignment));
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const noexcept { return true; }
+
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const noexcept { return false; }
+};
+
+template <typename T>
+using aligned_vector = std::vector<T, AlignedAllocator<T>>;
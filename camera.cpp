@@ -5,6 +5,9 @@
 #include <vector>
 #include <string>
 #include <fstream>
+#include <array>
+#include <span>
+#include <algorithm>
 
 #include "ray.hpp"
 #include "material.hpp"
@@ -105,72 +108,113 @@ void Camera::updateDirection() {
 	forward = direction;
 }
 
-std::vector<std::vector<Ray>> Camera::generate_rays_for_frame() {
-	std::vector<std::vector<Ray>> rays(image_height, std::vector<Ray>(image_width));
+Ray Camera::generate_ray(const int i, const int j) const {
+	const float halfWidth = float(image_width) * 0.5f;
+	const float halfHeight = float(image_height) * 0.5f;
 
-	float halfWidth = float(image_width) * 0.5f;
-	float halfHeight = float(image_height) * 0.5f;
+	const float scaleX = tan(fov / 2) * focal_length;
+	const float scaleY = scaleX / aspect_ratio;
 
-	float scaleX = tan(fov / 2) * focal_length;
-	float scaleY = scaleX / aspect_ratio;
+	// Centered pixel coordinates in [–1, +1]
+	const float ndc_x = (j - halfWidth) / halfWidth;
+	const float ndc_y = (i - halfHeight) / halfHeight;
 
+	const glm::vec3 ray_dir =
+		direction + ndc_x * scaleX * right + ndc_y * scaleY * up;
 
-#pragma omp parallel for
-	// (0, 0) = top_right; first one is height second one is width;
-	for (int i = 0; i < image_height; i++) {
-		for (int j = 0; j < image_width; j++) {
-
-			// Centered pixel coordinates in [–1, +1]
-			float ndc_x = (j - halfWidth) / halfWidth;
-			float ndc_y = (i - halfHeight) / halfHeight;
-
-			glm::vec3 ray_dir =
-				direction + ndc_x * scaleX * right + ndc_y * scaleY * up;
-
-			rays[i][j] = Ray(position, glm::normalize(ray_dir));
-		}
-	}
-
-	return rays;
+	return Ray(position, glm::normalize(ray_dir));
 }
 
-std::vector<HitInfo> Camera::calculate_hit_info(World& world) {
-	std::vector<HitInfo> hit_infos(image_height * image_width);
-	auto rays = generate_rays_for_frame();
-
-#pragma omp parallel for
-	for (int i = 0; i < image_height; i++) {
-		for (int j = 0; j < image_width; j++) {
-			Ray ray = rays[i][j];
-			HitInfo hit;
-			if (world.intersect(ray, hit)) {
-				hit_infos[i * image_width + j] = hit;
+void Camera::trace_gbuffer_tile(World& world, const Tile& tile) {
+	// Larger tiles are split up, one batch holds TRACE_TILE_SIZE x TRACE_TILE_SIZE rays
+	constexpr int TILE = TRACE_TILE_SIZE;
+	for (int ti = tile.y0; ti < tile.y1; ti += TILE) {
+		for (int tj = tile.x0; tj < tile.x1; tj += TILE) {
+			const int i1 = std::min(ti + TILE, tile.y1);
+			const int j1 = std::min(tj + TILE, tile.x1);
+
+			std::array<Ray, TILE * TILE> rays;
+			std::array<HitInfo, TILE * TILE> hits;
+			int count = 0;
+			for (int i = ti; i < i1; i++) {
+				for (int j = tj; j < j1; j++) {
+					rays[count++] = generate_ray(i, j);
+				}
 			}
-			else {
-				hit.r = ray;
-				hit.t = 1E30f;
-				hit_infos[i * image_width + j] = hit;
+
+			world.intersect(std::span<const Ray>(rays.data(), count), std::span<HitInfo>(hits.data(), count));
+
+			int k = 0;
+			for (int i = ti; i < i1; i++) {
+				for (int j = tj; j < j1; j++, k++) {
+					if (hits[k].prim != INVALID_PRIM) {
+						gbuffer.store(i * image_width + j, hits[k]);
+					}
+					else {
+						gbuffer.store_miss(i * image_width + j, rays[k]);
+					}
+				}
 			}
 		}
 	}
-
-	return hit_infos;
 }
 
-std::vector<HitInfo> Camera::get_hit_info_from_camera_per_frame(World& world) {
+bool Camera::begin_gbuffer(World& world) {
+	if (last_pos == position &&
+		last_right == right &&
+		last_up == up &&
+		last_forward == forward &&
+		gbuffer.get_width() == image_width &&
+		gbuffer.get_height() == image_height &&
+		last_geometry_version == world.get_geometry_version()) {
+		retraced = false;
+		return false;
+	}
 
-	if (last_pos != position ||
-		last_right != right ||
-		last_up != up ||
-		last_forward != forward)  {
+	last_pos = position;
+	last_right = right;
+	last_up = up;
+	last_forward = forward;
+	last_geometry_version = world.get_geometry_version();
+
+	retraced = true;
+	previous_view_projection = traced_view_projection;
+	traced_view_projection = view_projection();
+	std::swap(gbuffer, previous_gbuffer);
+
+	gbuffer.resize(image_width, image_height);
+	gbuffer.origin = position;
+	gbuffer.mesh = &world.mesh;
+	gbuffer.materials = world.get_material_table();
+	return true;
+}
 
-		last_pos = position;
-		last_right = right;
-		last_up = up;
-		last_forward = forward;
-		
-		hit_infos = calculate_hit_info(world);
+glm::mat4 Camera::view_projection() const {
+	const float scaleX = tan(fov / 2) * focal_length;
+	const float scaleY = scaleX / aspect_ratio;
+
+	// generate_ray sends pixel ndc (x, y) along direction + x * scaleX * right + y * scaleY * up
+	const glm::vec3 x_axis = right / scaleX;
+	const glm::vec3 y_axis = up / scaleY;
+
+	// glm matrices are indexed [column][row]
+	glm::mat4 m(0.0f);
+	for (int c = 0; c < 3; c++) {
+		m[c][0] = x_axis[c];
+		m[c][1] = y_axis[c];
+		m[c][2] = direction[c];
+		m[c][3] = direction[c];
 	}
+	m[3][0] = -glm::dot(x_axis, position);
+	m[3][1] = -glm::dot(y_axis, position);
+	m[3][2] = -glm::dot(direction, position);
+	m[3][3] = -glm::dot(direction, position);
+	return m;
+}
 
-	return hit_infos;
-}
\ No newline at end of file
+Reprojection Camera::get_reprojection() const {
+	if (!retraced) {
+		return Reprojection();
+	}
+	return Reprojection{ previous_view_projection, &previous_gbuffer };
+}
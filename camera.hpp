@@ -8,9 +8,11 @@
 #include "ray.hpp"
 #include "material.hpp"
 #include "hit_info.hpp"
+#include "gbuffer.hpp"
 #include "restir.hpp"
 #include "world.hpp"
 #include "constants.hpp"
+#include "tile_scheduler.hpp"
 
 
 tinybvh::Ray toBVHRay(const Ray& r);
@@ -47,18 +49,36 @@ public:
     int image_height = (int(image_width / aspect_ratio) < 1) ? 1 : int(image_width / aspect_ratio); // Rendered image height in pixel count
     const float fov = glm::radians(75.0f); // horizontal fov
 
-    std::vector<std::vector<Ray>> generate_rays_for_frame();
+    // Primary ray through pixel (i, j), i is the row
+    Ray generate_ray(const int i, const int j) const;
 
-    std::vector<HitInfo> get_hit_info_from_camera_per_frame(World& world);
+    // Primary hits for the current camera pose, only traced again when the camera or the geometry moved. If
+    // begin_gbuffer returns true the primary hits are out of date and trace_gbuffer_tile has to be called for a
+    // tile by the render scheduler before its part of the G-buffer is read.
+    bool begin_gbuffer(World& world);
+    void trace_gbuffer_tile(World& world, const Tile& tile);
+
+    inline const GBuffer& get_gbuffer() const {
+        return gbuffer;
+    }
+
+    // World to clip space of the current pose, x / w and y / w are the ndc generate_ray starts from
+    glm::mat4 view_projection() const;
+
+    // Where the hits of the current G-buffer were seen by the one traced before it
+    Reprojection get_reprojection() const;
 
     void save_to_file(std::string filename);
 	void load_from_file(std::string filename);
 
 private:
-    std::vector<HitInfo> hit_infos;
+    GBuffer gbuffer;
+    GBuffer previous_gbuffer; // Kept for reprojection when the G-buffer is traced again
+    glm::mat4 traced_view_projection = glm::mat4(1.0f);
+    glm::mat4 previous_view_projection = glm::mat4(1.0f);
+    bool retraced = false; // Whether the last begin_gbuffer call traced a new G-buffer
 
     glm::vec3 last_pos;
 	glm::vec3 last_right, last_up, last_forward;
-
-    std::vector<HitInfo> calculate_hit_info(World& world);
+    uint64_t last_geometry_version = UINT64_MAX;
 };
\ No newline at end of file
@@ -8,12 +8,22 @@ constexpr auto N_PHOTONS = 100000;
 constexpr auto N_INDIRECT_PHOTONS = 100000;
 constexpr auto MAX_BOUNCES = 8;
 constexpr auto MIN_BOUNCES = 0;
+constexpr auto WAVEFRONT_PHOTONS = true; // Trace the GI photons a bounce at a time in batches instead of one by one
+constexpr auto PHOTON_BATCH_SIZE = 2048; // Photons in flight per thread in wavefront mode, tune for the L2 size
+constexpr auto PHOTON_BLOCK_SIZE = 8192; // GI VPLs traced as one unit of parallel work, fixed so the VPLs do not depend on the thread count
+constexpr auto MAX_PHOTONS_PER_VPL = 16; // Photon tracing gives up once this many photons per wanted VPL left without one
+constexpr auto SPAWNED_LIGHT_VPLS = 4096; // GI VPLs traced from every point light spawned at runtime, or photons emitted from it into the photon map
+constexpr auto N_MAP_PHOTONS = 200000; // Photons emitted into the photon map, see PhotonMap
+constexpr auto PHOTON_MAP_K = 64; // Nearest photons the irradiance at every photon of the photon map is estimated from
+constexpr auto PHOTON_LOOKUP_K = 8; // Nearest photons a pixel averages the irradiance of, if they are on a surface like its own
 
 constexpr auto M_CAP = 20.0f;
 constexpr auto NORMAL_DEVIATION = 0.4f;
 constexpr auto T_DEVIATION = 0.05f;
-constexpr auto NEIGHBOUR_K = 8;
-constexpr auto NEIGHBOUR_RADIUS = 20; // pixels
+constexpr auto REPROJECTION_DEPTH_TOLERANCE = 0.1f; // Largest relative depth difference of a reprojected pixel
+constexpr auto MAX_NEIGHBOUR_K = 8; // Most neighbours a spatial reuse iteration can take, see SPATIAL_ITERATIONS
+constexpr auto LIGHTCUT_MAX_SIZE = 32; // Most clusters a lightcut is refined into
+constexpr auto LIGHTCUT_ERROR = 0.02f; // Clusters with an error bound above this fraction of the total are refined
 
 constexpr auto ASPECT_RATIO = 16.0 / 9.0f;
 constexpr auto LIVE_WIDTH = 400;
@@ -26,7 +36,15 @@ constexpr float SPHERE_R = 0.025f;
 
 constexpr int MAX_RAY_DEPTH = 8;
 
+constexpr auto ENABLE_BVH_CACHE = true;
+constexpr auto BVH_CACHE_DIR = "bvh_cache"; // BVHs are stored here, keyed by a hash of the scene
+constexpr auto SCENE_CACHE_DIR = "scene_cache"; // Compiled scenes, see World::load_scene
+constexpr auto ENABLE_WIDE_BVH = true; // Trace with a 4 or 8 wide BVH when the CPU supports it
+constexpr auto TRACE_TILE_SIZE = 8; // Primary rays are traced in square tiles of this many pixels
+constexpr auto RENDER_TILE_SIZE = 16; // The frame is rendered in square tiles of this many pixels, see TileScheduler
+
 extern bool DISABLE_GI;
+extern bool PHOTON_MAP_GI; // Indirect light from the photon map instead of VPLs, see PhotonMap
 
 //#define INTERPOLATE_NORMALS
 #define PL_ATTENUATION
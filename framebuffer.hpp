@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <algorithm>
+#include <numeric>
+
+#include "aligned_allocator.hpp"
+
+// Image stored in a single allocation, row after row. Every row starts on a cache line, so rows
+// are pitch() elements apart rather than width(). A framebuffer is meant to live across frames:
+// resize only reallocates when the size changes.
+template <typename T>
+class Framebuffer {
+public:
+    Framebuffer() = default;
+
+    Framebuffer(const int width, const int height) {
+        resize(width, height);
+    }
+
+    Framebuffer(const int width, const int height, const T& value) {
+        resize(width, height);
+        fill(value);
+    }
+
+    // Returns true if the storage was reallocated, the contents are unspecified then
+    bool resize(const int width, const int height) {
+        if (width == w && height == h) {
+            return false;
+        }
+        w = width;
+        h = height;
+        p = pitch_for(width);
+        pixels.assign(static_cast<size_t>(p) * height, T());
+        return true;
+    }
+
+    void fill(const T& value) {
+        std::fill(pixels.begin(), pixels.end(), value);
+    }
+
+    inline int width() const {
+        return w;
+    }
+
+    inline int height() const {
+        return h;
+    }
+
+    // Distance between the starts of two rows, in elements
+    inline int pitch() const {
+        return p;
+    }
+
+    inline bool empty() const {
+        return w == 0 || h == 0;
+    }
+
+    inline T* row(const int y) {
+        return pixels.data() + static_cast<size_t>(y) * p;
+    }
+
+    inline const T* row(const int y) const {
+        return pixels.data() + static_cast<size_t>(y) * p;
+    }
+
+    inline T& operator()(const int x, const int y) {
+        return row(y)[x];
+    }
+
+    inline const T& operator()(const int x, const int y) const {
+        return row(y)[x];
+    }
+
+private:
+    aligned_vector<T> pixels;
+    int w = 0;
+    int h = 0;
+    int p = 0;
+
+    // Round a row up to the fewest elements that fill whole cache lines, e.g. 16 for a 12 byte glm::vec3
+    static int pitch_for(const int width) {
+        constexpr int step = static_cast<int>(CACHE_LINE_SIZE / std::gcd(CACHE_LINE_SIZE, sizeof(T)));
+        return (width + step - 1) / step * step;
+    }
+};
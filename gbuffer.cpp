@@ -0,0 +1,106 @@
+#include "gbuffer.hpp"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+#include <cmath>
+
+static glm::vec2 oct_wrap(const glm::vec2& v) {
+	const glm::vec2 sign(v.x >= 0.0f ? 1.0f : -1.0f, v.y >= 0.0f ? 1.0f : -1.0f);
+	return (1.0f - glm::abs(glm::vec2(v.y, v.x))) * sign;
+}
+
+uint32_t encode_oct(const glm::vec3& n) {
+	const float l1 = fabs(n.x) + fabs(n.y) + fabs(n.z);
+	if (l1 <= 0.0f) {
+		return glm::packSnorm2x16(glm::vec2(0.0f));
+	}
+
+	glm::vec2 p = glm::vec2(n.x, n.y) / l1;
+	if (n.z < 0.0f) {
+		p = oct_wrap(p);
+	}
+	return glm::packSnorm2x16(p);
+}
+
+glm::vec3 decode_oct(const uint32_t packed) {
+	const glm::vec2 p = glm::unpackSnorm2x16(packed);
+	glm::vec3 n(p.x, p.y, 1.0f - fabs(p.x) - fabs(p.y));
+	if (n.z < 0.0f) {
+		const glm::vec2 xy = oct_wrap(glm::vec2(n.x, n.y));
+		n.x = xy.x;
+		n.y = xy.y;
+	}
+	return glm::normalize(n);
+}
+
+void GBuffer::resize(const int width, const int height) {
+	this->width = width;
+	this->height = height;
+
+	const size_t n = static_cast<size_t>(width) * height;
+	position.resize(n);
+	normal.resize(n);
+	depth.resize(n);
+	prim.resize(n);
+	instance.resize(n);
+	material_id.resize(n);
+	barycentrics.resize(n);
+}
+
+void GBuffer::store(const size_t i, const HitInfo& hit) {
+	position[i] = hit.r.at(hit.t);
+	normal[i] = encode_oct(hit.normal());
+	depth[i] = hit.t;
+	prim[i] = hit.prim;
+	instance[i] = hit.instance;
+	material_id[i] = hit.mesh->material_ids[hit.prim];
+	barycentrics[i] = hit.uv;
+}
+
+void GBuffer::store_miss(const size_t i, const Ray& ray) {
+	position[i] = ray.at(1.0f);
+	normal[i] = encode_oct(glm::vec3(0.0f));
+	depth[i] = NO_HIT;
+	prim[i] = INVALID_PRIM;
+	instance[i] = INVALID_INSTANCE;
+	material_id[i] = -1;
+	barycentrics[i] = glm::vec2(0.0f);
+}
+
+HitInfo GBuffer::hit(const size_t i) const {
+	HitInfo hit;
+	const glm::vec3 to_point = position[i] - origin;
+
+	if (!is_hit(i)) {
+		hit.r = Ray(origin, glm::normalize(to_point));
+		hit.t = NO_HIT;
+		hit.uv = glm::vec2(0.0f);
+		return hit;
+	}
+
+	hit.r = Ray(origin, to_point / depth[i]);
+	hit.t = depth[i];
+	hit.uv = barycentrics[i];
+	hit.prim = prim[i];
+	hit.instance = instance[i];
+	hit.mesh = mesh;
+	hit.material = materials[material_id[i]];
+	return hit;
+}
+
+int Reprojection::pixel(const glm::vec3& p) const {
+	const glm::vec4 clip = view_projection * glm::vec4(p, 1.0f);
+	if (clip.w <= 0.0f) {
+		return -1;
+	}
+
+	// Inverse of the pixel to ndc mapping of Camera::generate_ray, rounded to the nearest pixel
+	const int width = gbuffer->get_width();
+	const int height = gbuffer->get_height();
+	const float j = clip.x / clip.w * (float(width) * 0.5f) + float(width) * 0.5f + 0.5f;
+	const float i = clip.y / clip.w * (float(height) * 0.5f) + float(height) * 0.5f + 0.5f;
+	if (!(j >= 0.0f && j < float(width) && i >= 0.0f && i < float(height))) {
+		return -1;
+	}
+	return static_cast<int>(i) * width + static_cast<int>(j);
+}
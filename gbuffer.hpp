@@ -0,0 +1,81 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <span>
+#include <cstdint>
+
+#include "aligned_allocator.hpp"
+#include "hit_info.hpp"
+#include "mesh.hpp"
+#include "ray.hpp"
+
+struct Material;
+
+constexpr float NO_HIT = 1E30f;
+
+// Octahedral encoding of a unit vector into two 16 bit snorms
+uint32_t encode_oct(const glm::vec3& n);
+glm::vec3 decode_oct(const uint32_t packed);
+
+// Primary hits of a frame as structure of arrays, one entry per pixel (row-major).
+// All camera rays start at origin, so the ray of a pixel is recovered from its position.
+class GBuffer {
+public:
+    aligned_vector<glm::vec3> position;     // Hit point, or a point one unit along the ray for misses
+    aligned_vector<uint32_t> normal;        // Oct-encoded shading normal
+    aligned_vector<float> depth;            // Distance along the ray, NO_HIT for misses
+    aligned_vector<uint32_t> prim;
+    aligned_vector<uint32_t> instance;
+    aligned_vector<int32_t> material_id;
+    aligned_vector<glm::vec2> barycentrics;
+
+    glm::vec3 origin = glm::vec3(0.0f);
+    const Mesh* mesh = nullptr;
+    std::span<const Material* const> materials;
+
+    void resize(const int width, const int height);
+
+    inline size_t size() const {
+        return depth.size();
+    }
+
+    inline int get_width() const {
+        return width;
+    }
+
+    inline int get_height() const {
+        return height;
+    }
+
+    void store(const size_t i, const HitInfo& hit);
+    void store_miss(const size_t i, const Ray& ray);
+
+    inline bool is_hit(const size_t i) const {
+        return depth[i] != NO_HIT;
+    }
+
+    inline glm::vec3 get_normal(const size_t i) const {
+        return decode_oct(normal[i]);
+    }
+
+    inline const Material* material(const size_t i) const {
+        return is_hit(i) ? materials[material_id[i]] : nullptr;
+    }
+
+    // Rebuild the full hit record of a pixel for the shading code
+    HitInfo hit(const size_t i) const;
+
+private:
+    int width = 0;
+    int height = 0;
+};
+
+// Maps points of the current frame to the pixel that saw them in an earlier frame, so reservoirs can be
+// reused when the camera moves. Without a G-buffer the camera did not move and every pixel maps to itself.
+struct Reprojection {
+    glm::mat4 view_projection = glm::mat4(1.0f); // World to clip space of the earlier camera
+    const GBuffer* gbuffer = nullptr;            // Primary hits of the earlier frame
+
+    // Pixel of the earlier frame the point projects to, -1 if it is behind the camera or off screen
+    int pixel(const glm::vec3& p) const;
+};
@@ -7,12 +7,17 @@
 #endif
 #include "constants.hpp"
 
-glm::vec3 Triangle::calculateNormal() {
-	_normal = glm::normalize(glm::cross(v1.position - v0.position, v2.position - v0.position));
-	if (glm::dot(_normal, v0.normal) < 0.0f) {
-		_normal = -_normal;
+glm::vec3 face_normal(const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, const glm::vec3& n0) {
+	glm::vec3 n = glm::normalize(glm::cross(p1 - p0, p2 - p0));
+	if (glm::dot(n, n0) < 0.0f) {
+		n = -n;
 	}
 
+	return n;
+}
+
+glm::vec3 Triangle::calculateNormal() {
+	_normal = face_normal(v0.position, v1.position, v2.position, v0.normal);
 	return _normal;
 }
 
@@ -24,6 +24,9 @@ inline Vertex operator*(const float m, const Vertex& v) {
 	return v * m;
 }
 
+// Geometric normal of a triangle, flipped to the side of the normal n0 of its first vertex
+glm::vec3 face_normal(const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, const glm::vec3& n0);
+
 struct Triangle {
 	Vertex v0, v1, v2;
 	int material_id;
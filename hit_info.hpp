@@ -1,17 +1,27 @@
 #pragma once
 
 #include <glm/glm.hpp>
-#include <memory>
 
 #include "ray.hpp"
-#include "geometry.hpp"
+#include "mesh.hpp"
 
 struct Material;
 
+// Only the primitive and instance index are stored, the surface is looked up in the mesh when needed
 struct alignas(64) HitInfo {
-    Triangle triangle;
     Ray r;
     glm::vec2 uv;
     float t;
-    std::weak_ptr<Material> mat_ptr;
+    uint32_t prim = INVALID_PRIM;
+    uint32_t instance = INVALID_INSTANCE;
+    const Mesh* mesh = nullptr;
+    const Material* material = nullptr;
+
+    inline glm::vec3 normal() const {
+        return mesh ? mesh->normal(instance, prim, uv) : glm::vec3(0.0f);
+    }
+
+    inline glm::vec2 texcoord() const {
+        return mesh ? mesh->texcoord(prim, uv) : glm::vec2(0.0f);
+    }
 };
\ No newline at end of file
@@ -19,14 +19,14 @@ glm::vec3 to_srgb(const glm::vec3& color) {
     };
 }
 
-void save_png(const std::vector<std::vector<glm::vec3>>& pixels, const std::string& filename) {
-    int height = pixels.size();
-    int width = pixels[0].size();
+void save_png(const Framebuffer<glm::vec3>& pixels, const std::string& filename) {
+    int height = pixels.height();
+    int width = pixels.width();
     std::vector<unsigned char> data(width * height * 3);
 
     for (int y = 0; y < height; ++y) {
         for (int x = 0; x < width; ++x) {
-            glm::vec3 color = clamp(pixels[y][x], 0.0f, 1.0f);  // Clamp to [0,1]
+            glm::vec3 color = clamp(pixels(x, y), 0.0f, 1.0f);  // Clamp to [0,1]
             color = to_srgb(color); // Convert to sRGB
             int index = ((height - 1 - y) * width + x) * 3; // Flip vertically
             data[index + 0] = static_cast<unsigned char>(color.r * 255.0f);
@@ -47,15 +47,15 @@ void save_png(const std::vector<std::vector<glm::vec3>>& pixels, const std::stri
 
 
 
-void save_pfm(const std::vector<std::vector<glm::vec3>>& pixels, const std::string& file_path) {
+void save_pfm(const Framebuffer<glm::vec3>& pixels, const std::string& file_path) {
     std::ofstream file(file_path, std::ios::binary);
     if (!file) {
         printf("Failed to open %s for writing. Please check path and permissions.\n", file_path.c_str());
         return;
     }
 
-    int height = pixels.size();
-    int width = height > 0 ? pixels[0].size() : 0;
+    int height = pixels.height();
+    int width = pixels.width();
 
 
 
@@ -64,13 +64,9 @@ void save_pfm(const std::vector<std::vector<glm::vec3>>& pixels, const std::stri
             << width << " " << height << "\n"
             <<"-1.0\n";
 
+    // glm::vec3 is three tightly packed floats, so every row is written at once
     for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            const glm::vec3& pixel = pixels[y][x];
-            file.write(reinterpret_cast<const char*>(&pixel.r), sizeof(float));
-            file.write(reinterpret_cast<const char*>(&pixel.g), sizeof(float));
-            file.write(reinterpret_cast<const char*>(&pixel.b), sizeof(float));
-        }
+        file.write(reinterpret_cast<const char*>(pixels.row(y)), static_cast<std::streamsize>(width * sizeof(glm::vec3)));
     }
 
     file.close();
@@ -4,7 +4,9 @@
 #include <glm/glm.hpp>
 #include <string>
 
-void save_png(const std::vector<std::vector<glm::vec3>>& pixels, const std::string& filename);
+#include "framebuffer.hpp"
 
-void save_pfm(const std::vector<std::vector<glm::vec3>>& pixels, const std::string& file_path);
+void save_png(const Framebuffer<glm::vec3>& pixels, const std::string& filename);
+
+void save_pfm(const Framebuffer<glm::vec3>& pixels, const std::string& file_path);
 
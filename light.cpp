@@ -5,7 +5,6 @@
 #ifndef TINY_BVH_H_
 #include "lib/tiny_bvh.h"
 #endif
-#include <random>
 #include <glm/gtc/constants.hpp>
 
 #include "tiny_bvh_types.hpp"
@@ -14,36 +13,44 @@
 
 Light::Light(const glm::vec3 c, const float intensity) : c(c), intensity(intensity) {}
 
-PointLight::PointLight(const glm::vec3 c, const float intensity, const glm::vec3 position, const glm::vec3 normal)
-    : Light(c, intensity), position(position), _normal(normal) {
+uint32_t LightTable::push_back(const glm::vec3& p, const glm::vec3& n, const glm::vec3& c, const float intensity, const float a) {
     if (any(glm::isnan(c)) || any(glm::isinf(c))) {
 		std::cerr << "Error: PointLight color is NaN or Inf!" << std::endl;
     }
-}
-
-PointLight::PointLight(const glm::vec3 c, const glm::vec3 position, const glm::vec3 normal)
-    : Light(c, 1.0f), position(position), _normal(normal) {
-}
 
-float PointLight::area() const {
-    return 1.0f;
+    position.push_back(p);
+    normal.push_back(n);
+    emission.push_back(c * intensity);
+    area.push_back(a);
+    return static_cast<uint32_t>(position.size() - 1);
 }
 
-glm::vec3 PointLight::normal(const glm::vec2& uv) const {
-    return _normal;
+void LightTable::append(const LightTable& other) {
+    position.insert(position.end(), other.position.begin(), other.position.end());
+    normal.insert(normal.end(), other.normal.begin(), other.normal.end());
+    emission.insert(emission.end(), other.emission.begin(), other.emission.end());
+    area.insert(area.end(), other.area.begin(), other.area.end());
 }
 
-glm::vec3 PointLight::normal(const glm::vec3& light_pos) const {
-    return normal({ 0.0f, 0.0f });
+void LightTable::erase(const size_t first, const size_t count) {
+    position.erase(position.begin() + first, position.begin() + first + count);
+    normal.erase(normal.begin() + first, normal.begin() + first + count);
+    emission.erase(emission.begin() + first, emission.begin() + first + count);
+    area.erase(area.begin() + first, area.begin() + first + count);
 }
 
-glm::vec3 PointLight::sample_on_light(float& pdf) const {
-	pdf = 1.0f; // PDF for point light is uniform
-    return position; // Sample the position of the point light
+void LightTable::clear() {
+    position.clear();
+    normal.clear();
+    emission.clear();
+    area.clear();
 }
 
-glm::vec3 PointLight::sample_direction(const glm::vec3& p, float& pdf) const {
-    return cosine_weighted_hemisphere_sample(_normal, pdf);
+void LightTable::reserve(const size_t n) {
+    position.reserve(n);
+    normal.reserve(n);
+    emission.reserve(n);
+    area.reserve(n);
 }
 
 TriangularLight::TriangularLight(const glm::vec3 v0, const glm::vec3 v1, const glm::vec3 v2, const glm::vec3 c, const float intensity)
@@ -72,22 +79,20 @@ glm::vec3 TriangularLight::normal(const glm::vec3& light_pos) const {
     return normal;
 }
 
-glm::vec3 TriangularLight::sample_on_light(float& pdf) const {
+glm::vec3 TriangularLight::sample_on_light(const glm::vec2& u, float& pdf) const {
     // Sample a random point on the triangle
-    float r1 = float(rand()) / RAND_MAX;
-    float r2 = float(rand()) / RAND_MAX;
-    float sqrt_r1 = std::sqrt(r1);
-    float u = 1 - sqrt_r1;
-    float v = r2 * sqrt_r1;
+    float sqrt_r1 = std::sqrt(u.x);
+    float b1 = 1 - sqrt_r1;
+    float b2 = u.y * sqrt_r1;
 
 	pdf = 1.0f / area(); // PDF is uniform over the triangle area
 
-    return (1 - u - v) * triangle.v0.position + u * triangle.v1.position + v * triangle.v2.position;
+    return (1 - b1 - b2) * triangle.v0.position + b1 * triangle.v1.position + b2 * triangle.v2.position;
 }
 
-glm::vec3 TriangularLight::sample_direction(const glm::vec3& p, float& pdf) const {
+glm::vec3 TriangularLight::sample_direction(const glm::vec3& p, const glm::vec2& u, float& pdf) const {
     glm::vec3 normal = triangle.normal();
-    return cosine_weighted_hemisphere_sample(normal, pdf);
+    return cosine_weighted_hemisphere_sample(normal, u, pdf);
 }
 
 inline int add_light_to_triangle_soup(
@@ -111,12 +116,9 @@ static glm::vec3 rotate_vector_around_normal(const glm::vec3& normal, const glm:
            random_dir_local_space.z * bitangent;
 }
 
-thread_local std::mt19937 rng_light(std::random_device{}());
-std::uniform_real_distribution<float> dist_light(0.0f, 1.0f);
-
-glm::vec3 cosine_weighted_hemisphere_sample(const glm::vec3& normal, float& pdf) {
-    float rand_1 = dist_light(rng_light);
-    float rand_2 = dist_light(rng_light);
+glm::vec3 cosine_weighted_hemisphere_sample(const glm::vec3& normal, const glm::vec2& u, float& pdf) {
+    float rand_1 = u.x;
+    float rand_2 = u.y;
 
     float sqrt_rand_2 = sqrtf(rand_2);
     float phi = 2.0f * glm::pi<float>() * rand_1;
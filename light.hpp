@@ -2,12 +2,14 @@
 
 #include <glm/vec3.hpp>
 #include <vector>
+#include <cstdint>
 #ifndef TINY_BVH_H_
 #include "lib/tiny_bvh.h"
 #endif
 
 #include "tiny_bvh_types.hpp"
 #include "geometry.hpp"
+#include "aligned_allocator.hpp"
 
 
 class Light {
@@ -20,24 +22,56 @@ public:
     virtual float area() const = 0;
     virtual glm::vec3 normal(const glm::vec2& uv) const = 0;
     virtual glm::vec3 normal(const glm::vec3& light_pos) const = 0;
-    virtual glm::vec3 sample_on_light(float& pdf) const = 0;
-    virtual glm::vec3 sample_direction(const glm::vec3& point, float& pdf) const = 0;
+    // u is a uniform random point in [0, 1)^2 that the sample is derived from
+    virtual glm::vec3 sample_on_light(const glm::vec2& u, float& pdf) const = 0;
+    virtual glm::vec3 sample_direction(const glm::vec3& point, const glm::vec2& u, float& pdf) const = 0;
 };
 
-class PointLight : public Light {
-public:
-    glm::vec3 position; // Position of the point light
-
-    PointLight(const glm::vec3 c, const float intensity, const glm::vec3 position, const glm::vec3 normal);
-    PointLight(const glm::vec3 c, const glm::vec3 position, const glm::vec3 normal);
+// Sentinel light index for samples that do not refer to a light
+constexpr uint32_t INVALID_LIGHT = UINT32_MAX;
+
+// Flat structure-of-arrays table of point lights (spawned point lights and VPLs).
+// Lights are referred to by their index into the table; every column is a contiguous,
+// cache-line aligned array so the sampler and shading code can stream through it.
+struct LightTable {
+    aligned_vector<glm::vec3> position; // Position of the point light
+    aligned_vector<glm::vec3> normal;   // Normal vector of the point light
+    aligned_vector<glm::vec3> emission; // Color * intensity
+    aligned_vector<float> area;
+
+    inline size_t size() const {
+        return position.size();
+    }
+
+    inline bool empty() const {
+        return position.empty();
+    }
+
+    uint32_t push_back(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& c, const float intensity, const float area = 1.0f);
+    void append(const LightTable& other);
+    // Remove the lights [first, first + count), the ones after them move down by count
+    void erase(const size_t first, const size_t count);
+    void clear();
+    void reserve(const size_t n);
+};
 
-    float area() const override;
-    glm::vec3 normal(const glm::vec2& uv) const override;
-    glm::vec3 normal(const glm::vec3& light_pos) const override;
-    glm::vec3 sample_on_light(float& pdf) const override;
-    glm::vec3 sample_direction(const glm::vec3& point, float& pdf) const override;
-private:
-    glm::vec3 _normal; // Normal vector of the point light
+// How the indices into a LightTable changed when the lights [first, first + count) were erased, so that indices
+// held elsewhere can be patched instead of thrown away. Lights appended to a table keep every index as it is.
+struct LightRemap {
+    uint32_t first = 0;
+    uint32_t count = 0;
+
+    inline bool empty() const {
+        return count == 0;
+    }
+
+    // New index of a light, INVALID_LIGHT if it was erased
+    inline uint32_t operator()(const uint32_t index) const {
+        if (index < first || index == INVALID_LIGHT) {
+            return index;
+        }
+        return index - first < count ? INVALID_LIGHT : index - count;
+    }
 };
 
 class TriangularLight : public Light {
@@ -50,8 +84,8 @@ public:
     float area() const override;
     glm::vec3 normal(const glm::vec2& uv) const override;
     glm::vec3 normal(const glm::vec3& light_pos) const override;
-    glm::vec3 sample_on_light(float& pdf) const override;
-    glm::vec3 sample_direction(const glm::vec3& point, float& pdf) const override;
+    glm::vec3 sample_on_light(const glm::vec2& u, float& pdf) const override;
+    glm::vec3 sample_direction(const glm::vec3& point, const glm::vec2& u, float& pdf) const override;
 
 };
 
@@ -63,6 +97,6 @@ inline int add_light_to_triangle_soup(
     return index_offset;
 }
 
-glm::vec3 cosine_weighted_hemisphere_sample(const glm::vec3& normal, float& pdf);
+glm::vec3 cosine_weighted_hemisphere_sample(const glm::vec3& normal, const glm::vec2& u, float& pdf);
 
 glm::vec2 calculate_uv(const Triangle& triangle, const glm::vec3& point);
\ No newline at end of file
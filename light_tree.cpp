@@ -0,0 +1,515 @@
+#include "light_tree.hpp"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "util.hpp"
+
+#include "constants.hpp"
+
+static void merge_cones(const glm::vec3& axis_a, const float theta_a,
+	const glm::vec3& axis_b, const float theta_b,
+	glm::vec3& axis, float& theta_o) {
+	if (theta_a < theta_b) {
+		merge_cones(axis_b, theta_b, axis_a, theta_a, axis, theta_o);
+		return;
+	}
+
+	const float theta_d = std::acos(glm::clamp(glm::dot(axis_a, axis_b), -1.0f, 1.0f));
+
+	// Cone b already lies inside cone a
+	if (std::min(theta_d + theta_b, glm::pi<float>()) <= theta_a) {
+		axis = axis_a;
+		theta_o = theta_a;
+		return;
+	}
+
+	theta_o = (theta_a + theta_d + theta_b) * 0.5f;
+	if (theta_o >= glm::pi<float>()) {
+		axis = axis_a;
+		theta_o = glm::pi<float>();
+		return;
+	}
+
+	// Rotate axis a towards axis b so the new cone touches both
+	const float theta_r = theta_o - theta_a;
+	const glm::vec3 w = glm::cross(axis_a, axis_b);
+	const float w_len = glm::length(w);
+	if (w_len < 1e-6f) {
+		// Axes are (anti)parallel, any rotation axis works so keep the widest bound
+		axis = axis_a;
+		theta_o = glm::pi<float>();
+		return;
+	}
+	const glm::vec3 k = w / w_len;
+	axis = glm::normalize(axis_a * std::cos(theta_r) + glm::cross(k, axis_a) * std::sin(theta_r));
+}
+
+void LightTree::build(const LightTable& lights) {
+	clear();
+
+	const size_t n = lights.size();
+	if (n == 0) return;
+
+	nodes.resize(2 * n - 1);
+	leaf_of_light.resize(n);
+
+	std::vector<uint32_t> indices(n);
+	for (size_t i = 0; i < n; i++) {
+		indices[i] = static_cast<uint32_t>(i);
+	}
+
+	nodes[0].parent = LightTreeNode::INVALID_NODE;
+	next_node = 1;
+
+	glm::vec3 bounds_min, bounds_max;
+	build_recursive(lights, indices, 0, n, 0, bounds_min, bounds_max);
+}
+
+void LightTree::clear() {
+	nodes.clear();
+	leaf_of_light.clear();
+	grafts.clear();
+	unused_nodes = 0;
+}
+
+void LightTree::append(const LightTable& lights, const size_t first) {
+	const size_t n = lights.size();
+	if (first >= n) return;
+	if (nodes.empty()) {
+		build(lights);
+		return;
+	}
+
+	// Slots for the old root, which moves out of the way for the new one, and for the subtree
+	const size_t count = n - first;
+	const uint32_t old_root = static_cast<uint32_t>(nodes.size());
+	const uint32_t subtree = old_root + 1;
+	nodes.resize(nodes.size() + 2 * count);
+	leaf_of_light.resize(n);
+
+	move_node(0, old_root);
+
+	std::vector<uint32_t> indices(count);
+	for (size_t i = 0; i < count; i++) {
+		indices[i] = static_cast<uint32_t>(first + i);
+	}
+	next_node = subtree + 1;
+	glm::vec3 bounds_min, bounds_max;
+	build_recursive(lights, indices, 0, count, subtree, bounds_min, bounds_max);
+
+	LightTreeNode& root = nodes[0];
+	root.parent = LightTreeNode::INVALID_NODE;
+	root.left = old_root;
+	root.right = subtree;
+	root.light = LightTreeNode::INVALID_NODE;
+	nodes[old_root].parent = 0;
+	nodes[subtree].parent = 0;
+	refit(0);
+
+	grafts.push_back({ static_cast<uint32_t>(first), static_cast<uint32_t>(count), subtree });
+}
+
+void LightTree::erase(const LightTable& lights, const size_t first, const size_t count) {
+	if (count == 0) return;
+
+	size_t g = 0;
+	while (g < grafts.size() && (grafts[g].first != first || grafts[g].count != count)) {
+		g++;
+	}
+	if (g == grafts.size() || unused_nodes + 2 * count > nodes.size() / 2) {
+		build(lights);
+		return;
+	}
+
+	// The sibling of the subtree takes the place of their parent
+	const uint32_t subtree = grafts[g].root;
+	const uint32_t parent = nodes[subtree].parent;
+	const uint32_t sibling = nodes[parent].left == subtree ? nodes[parent].right : nodes[parent].left;
+	const uint32_t grandparent = nodes[parent].parent;
+	move_node(sibling, parent);
+	nodes[parent].parent = grandparent;
+	unused_nodes += 2 * count;
+
+	for (uint32_t node = grandparent; node != LightTreeNode::INVALID_NODE; node = nodes[node].parent) {
+		refit(node);
+	}
+
+	// The lights after the range moved down
+	leaf_of_light.erase(leaf_of_light.begin() + first, leaf_of_light.begin() + first + count);
+	for (size_t light = first; light < leaf_of_light.size(); light++) {
+		nodes[leaf_of_light[light]].light = static_cast<uint32_t>(light);
+	}
+	grafts.erase(grafts.begin() + g);
+	for (Graft& graft : grafts) {
+		if (graft.first > first) {
+			graft.first -= static_cast<uint32_t>(count);
+		}
+	}
+}
+
+void LightTree::move_node(const uint32_t from, const uint32_t to) {
+	nodes[to] = nodes[from];
+	const LightTreeNode& node = nodes[to];
+	if (node.is_leaf()) {
+		leaf_of_light[node.light] = to;
+	}
+	else {
+		nodes[node.left].parent = to;
+		nodes[node.right].parent = to;
+	}
+	for (Graft& graft : grafts) {
+		if (graft.root == from) {
+			graft.root = to;
+		}
+	}
+}
+
+void LightTree::refit(const uint32_t node_index) {
+	LightTreeNode& node = nodes[node_index];
+	const LightTreeNode& l = nodes[node.left];
+	const LightTreeNode& r = nodes[node.right];
+
+	// Smallest sphere around both bounding spheres
+	const float d = glm::distance(l.center, r.center);
+	if (d + r.radius <= l.radius) {
+		node.center = l.center;
+		node.radius = l.radius;
+	}
+	else if (d + l.radius <= r.radius) {
+		node.center = r.center;
+		node.radius = r.radius;
+	}
+	else {
+		node.radius = 0.5f * (d + l.radius + r.radius);
+		node.center = l.center + (r.center - l.center) * ((node.radius - l.radius) / d);
+	}
+
+	node.flux = l.flux + r.flux;
+	merge_cones(l.axis, l.theta_o, r.axis, r.theta_o, node.axis, node.theta_o);
+	node.cos_theta_o = std::cos(node.theta_o);
+	node.sin_theta_o = std::sin(node.theta_o);
+}
+
+void LightTree::build_recursive(const LightTable& lights, std::vector<uint32_t>& indices, const size_t begin, const size_t end,
+	const uint32_t node_index, glm::vec3& bounds_min, glm::vec3& bounds_max) {
+	LightTreeNode& node = nodes[node_index];
+	node.left = LightTreeNode::INVALID_NODE;
+	node.right = LightTreeNode::INVALID_NODE;
+	node.light = LightTreeNode::INVALID_NODE;
+
+	if (end - begin == 1) {
+		const uint32_t light = indices[begin];
+		bounds_min = lights.position[light];
+		bounds_max = lights.position[light];
+		node.center = lights.position[light];
+		node.radius = 0.0f;
+		node.flux = luminance(lights.emission[light]);
+		node.axis = lights.normal[light];
+		node.theta_o = 0.0f;
+		node.cos_theta_o = 1.0f;
+		node.sin_theta_o = 0.0f;
+		node.light = light;
+
+		leaf_of_light[light] = node_index;
+		return;
+	}
+
+	// Split at the median of the largest axis of the bounds
+	glm::vec3 bmin(std::numeric_limits<float>::max());
+	glm::vec3 bmax(-std::numeric_limits<float>::max());
+	for (size_t i = begin; i < end; i++) {
+		bmin = glm::min(bmin, lights.position[indices[i]]);
+		bmax = glm::max(bmax, lights.position[indices[i]]);
+	}
+	const glm::vec3 extent = bmax - bmin;
+	int axis = 0;
+	if (extent.y > extent[axis]) axis = 1;
+	if (extent.z > extent[axis]) axis = 2;
+
+	const size_t mid = begin + (end - begin) / 2;
+	std::nth_element(indices.begin() + begin, indices.begin() + mid, indices.begin() + end,
+		[&](const uint32_t a, const uint32_t b) {
+			return lights.position[a][axis] < lights.position[b][axis];
+		});
+
+	// Allocate both children at once so they end up next to each other
+	const uint32_t left = next_node;
+	next_node += 2;
+	node.left = left;
+	node.right = left + 1;
+	nodes[left].parent = node_index;
+	nodes[left + 1].parent = node_index;
+
+	glm::vec3 l_min, l_max, r_min, r_max;
+	build_recursive(lights, indices, begin, mid, left, l_min, l_max);
+	build_recursive(lights, indices, mid, end, left + 1, r_min, r_max);
+
+	const LightTreeNode& l = nodes[left];
+	const LightTreeNode& r = nodes[left + 1];
+	bounds_min = glm::min(l_min, r_min);
+	bounds_max = glm::max(l_max, r_max);
+	node.center = 0.5f * (bounds_min + bounds_max);
+	node.radius = 0.5f * glm::distance(bounds_min, bounds_max);
+	node.flux = l.flux + r.flux;
+	merge_cones(l.axis, l.theta_o, r.axis, r.theta_o, node.axis, node.theta_o);
+	node.cos_theta_o = std::cos(node.theta_o);
+	node.sin_theta_o = std::sin(node.theta_o);
+}
+
+// Cosine of max(theta - theta_u, 0) given the cosine of theta and the sine/cosine of theta_u
+static float cos_subtract_clamped(const float cos_theta, const float cos_theta_u, const float sin_theta_u) {
+	if (cos_theta >= cos_theta_u) {
+		return 1.0f;
+	}
+	const float sin_theta = sqrtf(fmax(1.0f - cos_theta * cos_theta, 0.0f));
+	return cos_theta * cos_theta_u + sin_theta * sin_theta_u;
+}
+
+float LightTree::importance(const LightTreeNode& node, const glm::vec3& p, const glm::vec3& n) const {
+	if (node.flux <= 0.0f) {
+		return 0.0f;
+	}
+
+	const float radius = node.radius;
+
+	const glm::vec3 to_cluster = node.center - p;
+	const float d2 = glm::dot(to_cluster, to_cluster);
+	const float d = sqrtf(d2);
+
+	// Closest possible distance to a light in the node, with the same falloff as the shading
+	const float _dist = fmax(d - radius, 0.0f);
+	const float _dist2 = fmax(_dist * _dist, 1e-4f);
+	constexpr float _r = 3.0f;
+	constexpr float _r2 = _r * _r;
+#ifdef PL_ATTENUATION
+	const float dist2 = (_dist2 + _r2 + _dist * sqrtf(_dist2 + _r2)) / 2.0f;
+#else
+	const float dist2 = _dist2;
+#endif
+
+	// Inside the bounds every direction is possible
+	if (d <= radius) {
+		return node.flux / dist2;
+	}
+
+	const glm::vec3 dir = to_cluster / d;
+
+	// Angle subtended by the bounding sphere of the node
+	const float sin_theta_u = radius / d;
+	const float cos_theta_u = sqrtf(fmax(1.0f - sin_theta_u * sin_theta_u, 0.0f));
+
+	// Emitter: smallest angle between the normal cone and the direction towards the shading point.
+	// VPLs are one-sided cosine emitters, so nothing is emitted beyond a right angle.
+	float cos_emit = 1.0f;
+	const float cos_theta = glm::dot(node.axis, -dir);
+	// theta_o + theta_u, the cone widened by the bounds. Once that reaches pi every direction is covered.
+	const float cos_widened = node.cos_theta_o * cos_theta_u - node.sin_theta_o * sin_theta_u;
+	const float sin_widened = node.sin_theta_o * cos_theta_u + node.cos_theta_o * sin_theta_u;
+	const bool covers_all = sin_widened <= 0.0f && cos_widened < 0.0f;
+	if (!covers_all && cos_theta < cos_widened) {
+		// cos(theta - theta_o), then subtract theta_u
+		const float sin_theta = sqrtf(fmax(1.0f - cos_theta * cos_theta, 0.0f));
+		const float cos_minus_o = cos_theta * node.cos_theta_o + sin_theta * node.sin_theta_o;
+		cos_emit = cos_subtract_clamped(cos_minus_o, cos_theta_u, sin_theta_u);
+		if (cos_emit <= 0.0f) {
+			return 0.0f;
+		}
+	}
+
+	// Receiver: smallest angle between the surface normal and the node
+	const float cos_recv = cos_subtract_clamped(glm::dot(n, dir), cos_theta_u, sin_theta_u);
+	if (cos_recv <= 0.0f) {
+		return 0.0f;
+	}
+
+	return node.flux * cos_emit * cos_recv / dist2;
+}
+
+float LightTree::left_probability(const LightTreeNode& node, const glm::vec3& p, const glm::vec3& n) const {
+	const LightTreeNode& l = nodes[node.left];
+	const LightTreeNode& r = nodes[node.right];
+
+	const float i_l = importance(l, p, n);
+	const float i_r = importance(r, p, n);
+
+	if (i_l + i_r > 0.0f) {
+		return i_l / (i_l + i_r);
+	}
+
+	// Neither child is expected to contribute, fall back to their power so every light stays reachable
+	if (l.flux + r.flux > 0.0f) {
+		return l.flux / (l.flux + r.flux);
+	}
+
+	return 0.5f;
+}
+
+uint32_t LightTree::sample(const glm::vec3& p, const glm::vec3& n, float u, float& pdf) const {
+	pdf = 1.0f;
+	uint32_t index = 0;
+
+	while (!nodes[index].is_leaf()) {
+		const LightTreeNode& node = nodes[index];
+		const float p_left = left_probability(node, p, n);
+
+		// Reuse the random number by rescaling it to the chosen branch
+		if (u < p_left) {
+			u = fmin(u / p_left, 0.99999994f);
+			pdf *= p_left;
+			index = node.left;
+		}
+		else {
+			u = fmin((u - p_left) / (1.0f - p_left), 0.99999994f);
+			pdf *= 1.0f - p_left;
+			index = node.right;
+		}
+	}
+
+	return nodes[index].light;
+}
+
+float LightTree::pdf(const uint32_t light, const glm::vec3& p, const glm::vec3& n) const {
+	float pdf = 1.0f;
+	uint32_t index = leaf_of_light[light];
+
+	while (nodes[index].parent != LightTreeNode::INVALID_NODE) {
+		const uint32_t parent = nodes[index].parent;
+		const float p_left = left_probability(nodes[parent], p, n);
+		pdf *= (nodes[parent].left == index) ? p_left : 1.0f - p_left;
+		index = parent;
+	}
+
+	return pdf;
+}
+
+float LightTree::power_left_probability(const LightTreeNode& node) const {
+	const float l_flux = nodes[node.left].flux;
+	const float r_flux = nodes[node.right].flux;
+	return l_flux + r_flux > 0.0f ? l_flux / (l_flux + r_flux) : 0.5f;
+}
+
+LightCut LightTree::cut(const glm::vec3& p, const glm::vec3& n) const {
+	LightCut cut;
+	cut.node[0] = 0;
+	cut.estimate[0] = importance(nodes[0], p, n);
+	cut.size = 1;
+	cut.total = cut.estimate[0];
+
+	// Max-heap over the positions of the clusters in the cut by their error bound.
+	// A single light is exact, so only clusters are pushed.
+	std::array<uint32_t, LIGHTCUT_MAX_SIZE> heap;
+	uint32_t heap_size = 0;
+	const auto by_error = [&](const uint32_t a, const uint32_t b) {
+		return cut.estimate[a] < cut.estimate[b];
+	};
+	const auto push = [&](const uint32_t i) {
+		if (!nodes[cut.node[i]].is_leaf() && cut.estimate[i] > 0.0f) {
+			heap[heap_size++] = i;
+			std::push_heap(heap.begin(), heap.begin() + heap_size, by_error);
+		}
+	};
+	push(0);
+
+	while (cut.size < LIGHTCUT_MAX_SIZE && heap_size > 0) {
+		const uint32_t worst = heap[0];
+		if (cut.estimate[worst] <= LIGHTCUT_ERROR * cut.total) {
+			break;
+		}
+		std::pop_heap(heap.begin(), heap.begin() + heap_size, by_error);
+		heap_size--;
+
+		// The children replace the cluster, the right one goes to the end
+		const LightTreeNode& node = nodes[cut.node[worst]];
+		const float i_l = importance(nodes[node.left], p, n);
+		const float i_r = importance(nodes[node.right], p, n);
+		cut.total += i_l + i_r - cut.estimate[worst];
+		cut.node[worst] = node.left;
+		cut.estimate[worst] = i_l;
+		cut.node[cut.size] = node.right;
+		cut.estimate[cut.size] = i_r;
+		cut.size++;
+
+		push(worst);
+		push(cut.size - 1);
+	}
+
+	// No cluster is expected to contribute, fall back to their power so every light stays reachable
+	if (cut.total <= 0.0f) {
+		cut.total = 0.0f;
+		for (uint32_t i = 0; i < cut.size; i++) {
+			cut.estimate[i] = nodes[cut.node[i]].flux;
+			cut.total += cut.estimate[i];
+		}
+	}
+
+	return cut;
+}
+
+uint32_t LightTree::sample(const LightCut& cut, float u, float& pdf) const {
+	// Pick a cluster, skipping the ones without an estimate
+	float target = u * cut.total;
+	uint32_t chosen = LightTreeNode::INVALID_NODE;
+	for (uint32_t i = 0; i < cut.size; i++) {
+		if (cut.estimate[i] <= 0.0f) continue;
+
+		chosen = i;
+		if (target < cut.estimate[i]) break;
+		target -= cut.estimate[i];
+	}
+
+	if (chosen == LightTreeNode::INVALID_NODE) {
+		pdf = 0.0f;
+		return nodes[cut.node[0]].is_leaf() ? nodes[cut.node[0]].light : 0;
+	}
+
+	pdf = cut.estimate[chosen] / cut.total;
+	u = fmin(fmax(target, 0.0f) / cut.estimate[chosen], 0.99999994f);
+
+	// Pick the representative light of the cluster
+	uint32_t index = cut.node[chosen];
+	while (!nodes[index].is_leaf()) {
+		const LightTreeNode& node = nodes[index];
+		const float p_left = power_left_probability(node);
+
+		if (u < p_left) {
+			u = fmin(u / p_left, 0.99999994f);
+			pdf *= p_left;
+			index = node.left;
+		}
+		else {
+			u = fmin((u - p_left) / (1.0f - p_left), 0.99999994f);
+			pdf *= 1.0f - p_left;
+			index = node.right;
+		}
+	}
+
+	return nodes[index].light;
+}
+
+float LightTree::pdf(const LightCut& cut, const uint32_t light) const {
+	float pdf = 1.0f;
+	uint32_t index = leaf_of_light[light];
+
+	// Walk up until the cluster of the cut holding the light is found
+	while (index != LightTreeNode::INVALID_NODE) {
+		for (uint32_t i = 0; i < cut.size; i++) {
+			if (cut.node[i] == index) {
+				return cut.total > 0.0f ? pdf * cut.estimate[i] / cut.total : 0.0f;
+			}
+		}
+
+		const uint32_t parent = nodes[index].parent;
+		if (parent != LightTreeNode::INVALID_NODE) {
+			const float p_left = power_left_probability(nodes[parent]);
+			pdf *= (nodes[parent].left == index) ? p_left : 1.0f - p_left;
+		}
+		index = parent;
+	}
+
+	return 0.0f;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <array>
+#include <cstdint>
+
+#include "light.hpp"
+#include "constants.hpp"
+
+// Siblings are stored next to each other, so a traversal step touches a single pair of nodes
+struct alignas(64) LightTreeNode {
+    glm::vec3 center;    // Center of the bounding sphere
+    float radius;
+    glm::vec3 axis;      // Axis of the cone bounding the light normals
+    float flux;          // Summed power of all lights below this node
+    float theta_o;       // Half-angle of the normal cone
+    float cos_theta_o;
+    float sin_theta_o;
+    uint32_t parent;
+    uint32_t left;       // Children (right = left + 1), INVALID_NODE for leaves
+    uint32_t right;
+    uint32_t light;      // Light index for leaves
+
+    inline bool is_leaf() const {
+        return left == INVALID_NODE;
+    }
+
+    static constexpr uint32_t INVALID_NODE = UINT32_MAX;
+};
+
+// A cut through the light tree for one shading point: clusters that together hold every light exactly once
+struct LightCut {
+    std::array<uint32_t, LIGHTCUT_MAX_SIZE> node;
+    std::array<float, LIGHTCUT_MAX_SIZE> estimate; // Upper bound on the contribution of the cluster
+    uint32_t size = 0;
+    float total = 0.0f;
+};
+
+// Binary light hierarchy over a LightTable (see "Importance Sampling of Many Lights with Adaptive Tree Splitting", Conty & Kulla).
+// Every node stores the bounds, the orientation cone and the summed power of its lights.
+// Sampling walks down the tree choosing a child proportional to a conservative estimate of its
+// contribution at the shading point, so the probability of picking a light is the product of the
+// branch probabilities along its path and can be evaluated exactly for any light.
+class LightTree {
+public:
+    LightTree() = default;
+
+    void build(const LightTable& lights);
+    void clear();
+
+    // Lights [first, lights.size()) were appended to the table: build a subtree over them and hang it next to
+    // the rest of the tree under a new root, without touching the existing nodes
+    void append(const LightTable& lights, const size_t first);
+
+    // The lights [first, first + count) were erased from the table (lights is the table afterwards). If they are
+    // exactly the lights of an append, only that subtree is taken out, otherwise the tree is built again.
+    void erase(const LightTable& lights, const size_t first, const size_t count);
+
+    inline size_t size() const {
+        return leaf_of_light.size();
+    }
+
+    inline bool empty() const {
+        return nodes.empty();
+    }
+
+    // Pick a light for the shading point p with normal n using a single uniform number in [0, 1)
+    [[nodiscard]] uint32_t sample(const glm::vec3& p, const glm::vec3& n, float u, float& pdf) const;
+
+    // Probability of sample() returning the given light for the shading point p with normal n
+    [[nodiscard]] float pdf(const uint32_t light, const glm::vec3& p, const glm::vec3& n) const;
+
+    // Conservative estimate of the contribution of everything below the node to the shading point
+    [[nodiscard]] float importance(const LightTreeNode& node, const glm::vec3& p, const glm::vec3& n) const;
+
+    // Lightcut for the shading point p with normal n (see "Lightcuts: A Scalable Approach to Illumination", Walter et al.).
+    // Starting at the root, the cluster with the largest error bound is split until every bound is below
+    // LIGHTCUT_ERROR times the total or the cut holds LIGHTCUT_MAX_SIZE clusters.
+    [[nodiscard]] LightCut cut(const glm::vec3& p, const glm::vec3& n) const;
+
+    // Pick a cluster of the cut proportional to its estimate, then a representative light in it proportional to power
+    [[nodiscard]] uint32_t sample(const LightCut& cut, float u, float& pdf) const;
+
+    // Probability of sample() returning the given light for the cut
+    [[nodiscard]] float pdf(const LightCut& cut, const uint32_t light) const;
+
+    inline const std::vector<LightTreeNode>& get_nodes() const {
+        return nodes;
+    }
+
+private:
+    // Subtree over lights that were appended after the last build
+    struct Graft {
+        uint32_t first;
+        uint32_t count;
+        uint32_t root;
+    };
+
+    std::vector<LightTreeNode> nodes;
+    std::vector<uint32_t> leaf_of_light;
+    std::vector<Graft> grafts;
+    uint32_t next_node = 0;
+    size_t unused_nodes = 0; // Nodes left behind by erase, the tree is built again once they outnumber the rest
+
+    // Bounds, power and normal cone of an interior node from its children
+    void refit(const uint32_t node_index);
+
+    // Move a node to another slot and point its children (or its light, or its graft) at the new slot
+    void move_node(const uint32_t from, const uint32_t to);
+
+    void build_recursive(const LightTable& lights, std::vector<uint32_t>& indices, const size_t begin, const size_t end,
+        const uint32_t node_index, glm::vec3& bounds_min, glm::vec3& bounds_max);
+
+    // Probability of choosing the left child of an interior node
+    float left_probability(const LightTreeNode& node, const glm::vec3& p, const glm::vec3& n) const;
+
+    // Same, but only by the power of the children, used to pick a representative light inside a cluster
+    float power_left_probability(const LightTreeNode& node) const;
+};
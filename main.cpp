@@ -15,6 +15,12 @@
 
 
 int main(int argc, char* argv[]) {
+    // --compile-scene rebuilds the compiled scene and exits, normal runs compile it on demand
+    if (argc > 1 && std::string(argv[1]) == "--compile-scene") {
+        load_world(true);
+        return 0;
+    }
+
     World world = load_world();
 
     Camera cam;
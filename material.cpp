@@ -3,7 +3,6 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/constants.hpp>
 #include <memory>
-#include <random>
 
 #include "ray.hpp"
 #include "texture.hpp"
@@ -11,43 +10,23 @@
 #include "util.hpp"
 #include "light.hpp"
 
-thread_local std::mt19937 rngFloat(std::random_device{}());
-std::uniform_real_distribution<float> distFloat(0.0f, 1.0f);
-
 bool Material::emits_light() const { return false; }
 
 glm::vec3 Material::albedo(const HitInfo& hit) const { return glm::vec3(1.0f); }
 
-static glm::vec2 calculate_texcoords(const glm::vec2& texcoord0, const glm::vec2& texcoord1, const glm::vec2& texcoord2, const glm::vec2& uv) {
-	const float u = uv.x;
-	const float v = uv.y;
-	const float w = 1.0f - u - v;
-
-	const glm::vec2 texcoords = texcoord0 * u +
-		texcoord1 * v +
-		texcoord2 * w;
-
-	return texcoords;
-}
-
 #define EPS 0.01f
 
 Lambertian::Lambertian(const glm::vec3& a) : _albedo(new SolidColor(a)) {}
 Lambertian::Lambertian(std::shared_ptr<Texture> a) : _albedo(a) {}
-bool Lambertian::scatter(const Ray& r_in, const HitInfo& hit, glm::vec3& attenuation, Ray& scattered, float& pdf) const {
-	const glm::vec3 N = hit.triangle.normal(hit.uv);
-	glm::vec3 scatter_dir = cosine_weighted_hemisphere_sample(N, pdf);
+bool Lambertian::scatter(const Ray& r_in, const HitInfo& hit, const glm::vec2& u, glm::vec3& attenuation, Ray& scattered, float& pdf) const {
+	const glm::vec3 N = hit.normal();
+	glm::vec3 scatter_dir = cosine_weighted_hemisphere_sample(N, u, pdf);
 
 	const glm::vec3 offset_point = hit.r.at(hit.t) + EPS * N;
 
 	scattered = Ray(offset_point, scatter_dir);
 
-	glm::vec2 texcoords = calculate_texcoords(
-		hit.triangle.v0.texcoord,
-		hit.triangle.v1.texcoord,
-		hit.triangle.v2.texcoord,
-		hit.uv
-	);
+	glm::vec2 texcoords = hit.texcoord();
 
 	attenuation = _albedo->value(texcoords.x, texcoords.y, hit.r.at(hit.t)) / glm::pi<float>();
 
@@ -55,12 +34,7 @@ bool Lambertian::scatter(const Ray& r_in, const HitInfo& hit, glm::vec3& attenua
 }
 
 glm::vec3 Lambertian::evaluate(const HitInfo& hit, const glm::vec3& wi) const {
-	glm::vec2 texcoords = calculate_texcoords(
-		hit.triangle.v0.texcoord,
-		hit.triangle.v1.texcoord,
-		hit.triangle.v2.texcoord,
-		hit.uv
-	);
+	glm::vec2 texcoords = hit.texcoord();
 
 	return _albedo->value(texcoords.x, texcoords.y, hit.r.at(hit.t)) / glm::pi<float>();
 }
@@ -68,11 +42,10 @@ glm::vec3 Lambertian::evaluate(const HitInfo& hit, const glm::vec3& wi) const {
 glm::vec3 Lambertian::sample_direction(
 	const glm::vec3& wi,
 	const glm::vec3& normal,
+	const glm::vec2& u,
 	float& pdf
 ) const {
 	//// Cosine-weighted hemisphere sampling
-	//float u = distFloat(rngFloat);
-	//float v = distFloat(rngFloat);
 	//float r = sqrt(u);
 	//float theta = 2.0f * glm::pi<float>() * v;
 	//// local coordinates
@@ -90,16 +63,11 @@ glm::vec3 Lambertian::sample_direction(
 	//pdf = z / glm::pi<float>(); // cos(theta) / pi
 	//return glm::normalize(sample);
 
-	return cosine_weighted_hemisphere_sample(normal, pdf);
+	return cosine_weighted_hemisphere_sample(normal, u, pdf);
 }
 
 glm::vec3 Lambertian::albedo(const HitInfo& hit) const {
-	glm::vec2 texcoords = calculate_texcoords(
-		hit.triangle.v0.texcoord,
-		hit.triangle.v1.texcoord,
-		hit.triangle.v2.texcoord,
-		hit.uv
-	);
+	glm::vec2 texcoords = hit.texcoord();
 
 	return _albedo->value(texcoords.x, texcoords.y, hit.r.at(hit.t));
 }
@@ -109,16 +77,11 @@ Emissive::Emissive(const glm::vec3& a) : emit(new SolidColor(a)) {}
 
 Emissive::Emissive(std::shared_ptr<Texture> a) : emit(a) {}
 
-bool Emissive::scatter(const Ray& r_in, const HitInfo& hit, glm::vec3& attenuation, Ray& scattered, float& pdf) const {
+bool Emissive::scatter(const Ray& r_in, const HitInfo& hit, const glm::vec2& u, glm::vec3& attenuation, Ray& scattered, float& pdf) const {
 	return false;
 }
 glm::vec3 Emissive::evaluate(const HitInfo& hit, const glm::vec3& wi) const {
-	glm::vec2 texcoords = calculate_texcoords(
-		hit.triangle.v0.texcoord,
-		hit.triangle.v1.texcoord,
-		hit.triangle.v2.texcoord,
-		hit.uv
-	);
+	glm::vec2 texcoords = hit.texcoord();
 
 	return emit->value(texcoords.x, texcoords.y, hit.r.at(hit.t));
 }
@@ -127,6 +90,7 @@ bool Emissive::emits_light() const { return true; }
 glm::vec3 Emissive::sample_direction(
 	const glm::vec3& wi,
 	const glm::vec3& normal,
+	const glm::vec2& u,
 	float& pdf
 ) const {
 	// Emissive materials do not scatter, so we return a zero vector
@@ -135,12 +99,7 @@ glm::vec3 Emissive::sample_direction(
 }
 
 glm::vec3 Emissive::albedo(const HitInfo& hit) const {
-	glm::vec2 texcoords = calculate_texcoords(
-		hit.triangle.v0.texcoord,
-		hit.triangle.v1.texcoord,
-		hit.triangle.v2.texcoord,
-		hit.uv
-	);
+	glm::vec2 texcoords = hit.texcoord();
 
 	return emit->value(texcoords.x, texcoords.y, hit.r.at(hit.t));
 }
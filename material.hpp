@@ -11,9 +11,10 @@
 
 class Material {
 public:
-	virtual bool scatter(const Ray& r_In, const HitInfo& hit, glm::vec3& attenuation, Ray& scattered, float& pdf) const = 0;
+	// u is a uniform random point in [0, 1)^2 that the sampled direction is derived from
+	virtual bool scatter(const Ray& r_In, const HitInfo& hit, const glm::vec2& u, glm::vec3& attenuation, Ray& scattered, float& pdf) const = 0;
 	virtual glm::vec3 evaluate(const HitInfo& hit, const glm::vec3& wi) const = 0;
-	virtual glm::vec3 sample_direction(const glm::vec3& wi, const glm::vec3& normal, float& pdf) const = 0;
+	virtual glm::vec3 sample_direction(const glm::vec3& wi, const glm::vec3& normal, const glm::vec2& u, float& pdf) const = 0;
 	virtual bool emits_light() const;
 
 	virtual glm::vec3 albedo(const HitInfo& hit) const;
@@ -24,11 +25,11 @@ class Lambertian : public Material {
 public:
 	Lambertian(const glm::vec3& a);
 	Lambertian(std::shared_ptr<Texture> a);
-	virtual bool scatter(const Ray& r_in, const HitInfo& hit, glm::vec3& attenuation, Ray& scattered, float& pdf) const;
+	virtual bool scatter(const Ray& r_in, const HitInfo& hit, const glm::vec2& u, glm::vec3& attenuation, Ray& scattered, float& pdf) const;
 
 	virtual glm::vec3 evaluate(const HitInfo& hit, const glm::vec3& wi) const;
 
-	virtual glm::vec3 sample_direction(const glm::vec3& wi, const glm::vec3& normal, float& pdf) const;
+	virtual glm::vec3 sample_direction(const glm::vec3& wi, const glm::vec3& normal, const glm::vec2& u, float& pdf) const;
 
 	virtual glm::vec3 albedo(const HitInfo& hit) const;
 };
@@ -39,10 +40,10 @@ public:
 	Emissive(const glm::vec3& a);
 	Emissive(std::shared_ptr<Texture> a);
 
-	virtual bool scatter(const Ray& r_in, const HitInfo& hit, glm::vec3& attenuation, Ray& scattered, float& pdf) const;
+	virtual bool scatter(const Ray& r_in, const HitInfo& hit, const glm::vec2& u, glm::vec3& attenuation, Ray& scattered, float& pdf) const;
 	virtual glm::vec3 evaluate(const HitInfo& hit, const glm::vec3& wi) const;
 
-	virtual glm::vec3 sample_direction(const glm::vec3& wi, const glm::vec3& normal, float& pdf) const;
+	virtual glm::vec3 sample_direction(const glm::vec3& wi, const glm::vec3& normal, const glm::vec2& u, float& pdf) const;
 
 	virtual bool emits_light() const;
 	virtual glm::vec3 albedo(const HitInfo& hit) const;
@@ -0,0 +1,62 @@
+#include "mesh.hpp"
+
+#include <glm/glm.hpp>
+
+#include "constants.hpp"
+
+MeshInstance::MeshInstance(const uint32_t asset, const glm::mat4& transform) :
+	asset(asset), transform(transform), normal_matrix(glm::transpose(glm::inverse(glm::mat3(transform)))) {
+}
+
+glm::vec3 Mesh::normal(const uint32_t prim, const glm::vec2 uv) const {
+#ifdef INTERPOLATE_NORMALS
+	const float u = uv.x;
+	const float v = uv.y;
+	const float w = 1.0f - u - v;
+
+	glm::vec3 n = normals[indices[prim * 3]] * u +
+		normals[indices[prim * 3 + 1]] * v +
+		normals[indices[prim * 3 + 2]] * w;
+
+	return glm::normalize(n);
+#else
+	return face_normals[prim];
+#endif
+}
+
+glm::vec3 Mesh::normal(const uint32_t instance, const uint32_t prim, const glm::vec2 uv) const {
+	return glm::normalize(instances[instance].normal_matrix * normal(prim, uv));
+}
+
+glm::vec2 Mesh::texcoord(const uint32_t prim, const glm::vec2 uv) const {
+	const float u = uv.x;
+	const float v = uv.y;
+	const float w = 1.0f - u - v;
+
+	return texcoords[indices[prim * 3]] * u +
+		texcoords[indices[prim * 3 + 1]] * v +
+		texcoords[indices[prim * 3 + 2]] * w;
+}
+
+Triangle Mesh::triangle(const uint32_t prim) const {
+	Vertex triangle_verts[3];
+	for (uint32_t v = 0; v < 3; v++) {
+		const uint32_t vertex = indices[prim * 3 + v];
+		triangle_verts[v] = Vertex{ position(vertex), normals[vertex], texcoords[vertex] };
+	}
+	return Triangle(triangle_verts, material_ids[prim]);
+}
+
+Triangle Mesh::triangle(const uint32_t instance, const uint32_t prim) const {
+	const MeshInstance& placement = instances[instance];
+
+	Vertex triangle_verts[3];
+	for (uint32_t v = 0; v < 3; v++) {
+		const uint32_t vertex = indices[prim * 3 + v];
+		const glm::vec3 world_position = glm::vec3(placement.transform * glm::vec4(position(vertex), 1.0f));
+		const glm::vec3 n = normals[vertex];
+		const glm::vec3 world_normal = glm::dot(n, n) > 0.0f ? glm::normalize(placement.normal_matrix * n) : n;
+		triangle_verts[v] = Vertex{ world_position, world_normal, texcoords[vertex] };
+	}
+	return Triangle(triangle_verts, material_ids[prim]);
+}
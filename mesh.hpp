@@ -0,0 +1,77 @@
+#pragma once
+
+#ifndef TINY_BVH_H_
+#include "lib/tiny_bvh.h"
+#endif
+#include <glm/glm.hpp>
+#include <span>
+#include <cstdint>
+
+#include "geometry.hpp"
+
+constexpr uint32_t INVALID_PRIM = UINT32_MAX;
+constexpr uint32_t INVALID_INSTANCE = UINT32_MAX;
+
+// The triangles loaded from one obj file, shared by every placement of that file
+struct MeshAsset {
+    uint32_t first_triangle;
+    uint32_t triangle_count;
+    uint64_t source_hash; // Hash of the obj file, keys the BVH cache of the asset
+};
+
+// A placement of an asset in the scene
+struct MeshInstance {
+    uint32_t asset;
+    glm::mat4 transform;     // Object to world
+    glm::mat3 normal_matrix; // Inverse transpose of the upper 3x3 of transform
+
+    MeshInstance() = default;
+    MeshInstance(const uint32_t asset, const glm::mat4& transform);
+};
+
+// Indexed triangle mesh. Vertices are shared between the triangles that reference them, every
+// triangle stores three indices into the vertex arrays plus its material and geometric normal.
+// Geometry is stored once per asset in object space and placed in the world by instances.
+// The mesh only views its arrays, they are owned by the World or by a mapped scene file.
+struct Mesh {
+    // Per vertex
+    std::span<const tinybvh::bvhvec4> positions; // w is unused, tinybvh expects a 16 byte stride
+    std::span<const glm::vec3> normals;
+    std::span<const glm::vec2> texcoords;
+
+    // Per triangle
+    std::span<const uint32_t> indices; // Three per triangle
+    std::span<const int32_t> material_ids;
+    std::span<const glm::vec3> face_normals;
+
+    std::span<const MeshAsset> assets;
+    std::span<const MeshInstance> instances;
+
+    inline size_t triangle_count() const {
+        return material_ids.size();
+    }
+
+    inline size_t vertex_count() const {
+        return positions.size();
+    }
+
+    inline glm::vec3 position(const uint32_t vertex) const {
+        const tinybvh::bvhvec4& p = positions[vertex];
+        return glm::vec3(p.x, p.y, p.z);
+    }
+
+    // Shading normal of a triangle at the barycentric coordinates uv, in object space
+    glm::vec3 normal(const uint32_t prim, const glm::vec2 uv) const;
+
+    // Shading normal of a triangle of an instance at the barycentric coordinates uv, in world space
+    glm::vec3 normal(const uint32_t instance, const uint32_t prim, const glm::vec2 uv) const;
+
+    // Texture coordinates of a triangle at the barycentric coordinates uv
+    glm::vec2 texcoord(const uint32_t prim, const glm::vec2 uv) const;
+
+    // Expand a triangle into a standalone copy, in object space
+    Triangle triangle(const uint32_t prim) const;
+
+    // Expand a triangle of an instance into a standalone copy, in world space
+    Triangle triangle(const uint32_t instance, const uint32_t prim) const;
+};
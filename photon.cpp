@@ -2,7 +2,6 @@
 
 #include <glm/glm.hpp>
 #include <iostream>
-#include <random>
 
 #include "constants.hpp"
 #include "ray.hpp"
@@ -10,9 +9,6 @@
 
 Photon::Photon() : position(0, 0, 0), direction(0, 0, 1), flux(1,1,1) {}
 
-thread_local std::mt19937 rng3(std::random_device{}());
-std::uniform_real_distribution<float> dist3(0.0f, 1.0f);
-
 Photon::Photon(glm::vec3 position, glm::vec3 direction, glm::vec3 color, float intensity) : 
 	position(position), direction(glm::normalize(direction)), flux(color * intensity) {
 	if (std::isnan(intensity) || std::isinf(intensity)) {
@@ -23,45 +19,45 @@ Photon::Photon(glm::vec3 position, glm::vec3 direction, glm::vec3 color, float i
 Photon::Photon(glm::vec3 position, glm::vec3 direction, glm::vec3 color) :
 	position(position), direction(glm::normalize(direction)), flux(color) {}
 
-void Photon::shoot(World& scene, int max_bounces, size_t& photon_count, const size_t max_photons) {
+size_t Photon::shoot(World& scene, const int max_bounces, const size_t max_vpls, Rng& rng, LightTable& vpls) {
+	const size_t start = vpls.size();
 
-	if (photon_count >= max_photons || bounces >= max_bounces) {
-		return; // Stop if we reached the maximum number of photons or bounces
-	}
+	while (bounces < max_bounces && vpls.size() - start < max_vpls) {
+		HitInfo hit_point;
+		auto r = Ray(position, direction);
+		if (!scene.intersect(r, hit_point)) {
+			break; // If the photon does not hit anything, stop
+		}
 
-	HitInfo hit_point;
-	auto r = Ray(position, direction);
-	if (!scene.intersect(r, hit_point)) {
-		return; // If the photon does not hit anything, stop
+		if (!scatter(r, hit_point, rng, vpls)) {
+			break;
+		}
 	}
 
-	// Get the triangle that was hit
-	const Triangle& triangle = hit_point.triangle;
-	const glm::vec3& normal = triangle.normal(hit_point.uv); // Get the normal of the triangle at the hit point
-	const auto mat_ptr = hit_point.mat_ptr.lock();
+	return vpls.size() - start;
+}
+
+template <class Leave>
+bool Photon::bounce(const Ray& r, const HitInfo& hit_point, Rng& rng, Leave&& leave) {
+	const glm::vec3 normal = hit_point.normal(); // Get the normal of the triangle at the hit point
+	const Material* mat_ptr = hit_point.material;
 
 	// Get the hit point
 	position = r.at(hit_point.t); // Update the position of the photon to the hit point
 
-	// Place a virtual point light at the hit point slightly offset in the direction of the normal
-	glm::vec3 light_position = position + 0.001f * normal; // Offset to avoid self-occlusion
-
 	const float cos_theta = glm::dot(normal, -direction); // Cosine of the angle between the surface normal and the direction
-	if (cos_theta <= 0.0f) return; // Ignore if backfacing or grazing
+	if (cos_theta <= 0.0f) return false; // Ignore if backfacing or grazing
 
 	float pdf_dir;
-	glm::vec3 new_dir = mat_ptr->sample_direction(-direction, normal, pdf_dir);
+	glm::vec3 new_dir = mat_ptr->sample_direction(-direction, normal, rng.next_2d(), pdf_dir);
 
-	if (pdf_dir <= 0.0f) return; // If the PDF is zero or negative, skip this photon
+	if (pdf_dir <= 0.0f) return false; // If the PDF is zero or negative, stop here
 
-	HitInfo hi;
-	const glm::vec3 brdf = mat_ptr.get()->evaluate(hi, -direction);
+	const glm::vec3 incident_flux = flux;
+	const glm::vec3 brdf = mat_ptr->evaluate(hit_point, -direction);
 	flux = flux * brdf * cos_theta / pdf_dir;
 
-	if (!mat_ptr.get()->emits_light()) {
-		photon_count++; // Increment the number of photons shot
-		scene.spawn_vpl(light_position, normal, flux, N_PHOTONS / float(N_INDIRECT_PHOTONS));
-	}
+	leave(normal, incident_flux);
 
 	bounces++; // Increment the number of bounces
 
@@ -70,10 +66,53 @@ void Photon::shoot(World& scene, int max_bounces, size_t& photon_count, const si
 		const float max_flux = fmax(fmax(flux.r, flux.g), flux.b);
 		const float rr_prob = glm::clamp(max_flux, 0.05f, 0.95f); // Clamp the probability to avoid too low or too high values
 
-		if (dist3(rng3) > rr_prob) return;
+		if (rng.next_float() > rr_prob) return false;
 		flux /= rr_prob;
 	}
 
+	// Leave from slightly off the surface, on the side of the new direction. Without the offset the next ray can hit
+	// the surface it starts on, and whether it does depends on the BVH layout.
+	position += (glm::dot(new_dir, normal) < 0.0f ? -0.001f : 0.001f) * normal;
 	direction = new_dir;
-	shoot(scene, max_bounces, photon_count, max_photons);
-}
\ No newline at end of file
+	return true;
+}
+
+size_t Photon::shoot(World& scene, const int max_bounces, Rng& rng, PhotonHits& photons) {
+	const size_t start = photons.size();
+
+	while (bounces < max_bounces) {
+		HitInfo hit_point;
+		auto r = Ray(position, direction);
+		if (!scene.intersect(r, hit_point)) {
+			break; // If the photon does not hit anything, stop
+		}
+
+		if (!deposit(r, hit_point, rng, photons)) {
+			break;
+		}
+	}
+
+	return photons.size() - start;
+}
+
+bool Photon::scatter(const Ray& r, const HitInfo& hit_point, Rng& rng, LightTable& vpls) {
+	const Material* mat_ptr = hit_point.material;
+	return bounce(r, hit_point, rng, [&](const glm::vec3& normal, const glm::vec3&) {
+		// Place a virtual point light at the hit point slightly offset in the direction of the normal
+		glm::vec3 light_position = position + 0.001f * normal; // Offset to avoid self-occlusion
+
+		if (!mat_ptr->emits_light()) {
+			vpls.push_back(light_position, normal, flux, vpl_intensity);
+		}
+	});
+}
+
+bool Photon::deposit(const Ray& r, const HitInfo& hit_point, Rng& rng, PhotonHits& photons) {
+	const Material* mat_ptr = hit_point.material;
+	const glm::vec3 incoming = -glm::normalize(direction);
+	return bounce(r, hit_point, rng, [&](const glm::vec3& normal, const glm::vec3& incident_flux) {
+		if (bounces > 0 && !mat_ptr->emits_light()) {
+			photons.push_back(position, normal, incoming, incident_flux * vpl_intensity);
+		}
+	});
+}
@@ -3,6 +3,12 @@
 #include <glm/glm.hpp>
 
 #include "world.hpp"
+#include "light.hpp"
+#include "ray.hpp"
+#include "hit_info.hpp"
+#include "rng.hpp"
+#include "constants.hpp"
+#include "photon_map.hpp"
 
 class Photon {
 public:
@@ -16,7 +22,28 @@ public:
 	Photon(glm::vec3 position, glm::vec3 direction, glm::vec3 color, float intensity);
 	Photon(glm::vec3 position, glm::vec3 direction, glm::vec3 color);
 
-	void shoot(World& scene, int max_bounces, size_t& photon_count, const size_t max_photons);
-private:
+	// Trace the photon until it is absorbed or leaves the scene, leaving a VPL in vpls at every bounce off a
+	// non-emissive surface. Stops once max_vpls were left. Returns the number of VPLs added.
+	size_t shoot(World& scene, const int max_bounces, const size_t max_vpls, Rng& rng, LightTable& vpls);
+
+	// A single bounce at the hit of the ray (position, direction): leaves a VPL unless the surface emits light
+	// and samples the next direction. Returns false once the photon is absorbed.
+	bool scatter(const Ray& r, const HitInfo& hit_point, Rng& rng, LightTable& vpls);
+
+	// Photon map versions of the above: the photon itself is stored in photons at every bounce off a non-emissive
+	// surface but the first, whose light is already accounted for by the point lights
+	size_t shoot(World& scene, const int max_bounces, Rng& rng, PhotonHits& photons);
+	bool deposit(const Ray& r, const HitInfo& hit_point, Rng& rng, PhotonHits& photons);
+
 	int bounces = 0; // Number of bounces the photon has made
+
+	// Intensity of the VPLs the photon leaves, 1 / (probability of its source light * VPLs traced). Photon map
+	// photons are stored with their flux multiplied by it.
+	float vpl_intensity = N_PHOTONS / float(N_INDIRECT_PHOTONS);
+
+private:
+	// Move the photon to the hit and sample its next direction. leave(normal, incident flux) is called with the
+	// flux already updated to the reflected one, before Russian roulette. Returns false once the photon is absorbed.
+	template <class Leave>
+	bool bounce(const Ray& r, const HitInfo& hit_point, Rng& rng, Leave&& leave);
 };
@@ -0,0 +1,152 @@
+#include "photon_map.hpp"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+#include <vector>
+#include <algorithm>
+
+#include "hit_info.hpp"
+#include "material.hpp"
+#include "constants.hpp"
+
+void PhotonHits::append(const PhotonHits& other) {
+	position.insert(position.end(), other.position.begin(), other.position.end());
+	normal.insert(normal.end(), other.normal.begin(), other.normal.end());
+	direction.insert(direction.end(), other.direction.begin(), other.direction.end());
+	flux.insert(flux.end(), other.flux.begin(), other.flux.end());
+}
+
+void PhotonMap::clear() {
+	normal.clear();
+	direction.clear();
+	flux.clear();
+	irradiance.clear();
+	cloud.build({});
+	stale = false;
+}
+
+void PhotonMap::append(const PhotonHits& photons, const float scale) {
+	if (photons.size() == 0) return;
+
+	// New points take the slots at the end of the cloud
+	cloud.append(photons.position);
+	normal.insert(normal.end(), photons.normal.begin(), photons.normal.end());
+	direction.insert(direction.end(), photons.direction.begin(), photons.direction.end());
+	for (const glm::vec3& f : photons.flux) {
+		flux.push_back(f * scale);
+	}
+	irradiance.resize(flux.size());
+	stale = true;
+}
+
+void PhotonMap::erase(const size_t first, const size_t count) {
+	if (count == 0 || first + count > size()) return;
+
+	// When the cloud reclaims the erased slots, the photons follow their points
+	const std::vector<uint32_t> remap = cloud.erase(first, count);
+	if (!remap.empty()) {
+		// Live points keep their order, so slots only move down and this can be done in place
+		for (size_t slot = 0; slot < remap.size(); slot++) {
+			const uint32_t to = remap[slot];
+			if (to != SphereCloud::NO_POINT) {
+				normal[to] = normal[slot];
+				direction[to] = direction[slot];
+				flux[to] = flux[slot];
+			}
+		}
+		normal.resize(cloud.points.size());
+		direction.resize(cloud.points.size());
+		flux.resize(cloud.points.size());
+		irradiance.resize(cloud.points.size());
+	}
+	stale = true;
+}
+
+void PhotonMap::estimate_irradiance() {
+	std::vector<glm::vec3> points(cloud.slots.size());
+	for (size_t i = 0; i < points.size(); i++) {
+		points[i] = cloud.points[cloud.slots[i]];
+	}
+
+	constexpr size_t k = PHOTON_MAP_K;
+	std::vector<uint32_t> nearest(points.size() * k);
+	std::vector<float> dist_sqr(points.size() * k);
+	cloud.knn(points, k, nearest, dist_sqr);
+
+	const int64_t count = static_cast<int64_t>(points.size());
+#pragma omp parallel for
+	for (int64_t i = 0; i < count; i++) {
+		const uint32_t slot = cloud.slots[i];
+
+		// The flux is spread over the disc that holds all of the photons
+		glm::vec3 sum(0.0f);
+		float radius_sqr = 0.0f;
+		for (size_t j = 0; j < k; j++) {
+			const uint32_t photon = nearest[i * k + j];
+			if (photon == SphereCloud::NO_POINT) {
+				break;
+			}
+			radius_sqr = dist_sqr[i * k + j];
+
+			// Photons on other surfaces, or that arrived at the back of this one, lit something else
+			const bool same_surface = glm::distance(normal[photon], normal[slot]) <= NORMAL_DEVIATION;
+			if (same_surface && glm::dot(direction[photon], normal[slot]) > 0.0f) {
+				sum += flux[photon];
+			}
+		}
+		irradiance[slot] = radius_sqr > 0.0f ? sum / (glm::pi<float>() * radius_sqr) : glm::vec3(0.0f);
+	}
+	stale = false;
+}
+
+void PhotonMap::gather(const GBuffer& gbuffer, Framebuffer<glm::vec3>& colors) {
+	if (empty()) return;
+	if (stale) {
+		estimate_irradiance();
+	}
+
+	// Emitters show their own color, the other hits are looked up as one batch
+	lookup_pixels.clear();
+	lookup_points.clear();
+	for (size_t i = 0; i < gbuffer.size(); i++) {
+		const Material* material = gbuffer.material(i);
+		if (material && !material->emits_light()) {
+			lookup_pixels.push_back(static_cast<uint32_t>(i));
+			lookup_points.push_back(gbuffer.position[i]);
+		}
+	}
+
+	constexpr size_t k = PHOTON_LOOKUP_K;
+	lookup_nearest.resize(lookup_points.size() * k);
+	lookup_dist_sqr.resize(lookup_points.size() * k);
+	cloud.knn(lookup_points, k, lookup_nearest, lookup_dist_sqr);
+
+	const int width = gbuffer.get_width();
+	const int64_t count = static_cast<int64_t>(lookup_pixels.size());
+#pragma omp parallel for
+	for (int64_t q = 0; q < count; q++) {
+		const HitInfo hit = gbuffer.hit(lookup_pixels[q]);
+		const glm::vec3 N = hit.normal();
+
+		// Average the photons on a surface like this one, a single photon would show its Voronoi cell
+		glm::vec3 E(0.0f);
+		int found = 0;
+		for (size_t j = 0; j < k; j++) {
+			const uint32_t photon = lookup_nearest[q * k + j];
+			if (photon == SphereCloud::NO_POINT) {
+				break;
+			}
+			if (glm::distance(normal[photon], N) <= NORMAL_DEVIATION) {
+				E += irradiance[photon];
+				found++;
+			}
+		}
+
+		if (found > 0) {
+			// A diffuse surface reflects the same radiance in every direction
+			const int x = static_cast<int>(lookup_pixels[q] % width);
+			const int y = static_cast<int>(lookup_pixels[q] / width);
+			colors.row(y)[x] += hit.material->evaluate(hit, N) * E / static_cast<float>(found);
+		}
+	}
+}
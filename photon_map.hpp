@@ -0,0 +1,79 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+
+#include "spheres.hpp"
+#include "gbuffer.hpp"
+#include "framebuffer.hpp"
+
+// Photons as they are traced, before they are scaled into a PhotonMap
+struct PhotonHits {
+    std::vector<glm::vec3> position;
+    std::vector<glm::vec3> normal;    // Of the surface the photon hit
+    std::vector<glm::vec3> direction; // Towards where the photon came from
+    std::vector<glm::vec3> flux;      // Power the photon carries when it arrives
+
+    inline void push_back(const glm::vec3& p, const glm::vec3& n, const glm::vec3& d, const glm::vec3& f) {
+        position.push_back(p);
+        normal.push_back(n);
+        direction.push_back(d);
+        flux.push_back(f);
+    }
+
+    void append(const PhotonHits& other);
+
+    inline size_t size() const {
+        return position.size();
+    }
+};
+
+// Photons stored where they hit a diffuse surface after at least one bounce, for the indirect light at the
+// primary hits without VPLs and their shadow rays (Jensen, "Global Illumination using Photon Maps"). Direct
+// light still comes from the point lights.
+//
+// Estimating the density of the k nearest photons at every pixel is too slow for the live view, so it is done
+// once per photon instead, whenever the photons change (Christensen, "Faster Photon Map Global Illumination").
+// A pixel then only averages the irradiance of the few nearest photons on a surface facing the same way.
+class PhotonMap {
+public:
+    // Per slot of cloud
+    std::vector<glm::vec3> normal;
+    std::vector<glm::vec3> direction; // Towards where the photon came from
+    std::vector<glm::vec3> flux;
+    std::vector<glm::vec3> irradiance; // Estimated from the PHOTON_MAP_K nearest photons
+
+    SphereCloud cloud; // Photon positions, photons are added and erased in ranges like lights
+
+    inline size_t size() const {
+        return cloud.size();
+    }
+
+    inline bool empty() const {
+        return cloud.empty();
+    }
+
+    void clear();
+
+    // Add the photons at the end with their flux multiplied by scale, one over the number of photons emitted
+    // per light for the lights they were traced from
+    void append(const PhotonHits& photons, const float scale);
+
+    // Remove the photons [first, first + count), the ones after them move down by count
+    void erase(const size_t first, const size_t count);
+
+    // Add the indirect light towards the camera at every hit of the G-buffer. Diffuse reflection is assumed.
+    void gather(const GBuffer& gbuffer, Framebuffer<glm::vec3>& colors);
+
+private:
+    bool stale = false; // Photons changed since the irradiance was estimated
+
+    // Lookups of gather, kept across frames so they are only allocated once
+    std::vector<uint32_t> lookup_pixels;  // Pixels that reflect the indirect light
+    std::vector<glm::vec3> lookup_points; // Their positions
+    std::vector<uint32_t> lookup_nearest; // PHOTON_LOOKUP_K nearest photons of every pixel
+    std::vector<float> lookup_dist_sqr;
+
+    void estimate_irradiance();
+};
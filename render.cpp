@@ -1,64 +1,83 @@
 #include "render.hpp"
 
 #include <glm/glm.hpp>
-#include <random>
 #include <chrono>
 #include <iostream>
 #include <atomic>
 #include <thread>
 #include <omp.h>
+#include <array>
+#include <span>
+#include <algorithm>
 
 #include "camera.hpp"
 #include "world.hpp"
 #include "restir.hpp"
 #include "shading.hpp"
+#include "aligned_allocator.hpp"
+#include "tile_scheduler.hpp"
+#include "sampler.hpp"
 
 #define EPS 0.001f
 #define M_PI 3.14159265358979323846f
 
-thread_local std::mt19937 rng_pt(std::random_device{}());
-std::uniform_real_distribution<float> dist_pt(0.0f, 1.0f);
+// Paths are traced in chunks of this many rays, so the batch buffers stay on the stack
+constexpr size_t PATH_CHUNK = 64;
 
-static glm::vec3 pathtrace_ray(Ray& ray, World& world, int depth, glm::vec3 throughput, std::vector<std::weak_ptr<PointLight>>& lights) {
-    if (depth > MAX_RAY_DEPTH)
-        return glm::vec3(0.0f);
+void PathBuffer::resize(const size_t n) {
+    if (ray.size() == n) {
+        return;
+    }
+    ray.resize(n);
+    throughput.resize(n);
+    alive.resize(n);
+    sampler.resize(n);
+    shadow_ray.resize(n);
+    shadow_dist.resize(n);
+    shadow_contribution.resize(n);
+    has_shadow_ray.resize(n);
+    hits.resize(n);
+    active.reserve(n);
+    shadow_queue.reserve(n);
+}
+
+// Add the emission, sample a light for next event estimation and scatter the path at its hit
+static void shade_path(PathBuffer& paths, glm::vec3* radiance, const uint32_t path, const HitInfo& hit, const int depth,
+    const LightTable& lights) {
+    const Ray& ray = paths.ray[path];
+    paths.has_shadow_ray[path] = 0;
 
-    HitInfo hit;
-    if (!world.intersect(ray, hit)) {
+    if (hit.prim == INVALID_PRIM) {
         if (depth == 0) {
-            return sky_color(ray.direction());
-        }
-        else {
-            return glm::vec3(0.0f);
+            radiance[path] += sky_color(ray.direction());
         }
+        paths.alive[path] = 0;
+        return;
     }
 
-	auto material = hit.mat_ptr.lock();
-
-	glm::vec3 L = glm::vec3(0.0f);
+    const Material* material = hit.material;
 
     // Emitted light
     if (material->emits_light()) {
-        L += material->evaluate(hit, -ray.direction());
-        return L;
+        radiance[path] += paths.throughput[path] * material->evaluate(hit, -ray.direction());
+        paths.alive[path] = 0;
+        return;
     }
 
     // Direct lighting
-    glm::vec3 P = hit.r.at(hit.t);
-    glm::vec3 N = hit.triangle.normal(hit.uv);
-    size_t nLights = lights.size();
-	glm::vec3 L_direct = glm::vec3(0.0f);
-
-	if (nLights == 0) {
-		// No lights, return accumulated light
-		return L;
-	}
-
-    std::uniform_int_distribution<size_t> lightDist(0, nLights - 1);
-    size_t idx = lightDist(rng_pt);
-    auto light = lights[idx].lock();
+    const glm::vec3 P = hit.r.at(hit.t);
+    const glm::vec3 N = hit.normal();
+    const size_t nLights = lights.size();
+
+    if (nLights == 0) {
+        // No lights, keep the accumulated light
+        paths.alive[path] = 0;
+        return;
+    }
 
-    glm::vec3 toL = light->position - P;
+    Sampler& sampler = paths.sampler[path];
+    const size_t idx = std::min(static_cast<size_t>(sampler.get_1d(LIGHT_CHOICE_SEQUENCE) * nLights), nLights - 1);
+    const glm::vec3 toL = lights.position[idx] - P;
     const float _dist2 = glm::dot(toL, toL);
     const float dist_simple = sqrtf(_dist2);
 
@@ -70,120 +89,217 @@ static glm::vec3 pathtrace_ray(Ray& ray, World& world, int depth, glm::vec3 thro
     const float dist2 = _dist2;
 #endif
 
-    glm::vec3 L_dir = toL / dist_simple;
-
-    glm::vec3 fr = material->evaluate(hit, L_dir);
-    
-
-    Ray shadow_ray = Ray(P + EPS * L_dir, L_dir);
-    if (!world.is_occluded(shadow_ray, dist_simple - 0.1f)) {
-        
-        glm::vec3 Li = (light->intensity * light->c) / dist2;
-        float cos_theta = fmax(glm::dot(N, L_dir), 0.0f);
+    const glm::vec3 L_dir = toL / dist_simple;
+    const float cos_light = fmax(glm::dot(N, L_dir), 0.0f);
+    if (cos_light > 0.0f) {
+        const glm::vec3 fr = material->evaluate(hit, L_dir);
+        const glm::vec3 Li = lights.emission[idx] / dist2;
 
-        L_direct = fr * cos_theta * Li * float(nLights);
+        paths.shadow_ray[path] = Ray(P + EPS * L_dir, L_dir);
+        paths.shadow_dist[path] = dist_simple - 0.1f;
+        paths.shadow_contribution[path] = paths.throughput[path] * fr * cos_light * Li * float(nLights);
+        paths.has_shadow_ray[path] = 1;
     }
 
-    L += L_direct * throughput;
-
     Ray scattered;
     glm::vec3 attenuation;
     float pdf;
-    if (!material->scatter(ray, hit, attenuation, scattered, pdf))
-            return L;
-
-    if (pdf == 0.0f) {
-    	// If pdf is zero, we cannot continue the path, return the accumulated light
-    	return L;
+    if (!material->scatter(ray, hit, sampler.get_2d(SCATTER_SEQUENCE), attenuation, scattered, pdf) || pdf == 0.0f) {
+        // If pdf is zero, we cannot continue the path
+        paths.alive[path] = 0;
+        return;
     }
 
-	float cos_theta = fmax(glm::dot(N, scattered.direction()), 0.0f);
-    throughput *= fr * cos_theta / pdf;
-
+    const float cos_theta = fmax(glm::dot(N, scattered.direction()), 0.0f);
+    glm::vec3& throughput = paths.throughput[path];
+    throughput *= material->evaluate(hit, scattered.direction()) * cos_theta / pdf;
 
     // Russian roulette
-    float rr = glm::clamp(
+    const float rr = glm::clamp(
         std::max({ throughput.r, throughput.g, throughput.b }),
         0.05f,
         0.95f
     );
 
-    if (dist_pt(rng_pt) <= rr) {
-        throughput /= rr;
-
-        // Recursive call for indirect lighting
-        glm::vec3 indirect = pathtrace_ray(scattered, world, depth + 1, throughput, lights);
-        L += throughput * indirect;
+    if (sampler.get_1d(SequenceType::Random) > rr) {
+        paths.alive[path] = 0;
+        return;
     }
 
-
-    return L;
+    throughput /= rr;
+    paths.ray[path] = scattered;
 }
 
-std::vector<std::vector<glm::vec3>> pathtrace(RenderInfo& info) {
-    auto rays = info.cam.generate_rays_for_frame();
-    auto lights = info.world.get_lights();
-
-    std::vector<std::vector<glm::vec3> > colors = std::vector<std::vector<glm::vec3> >(
-        info.cam.image_height, std::vector<glm::vec3>(info.cam.image_width, glm::vec3(0.0f)));
-
-    int total_pixels = info.cam.image_height * info.cam.image_width;
-
-    //#pragma omp parallel for
-    for (int i = 0; i < rays.size(); i++) {
-        for (int j = 0; j < rays[i].size(); j++) {
-            Ray& ray = rays[i][j];
-            glm::vec3 color = pathtrace_ray(ray, info.world, 0, glm::vec3(1.0f), lights);
-            colors[i][j] = color;
+// Wavefront path tracer: every path of the frame advances one bounce at a time through flat queues.
+// generate fills the camera rays, extend intersects all active paths, shade accumulates emission,
+// queues a shadow ray and scatters, connect traces the shadow rays. Every stage runs in parallel.
+void pathtrace(RenderInfo& info, PathBuffer& paths, Framebuffer<glm::vec3>& colors) {
+    const Camera& cam = info.cam;
+    World& world = info.world;
+    const LightTable& lights = world.get_lights();
+    world.get_material_table(); // Built on first use, which must not happen inside the parallel stages
+
+    const int width = cam.image_width;
+    const int height = cam.image_height;
+    colors.resize(width, height);
+    const int pitch = colors.pitch();
+    paths.resize(static_cast<size_t>(pitch) * height);
+
+    // Paths are indexed like the framebuffer, so the radiance is accumulated in place
+    glm::vec3* radiance = colors.row(0);
+
+    // Generate
+    std::vector<uint32_t>& active = paths.active;
+    active.resize(static_cast<size_t>(width) * height);
+#pragma omp parallel for
+    for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+            const uint32_t path = static_cast<uint32_t>(i * pitch + j);
+            paths.ray[path] = cam.generate_ray(i, j);
+            paths.throughput[path] = glm::vec3(1.0f);
+            paths.alive[path] = 1;
+            paths.sampler[path] = Sampler(j, i, width, info.frame, RNG_STREAM_PATH);
+            paths.has_shadow_ray[path] = 0;
+            radiance[path] = glm::vec3(0.0f);
+            active[i * width + j] = path;
         }
     }
 
-    return colors;
-}
+    std::vector<HitInfo>& hits = paths.hits;
+    std::vector<uint32_t>& shadow_queue = paths.shadow_queue;
 
-std::vector<std::vector<glm::vec3>> raytrace(SamplingMode sampling_mode, ShadingMode render_mode, RenderInfo& info) {
-    auto hit_infos = info.cam.get_hit_info_from_camera_per_frame(info.world);
+    for (int depth = 0; depth <= MAX_RAY_DEPTH && !active.empty(); depth++) {
+        const int64_t active_count = static_cast<int64_t>(active.size());
 
-    // send hit infos to ReSTIR
-    std::vector<std::vector<SamplerResult>> light_samples_per_ray;
-    if (render_mode != RENDER_NORMALS) {
-        light_samples_per_ray = info.light_sampler.sample_lights(hit_infos, info.world);
-    }
-
-    std::vector<std::vector<glm::vec3> > colors = std::vector<std::vector<glm::vec3> >(
-        info.cam.image_height, std::vector<glm::vec3>(info.cam.image_width, glm::vec3(0.0f)));
-
-    // loop over hit_infos and light_samples_per_ray at the same time and feed them into the shade
-#pragma omp parallel for
-    for (int i = 0; i < hit_infos.size(); i++) {
-        HitInfo hit = hit_infos[i];
-		int j = i / info.cam.image_width;
-		int k = i % info.cam.image_width;
+        // Extend
+#pragma omp parallel for schedule(dynamic)
+        for (int64_t first = 0; first < active_count; first += PATH_CHUNK) {
+            const size_t count = std::min(PATH_CHUNK, static_cast<size_t>(active_count - first));
+            std::array<Ray, PATH_CHUNK> rays;
+            for (size_t k = 0; k < count; k++) {
+                rays[k] = paths.ray[active[first + k]];
+            }
+            world.intersect(std::span<const Ray>(rays.data(), count), std::span<HitInfo>(hits.data() + first, count));
+        }
 
-        SamplerResult sample;
+        // Shade
+#pragma omp parallel for schedule(dynamic, PATH_CHUNK)
+        for (int64_t q = 0; q < active_count; q++) {
+            shade_path(paths, radiance, active[q], hits[q], depth, lights);
+        }
 
-        if (render_mode != RENDER_NORMALS) {
-            sample = light_samples_per_ray[j][k];
+        // Compact the surviving paths and the shadow rays into the queues of the next stages
+        shadow_queue.clear();
+        size_t alive_count = 0;
+        for (const uint32_t path : active) {
+            if (paths.has_shadow_ray[path]) {
+                shadow_queue.push_back(path);
+            }
+            if (paths.alive[path]) {
+                active[alive_count++] = path;
+            }
         }
-        
-        glm::vec3 color;
-        if (render_mode == RENDER_SHADING) {
-            if (sampling_mode == SamplingMode::Uniform) {
-                color = shadeUniform(hit, sample, info.world, info.light_sampler);
+        active.resize(alive_count);
+
+        // Connect
+        const int64_t shadow_count = static_cast<int64_t>(shadow_queue.size());
+#pragma omp parallel for schedule(dynamic)
+        for (int64_t first = 0; first < shadow_count; first += PATH_CHUNK) {
+            const size_t count = std::min(PATH_CHUNK, static_cast<size_t>(shadow_count - first));
+            std::array<Ray, PATH_CHUNK> rays;
+            std::array<float, PATH_CHUNK> dists;
+            std::array<uint8_t, PATH_CHUNK> occluded;
+            for (size_t k = 0; k < count; k++) {
+                const uint32_t path = shadow_queue[first + k];
+                rays[k] = paths.shadow_ray[path];
+                dists[k] = paths.shadow_dist[path];
             }
-            else {
-				color = shadeRIS(hit, sample, info.world);
+            world.is_occluded(std::span<const Ray>(rays.data(), count), std::span<const float>(dists.data(), count),
+                std::span<uint8_t>(occluded.data(), count));
+
+            for (size_t k = 0; k < count; k++) {
+                if (!occluded[k]) {
+                    const uint32_t path = shadow_queue[first + k];
+                    radiance[path] += paths.shadow_contribution[path];
+                }
             }
         }
-        else if (render_mode == RENDER_DEBUG) {
-            color = shade_debug(hit, sample, info.world);
+    }
+}
+
+void raytrace(SamplingMode sampling_mode, ShadingMode render_mode, RenderInfo& info, Framebuffer<glm::vec3>& colors) {
+    // Every tile goes through the whole frame while its data is still in cache: primary rays, initial candidates
+    // and temporal reuse in the first pass, then one pass per spatial reuse iteration, the last of which also shades.
+    // The spatial passes read neighbouring tiles, so the scheduler holds every pass back until the pass before it
+    // is done for every tile in its halo.
+    const bool retrace = info.cam.begin_gbuffer(info.world);
+    const GBuffer& gbuffer = info.cam.get_gbuffer();
+    RestirLightSampler& sampler = info.light_sampler;
+    sampler.begin_frame(info.frame, info.cam.get_reprojection());
+    const bool sample_lights = render_mode == RENDER_SHADING && sampler.num_lights() > 0;
+    const int spatial_passes = sample_lights ? sampler.spatial_pass_count() : 0;
+
+    // Build the lazy tables now, the tiles only read them
+    info.world.get_material_table();
+    info.world.get_lights();
+
+    // Every pixel is written by its tile, so the old contents do not need to be cleared
+    colors.resize(info.cam.image_width, info.cam.image_height);
+
+    const TileScheduler scheduler(info.cam.image_width, info.cam.image_height, RENDER_TILE_SIZE,
+        sample_lights ? sampler.spatial_halo() : 0);
+    scheduler.run(1 + spatial_passes, [&](const int pass, const Tile& tile) {
+        if (pass == 0) {
+            if (retrace) {
+                info.cam.trace_gbuffer_tile(info.world, tile);
+            }
+            if (sample_lights) {
+                sampler.initial_pass(tile, gbuffer, info.world);
+            }
         }
-        else if (render_mode == RENDER_NORMALS) {
-            color = shade_normal(hit, sample, info.world);
+        else {
+            sampler.spatial_pass(pass - 1, tile, gbuffer, info.world);
         }
 
-        colors[j][k] = color;
-    }
+        // The debug view queries the sphere clouds for the whole frame at once, after the G-buffer is done
+        if (pass < spatial_passes || render_mode == RENDER_DEBUG) {
+            return;
+        }
 
-    return colors;
+        for (int j = tile.y0; j < tile.y1; j++) {
+            glm::vec3* row = colors.row(j);
+            for (int k = tile.x0; k < tile.x1; k++) {
+                const int i = j * info.cam.image_width + k;
+                const HitInfo hit = gbuffer.hit(i);
+
+                SamplerResult sample;
+                if (sample_lights) {
+                    sample = sampler.result(i, gbuffer);
+                }
+
+                glm::vec3 color;
+                if (render_mode == RENDER_SHADING) {
+                    if (sampling_mode == SamplingMode::Uniform) {
+                        color = shadeUniform(hit, sample, info.world, sampler);
+                    }
+                    else {
+                        color = shadeRIS(hit, sample, info.world);
+                    }
+                }
+                else if (render_mode == RENDER_NORMALS) {
+                    color = shade_normal(hit, sample, info.world);
+                }
+
+                row[k] = color;
+            }
+        }
+    });
+
+    if (render_mode == RENDER_DEBUG) {
+        shade_debug(gbuffer, info.world, colors);
+    }
+    else if (render_mode == RENDER_SHADING) {
+        // Indirect light of the photon map, if GI uses it
+        info.world.photon_map.gather(gbuffer, colors);
+    }
 }
\ No newline at end of file
@@ -1,18 +1,49 @@
 #pragma once
 
 #include <glm/vec3.hpp>
+#include <vector>
+#include <cstdint>
 
 #include "camera.hpp"
 #include "world.hpp"
 #include "restir.hpp"
 #include "shading.hpp" 
+#include "framebuffer.hpp"
+#include "aligned_allocator.hpp"
+#include "hit_info.hpp"
+#include "sampler.hpp"
 
 struct RenderInfo {
     Camera& cam;
     World& world;
     RestirLightSampler& light_sampler;
+    uint32_t frame = 0; // Keys the random numbers, so rendering the same frame twice gives the same image
 };
 
-std::vector<std::vector<glm::vec3>> raytrace(SamplingMode sampling_mode, ShadingMode render_mode, RenderInfo& info);
+// State of every path of the wavefront path tracer, indexed like the pixels of the framebuffer (y * pitch + x).
+// The radiance of a path is accumulated in the framebuffer itself.
+struct PathBuffer {
+    aligned_vector<Ray> ray;               // Next ray to extend the path with
+    aligned_vector<glm::vec3> throughput;
+    aligned_vector<uint8_t> alive;
+    aligned_vector<Sampler> sampler;       // Random numbers of the path, keyed by pixel and frame
 
-std::vector<std::vector<glm::vec3>> pathtrace(RenderInfo& info);
\ No newline at end of file
+    // Shadow ray towards the light sampled at the current vertex
+    aligned_vector<Ray> shadow_ray;
+    aligned_vector<float> shadow_dist;
+    aligned_vector<glm::vec3> shadow_contribution; // Added to radiance if the light is visible
+    aligned_vector<uint8_t> has_shadow_ray;
+
+    std::vector<uint32_t> active;       // Paths that are still being extended
+    std::vector<HitInfo> hits;          // Hit of every active path, in the order of active
+    std::vector<uint32_t> shadow_queue; // Paths with a shadow ray to trace
+
+    // Only reallocates when the number of paths changes
+    void resize(const size_t n);
+};
+
+// Both renderers write the frame into colors, which is resized to the camera if needed. Keep the
+// framebuffer (and the path tracer's PathBuffer) alive across frames so they are only allocated once.
+void raytrace(SamplingMode sampling_mode, ShadingMode render_mode, RenderInfo& info, Framebuffer<glm::vec3>& colors);
+
+void pathtrace(RenderInfo& info, PathBuffer& paths, Framebuffer<glm::vec3>& colors);
\ No newline at end of file
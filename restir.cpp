@@ -4,23 +4,22 @@
 #include <vector>
 #include <array>
 #include <span>
-#include <random>
 #include <memory>
+#include <algorithm>
+#include <cmath>
 
 #include "constants.hpp"
 #include "world.hpp"
 #include "ray.hpp"
 #include "light.hpp"
 #include "hit_info.hpp"
+#include "util.hpp"
 
 
-thread_local std::mt19937 rng(std::random_device{}());
-std::uniform_real_distribution<float> dist(0.0f, 1.0f);
-
-SampleInfo::SampleInfo() : light(), light_point(0.0f) {
+SampleInfo::SampleInfo() : light_index(INVALID_LIGHT), light_point(0.0f) {
 }
 
-SampleInfo::SampleInfo(const std::weak_ptr<PointLight> light, const glm::vec3& light_point) : light(light), light_point(light_point) {
+SampleInfo::SampleInfo(const uint32_t light_index, const glm::vec3& light_point) : light_index(light_index), light_point(light_point) {
 }
 
 Reservoir::Reservoir() : M(0),
@@ -28,17 +27,14 @@ w_sum(0.0f), phat(0.0f), y(), W(0.0f) {
 }
 
 SamplerResult::SamplerResult() : light_point(0.0f), light_dir(0.0f),
-light(), W(0.0f) {
+W(0.0f), light_index(INVALID_LIGHT) {
 }
 
-//static std::shared_ptr<PointLight> empty_light = std::make_shared<PointLight>(PointLight(glm::vec3(1.0f), 1.0f, glm::vec3(0.0f), glm::vec3(1.0f,0.0f,0.0f)));
-
-
-bool Reservoir::update(const SampleInfo x_i, const float w_i, const float n_phat) {
+bool Reservoir::update(const SampleInfo& x_i, const float w_i, const float n_phat, Rng& rng) {
 	w_sum = w_sum + w_i;
 	M = M + 1;
 	// Condition for when w_i is 0 and w_sum is also 0 so we get 0/0
-	if (dist(rng) < (w_i + 1e-6f) / (w_sum + 1e-6f)) {
+	if (rng.next_float() < (w_i + 1e-6f) / (w_sum + 1e-6f)) {
 		y = x_i;
 		phat = n_phat;
 		return true;
@@ -62,15 +58,15 @@ void Reservoir::replace(const Reservoir &other) {
 	phat = other.phat;
 }
 
-Reservoir Reservoir::combineReservoirs(const std::span<const Reservoir*>& reservoirs) {
+Reservoir Reservoir::combineReservoirs(std::span<const Reservoir> reservoirs, Rng& rng) {
 	Reservoir s;
-	for (auto& r : reservoirs) {
-		s.update(r->y, r->phat * r->W * r->M, r->phat);
+	for (const Reservoir& r : reservoirs) {
+		s.update(r.y, r.phat * r.W * r.M, r.phat, rng);
 	}
 
 	s.M = 0;
-	for (auto& r : reservoirs) {
-		s.M += r->M;
+	for (const Reservoir& r : reservoirs) {
+		s.M += r.M;
 	}
 
 	s.W = calculate_reservoir_weight(s.phat, s.M, s.w_sum);
@@ -78,22 +74,22 @@ Reservoir Reservoir::combineReservoirs(const std::span<const Reservoir*>& reserv
 	return s;
 }
 
-Reservoir Reservoir::combineReservoirsUnbiased(const std::span<const Reservoir*>& reservoirs) {
+Reservoir Reservoir::combineReservoirsUnbiased(std::span<const Reservoir> reservoirs, Rng& rng) {
 	Reservoir s;
-	for (auto& r : reservoirs) {
-		s.update(r->y, r->phat * r->W * r->M, r->phat);
+	for (const Reservoir& r : reservoirs) {
+		s.update(r.y, r.phat * r.W * r.M, r.phat, rng);
 	}
 
 	s.M = 0;
-	for (auto& r : reservoirs) {
-		s.M += r->M;
+	for (const Reservoir& r : reservoirs) {
+		s.M += r.M;
 	}
 
 	int Z = 0;
 
-	for (auto& r : reservoirs) {
-		if (r->phat > 0) {
-			Z += r->M;
+	for (const Reservoir& r : reservoirs) {
+		if (r.phat > 0) {
+			Z += r.M;
 		}
 	}
 
@@ -115,104 +111,280 @@ void Reservoir::reset() {
 	phat = 0.0f;
 }
 
-RestirLightSampler::RestirLightSampler(const int x, const int y,
-	std::vector<std::weak_ptr<PointLight>>& lights_vec) : x_pixels(x), y_pixels(y) {
-	prev_reservoirs = std::vector(y * x, Reservoir());
-	current_reservoirs = std::vector(y * x, Reservoir());
-	lights = lights_vec;
+ReservoirBuffer::ReservoirBuffer(const size_t n) :
+	light_index(n, INVALID_LIGHT), light_point(n, glm::vec3(0.0f)),
+	w_sum(n, 0.0f), M(n, 0), phat(n, 0.0f), W(n, 0.0f) {
+}
+
+Reservoir ReservoirBuffer::load(const size_t i) const {
+	Reservoir r;
+	r.y = SampleInfo(light_index[i], light_point[i]);
+	r.w_sum = w_sum[i];
+	r.M = M[i];
+	r.phat = phat[i];
+	r.W = W[i];
+	return r;
+}
+
+void ReservoirBuffer::store(const size_t i, const Reservoir& r) {
+	light_index[i] = r.y.light_index;
+	light_point[i] = r.y.light_point;
+	w_sum[i] = r.w_sum;
+	M[i] = r.M;
+	phat[i] = r.phat;
+	W[i] = r.W;
+}
+
+void ReservoirBuffer::reset(const size_t i) {
+	light_index[i] = INVALID_LIGHT;
+	light_point[i] = glm::vec3(0.0f);
+	w_sum[i] = 0.0f;
+	M[i] = 0;
+	phat[i] = 0.0f;
+	W[i] = 0.0f;
+}
+
+void ReservoirBuffer::reset() {
+	std::fill(light_index.begin(), light_index.end(), INVALID_LIGHT);
+	std::fill(light_point.begin(), light_point.end(), glm::vec3(0.0f));
+	std::fill(w_sum.begin(), w_sum.end(), 0.0f);
+	std::fill(M.begin(), M.end(), 0);
+	std::fill(phat.begin(), phat.end(), 0.0f);
+	std::fill(W.begin(), W.end(), 0.0f);
+}
+
+void ReservoirBuffer::remap(const LightRemap& remap) {
+	for (size_t i = 0; i < size(); i++) {
+		const uint32_t index = remap(light_index[i]);
+		if (index == INVALID_LIGHT) {
+			reset(i);
+		}
+		else {
+			light_index[i] = index;
+		}
+	}
+}
+
+void ReservoirBuffer::swap(ReservoirBuffer& other) noexcept {
+	light_index.swap(other.light_index);
+	light_point.swap(other.light_point);
+	w_sum.swap(other.w_sum);
+	M.swap(other.M);
+	phat.swap(other.phat);
+	W.swap(other.W);
+}
+
+RestirLightSampler::RestirLightSampler(const int x, const int y, World& world) :
+	x_pixels(x), y_pixels(y), lights(&world.get_lights()),
+	light_distribution(&world.light_distribution), light_tree(&world.light_tree) {
+	final_reservoirs = ReservoirBuffer(y * x);
+	history_reservoirs = ReservoirBuffer(y * x);
+	temporal_reservoirs = ReservoirBuffer(y * x);
+	spatial_reservoirs = ReservoirBuffer(y * x);
 }
 
 void RestirLightSampler::reset() {
 	// Reset the reservoirs
-	for (int y = 0; y < y_pixels; y++) {
-		for (int x = 0; x < x_pixels; x++) {
-			current_reservoirs[y * x_pixels + x].reset();
-			prev_reservoirs[y * x_pixels + x].reset();
-		}
+	temporal_reservoirs.reset();
+	spatial_reservoirs.reset();
+	final_reservoirs.reset();
+	history_reservoirs.reset();
+}
+
+void RestirLightSampler::remap_lights(const LightRemap& remap) {
+	if (remap.empty()) {
+		return;
 	}
+	final_reservoirs.remap(remap);
+	history_reservoirs.remap(remap);
+	temporal_reservoirs.remap(remap);
+	spatial_reservoirs.remap(remap);
 }
 
-std::vector<std::vector<SamplerResult> > RestirLightSampler::sample_lights(std::vector<HitInfo> hit_infos, World& scene) {
-	if (num_lights() == 0) {
-		return std::vector(y_pixels, std::vector<SamplerResult>(x_pixels));
+void RestirLightSampler::begin_frame(const uint32_t frame, const Reprojection& reprojection) {
+	this->frame = frame;
+	this->reprojection = reprojection;
+	if (uses_reuse()) {
+		// Every reservoir of the last frame stays readable while the current ones are written
+		final_reservoirs.swap(history_reservoirs);
 	}
-	// Swap the current and previous reservoirs: The previous current frame is now the previous frame
-	swap_buffers();
+}
 
+bool RestirLightSampler::uses_reuse() const {
+	return sampling_mode != SamplingMode::Uniform && sampling_mode != SamplingMode::RIS;
+}
+
+int RestirLightSampler::history_pixel(const int i, const GBuffer& gbuffer) const {
+	if (reprojection.gbuffer == nullptr) {
+		return i;
+	}
+
+	const GBuffer& previous = *reprojection.gbuffer;
+	if (previous.get_width() != x_pixels || previous.get_height() != y_pixels) {
+		return -1;
+	}
+
+	const int h = reprojection.pixel(gbuffer.position[i]);
+	if (h < 0 || !previous.is_hit(h)) {
+		return -1;
+	}
+
+	// The previous pixel has to see the same surface: at the depth the point has from the previous camera
+	// and with a similar normal. Otherwise it is a disocclusion and the history is not reused.
+	const float expected_depth = glm::distance(previous.origin, gbuffer.position[i]);
+	const bool different_depth = fabs(previous.depth[h] - expected_depth) > REPROJECTION_DEPTH_TOLERANCE * expected_depth;
+	const bool different_normals = glm::distance(gbuffer.get_normal(i), previous.get_normal(h)) > NORMAL_DEVIATION;
+	if (different_depth || different_normals) {
+		return -1;
+	}
+	return h;
+}
+
+int RestirLightSampler::spatial_pass_count() const {
+	return uses_reuse() ? static_cast<int>(SPATIAL_ITERATIONS.size()) : 0;
+}
+
+int RestirLightSampler::spatial_halo() const {
+	int halo = 0;
+	for (int n = 0; n < spatial_pass_count(); n++) {
+		halo = std::max(halo, SPATIAL_ITERATIONS[n].radius);
+	}
+	return halo;
+}
+
+ReservoirBuffer& RestirLightSampler::spatial_target(const int iteration) {
+	// Counted back from the last iteration, which has to end up in final_reservoirs
+	return (spatial_pass_count() - 1 - iteration) % 2 == 0 ? final_reservoirs : spatial_reservoirs;
+}
+
+const ReservoirBuffer& RestirLightSampler::spatial_source(const int iteration) {
+	return iteration == 0 ? temporal_reservoirs : spatial_target(iteration - 1);
+}
+
+void RestirLightSampler::initial_pass(const Tile& tile, const GBuffer& gbuffer, World& scene) {
 	// For every pixel:
 	// 1. Sample M times from the light sources; Choose one sample (reservoir)
-	// 2. Check visibility of the light sample
-	// 3. Temporal update - update the current reservoir with the previous one
-	// 4. Spatial update - update the current reservoir with the neighbors
-	// 5. Return the sample in the current reservoir
+	// 2. Check visibility of the light sample, the shadow rays of up to BATCH pixels are tested at once
+	// 3. Temporal update - update the current reservoir with the one the last frame had at the same surface
+	constexpr size_t BATCH = 64;
+	std::array<Reservoir, BATCH> batch;
+	std::array<Rng, BATCH> rngs;
+	std::array<int, BATCH> pixels;
+	std::array<Ray, BATCH> shadow_rays;
+	std::array<float, BATCH> shadow_dists;
+	std::array<uint8_t, BATCH> occluded;
+	size_t count = 0;
+
+	const bool reuse = uses_reuse();
+	ReservoirBuffer& target = spatial_pass_count() > 0 ? temporal_reservoirs : final_reservoirs;
+
+	const auto flush = [&]() {
+		scene.is_occluded(std::span<const Ray>(shadow_rays.data(), count),
+			std::span<const float>(shadow_dists.data(), count),
+			std::span<uint8_t>(occluded.data(), count));
+
+		for (size_t k = 0; k < count; k++) {
+			const int i = pixels[k];
+			Reservoir& current = batch[k];
+			if (occluded[k]) {
+				current.W = 0;
+			}
 
-#pragma omp parallel for
-	for (int y = 0; y < y_pixels; y++) {
-		for (int x = 0; x < x_pixels; x++) {
-			HitInfo& hi = hit_infos[y * x_pixels + x];
+			if (reuse) {
+				const int h = history_pixel(i, gbuffer);
+				if (h >= 0) {
+					Reservoir prev = history_reservoirs.load(h);
+					prev.M = fmin(M_CAP * current.M, prev.M);
+					current = temporal_update(current, prev, rngs[k]);
+				}
+			}
 
-			auto material = hi.mat_ptr.lock();
-			if (hi.t == 1E30f || material->emits_light()) {
+			target.store(i, current);
+		}
+		count = 0;
+	};
+
+	for (int y = tile.y0; y < tile.y1; y++) {
+		for (int x = tile.x0; x < tile.x1; x++) {
+			const int i = y * x_pixels + x;
+			if (!gbuffer.is_hit(i) || gbuffer.material(i)->emits_light()) {
+				target.reset(i);
 				continue;
 			}
 
-			Reservoir& current = current_reservoirs[y * x_pixels + x];
-			current.reset();
-
-			Reservoir& prev = prev_reservoirs[y * x_pixels + x];
+			const HitInfo hi = gbuffer.hit(i);
 
-			set_initial_sample(current, hi);
-			visibility_check(current, hi, scene);
+			Reservoir& current = batch[count];
+			current = Reservoir();
+			rngs[count] = Rng(i, frame, RNG_STREAM_INITIAL);
+			Sampler sampler(x, y, x_pixels, frame, RNG_STREAM_INITIAL, m);
+			set_initial_sample(current, hi, sampler, rngs[count]);
 
-			if (sampling_mode != SamplingMode::Uniform && sampling_mode != SamplingMode::RIS) {
-				prev.M = fmin(M_CAP * current.M, prev.M);
-				current_reservoirs[y * x_pixels + x] = temporal_update(current, prev);
+			shadow_ray(current, hi, shadow_rays[count], shadow_dists[count]);
+			pixels[count] = i;
+			if (++count == BATCH) {
+				flush();
 			}
 		}
 	}
+	flush();
+}
 
-	std::vector results(y_pixels, std::vector<SamplerResult>(x_pixels));
-	if (sampling_mode != SamplingMode::Uniform && sampling_mode != SamplingMode::RIS) {
-		 swap_buffers();
-	}
-#pragma omp parallel for
-	for (int y = 0; y < y_pixels; y++) {
-		for (int x = 0; x < x_pixels; x++) {
-			if (sampling_mode != SamplingMode::Uniform && sampling_mode != SamplingMode::RIS) {
-				 spatial_update(x, y, hit_infos, scene);
+void RestirLightSampler::spatial_pass(const int iteration, const Tile& tile, const GBuffer& gbuffer, World& scene) {
+	// 4. Spatial update - update the current reservoir with the neighbors
+	const ReservoirBuffer& source = spatial_source(iteration);
+	ReservoirBuffer& target = spatial_target(iteration);
+	for (int y = tile.y0; y < tile.y1; y++) {
+		for (int x = tile.x0; x < tile.x1; x++) {
+			const int i = y * x_pixels + x;
+			if (!gbuffer.is_hit(i) || gbuffer.material(i)->emits_light()) {
+				target.reset(i);
+				continue;
 			}
-
-			Reservoir& res = current_reservoirs[y * x_pixels + x];
-			HitInfo& hi = hit_infos[y * x_pixels + x];
-
-			results[y][x].light_point = res.y.light_point;
-			results[y][x].light_dir = normalize(res.y.light_point - hi.r.at(hi.t));
-			results[y][x].light = res.y.light;
-			results[y][x].W = res.W;
+			spatial_update(iteration, x, y, gbuffer, scene, source, target);
 		}
 	}
-	return results;
 }
 
-void RestirLightSampler::set_initial_sample(Reservoir& r, const HitInfo& hi) {
+SamplerResult RestirLightSampler::result(const int i, const GBuffer& gbuffer) const {
+	// 5. Return the sample in the final reservoir
+	SamplerResult result;
+	const glm::vec3& light_point = final_reservoirs.light_point[i];
+
+	result.light_point = light_point;
+	result.light_dir = normalize(light_point - gbuffer.position[i]);
+	result.light_index = final_reservoirs.light_index[i];
+	result.W = final_reservoirs.W[i];
+	return result;
+}
+
+void RestirLightSampler::set_initial_sample(Reservoir& r, const HitInfo& hi, Sampler& sampler, Rng& rng) {
+	// The cut only depends on the hit, so all candidates are drawn from the same one
+	LightCut cut;
+	const bool lightcut = uses_lightcut();
+	if (lightcut) {
+		cut = light_tree->cut(hi.r.at(hi.t), hi.normal());
+	}
+
 	// Sample M times from the light sources
 	for (int k = 0; k < m; k++) {
-		float light_choose_pdf;
-		auto l = pick_light(light_choose_pdf).lock();
+		sampler.start_sample(k);
+		const glm::vec2 u = sampler.get_2d(LIGHT_CHOICE_SEQUENCE);
 
-		if (!l) {
-			std::cerr << "Error: No light source found!" << std::endl;
-			exit(1);
+		float light_choose_pdf;
+		const uint32_t light_index = lightcut ? light_tree->sample(cut, u.x, light_choose_pdf) : pick_light(hi, u, light_choose_pdf);
+		if (light_choose_pdf <= 0.0f) {
+			continue;
 		}
 
-		float light_pos_pdf;
-		const glm::vec3 sample_point = l->sample_on_light(light_pos_pdf);
+		// Point lights are sampled at their position
+		const glm::vec3 sample_point = lights->position[light_index];
 
-		SampleInfo sample = SampleInfo(l, sample_point);
+		SampleInfo sample = SampleInfo(light_index, sample_point);
 
 		float W, phat;
-		get_light_weight(sample, hi, W, phat);
-		r.update(sample, W, phat);
+		get_light_weight(sample, hi, light_choose_pdf, W, phat);
+		r.update(sample, W, phat, rng);
 
 		if (sampling_mode == SamplingMode::Uniform)
 			break;
@@ -221,9 +393,7 @@ void RestirLightSampler::set_initial_sample(Reservoir& r, const HitInfo& hi) {
 	r.W = calculate_reservoir_weight(r.phat, r.M, r.w_sum);
 }
 
-bool RestirLightSampler::is_visible(Reservoir& res, const HitInfo& hi, World& scene) {
-	// Check the visibility of the light sample
-
+void RestirLightSampler::shadow_ray(const Reservoir& res, const HitInfo& hi, Ray& ray, float& max_t) const {
 	// Point of intersection [x]
 	const glm::vec3 I = hi.r.at(hi.t);
 
@@ -232,110 +402,143 @@ bool RestirLightSampler::is_visible(Reservoir& res, const HitInfo& hi, World& sc
 
 	const glm::vec3 L = (res.y.light_point - I) / dist; // Direction to light
 
-	Ray shadow_ray = Ray(I + 0.001f * L, L);
-	const bool is_occluded = scene.is_occluded(shadow_ray, dist - 1e-2f);
-
-	return !is_occluded;
-}
-
-bool RestirLightSampler::visibility_check(Reservoir& res, const HitInfo& hi, World& scene, bool reset_phat) {
-	const bool visible = is_visible(res, hi, scene);
-
-	if (!visible) {
-		res.W = 0;
-		if (reset_phat) {
-			res.phat = 0;
-		}
-	}
-
-	return visible;
+	ray = Ray(I + 0.001f * L, L);
+	max_t = dist - 1e-2f;
 }
 
-Reservoir RestirLightSampler::temporal_update(const Reservoir& current, const Reservoir& prev) {
-	std::array<const Reservoir*, 2> refs = { &current, &prev };
-	return Reservoir::combineReservoirs(refs);
+Reservoir RestirLightSampler::temporal_update(const Reservoir& current, const Reservoir& prev, Rng& rng) {
+	const std::array<Reservoir, 2> pair = { current, prev };
+	return Reservoir::combineReservoirs(pair, rng);
 }
 
-void RestirLightSampler::spatial_update(const int x, const int y, const std::vector<HitInfo>& hit_infos, World& scene) {
-	std::vector<const Reservoir*> candidates;
-	candidates.push_back(&prev_reservoirs[y * x_pixels + x]);
+void RestirLightSampler::spatial_update(const int iteration, const int x, const int y, const GBuffer& gbuffer, World& scene,
+	const ReservoirBuffer& source, ReservoirBuffer& target) {
+	const int i = y * x_pixels + x;
+	const int k = SPATIAL_ITERATIONS[iteration].k;
+	const int radius = SPATIAL_ITERATIONS[iteration].radius;
 
-	const HitInfo& current_hit = hit_infos[y * x_pixels + x];
+	// The pixel itself and the neighbours that pass the tests below
+	std::array<Reservoir, MAX_NEIGHBOUR_K + 1> candidates;
+	size_t candidate_count = 0;
+	candidates[candidate_count++] = source.load(i);
 
-	const glm::vec3 N = current_hit.triangle.normal(current_hit.uv);
+	const HitInfo current_hit = gbuffer.hit(i);
+	// Every iteration draws other neighbours: its own index for the rng and its own dimensions of the sampler
+	Rng rng(i + iteration * x_pixels * y_pixels, frame, RNG_STREAM_SPATIAL);
+	Sampler sampler(x, y, x_pixels, frame, RNG_STREAM_SPATIAL, MAX_NEIGHBOUR_K);
 
-	// Generate neighbours by randomly sampling a NEIGHBOUR_RADIUS radius around the current pixel
-	std::array<glm::ivec2, NEIGHBOUR_K> offsets;
+	const glm::vec3 N = gbuffer.get_normal(i);
 
-	int c = 0;
-	while (c < NEIGHBOUR_K) {
-		const float phi = dist(rng) * 2.0f * glm::pi<float>();
-		const float r = dist(rng) * NEIGHBOUR_RADIUS;
+	// Generate neighbours by randomly sampling the radius of the iteration around the current pixel
+	std::array<glm::ivec2, MAX_NEIGHBOUR_K> offsets;
 
-		const int x_offset = r * cosf(phi);
-		const int y_offset = r * sinf(phi);
+	for (int o = 0; o < k; o++) {
+		sampler.start_sample(o, iteration);
+		const glm::vec2 u = sampler.get_2d(NEIGHBOUR_SEQUENCE);
+		const float phi = u.x * 2.0f * glm::pi<float>();
+		// At least one pixel away: one of |cos| and |sin| is at least 1/sqrt(2), so that offset rounds to
+		// a non-zero value and the current pixel is never drawn
+		const float r = 1.0f + u.y * static_cast<float>(radius - 1);
 
-		if (x_offset == 0 && y_offset == 0) {
-			// Skip the current pixel
-			continue;
-		}
-
-		offsets[c] = glm::ivec2(x_offset, y_offset);
-		c++;
+		offsets[o] = glm::ivec2(static_cast<int>(std::round(r * cosf(phi))), static_cast<int>(std::round(r * sinf(phi))));
 	}
 
-	for (glm::ivec2& offset : offsets) {
-		const int nx = x + offset.x;
-		const int ny = y + offset.y;
+	// Neighbours that pass the similarity tests, their visibility is tested in one batch
+	std::array<Reservoir, MAX_NEIGHBOUR_K> similar;
+	std::array<Ray, MAX_NEIGHBOUR_K> shadow_rays;
+	std::array<float, MAX_NEIGHBOUR_K> shadow_dists;
+	std::array<uint8_t, MAX_NEIGHBOUR_K> occluded;
+	size_t similar_count = 0;
+
+	for (int o = 0; o < k; o++) {
+		const int nx = x + offsets[o].x;
+		const int ny = y + offsets[o].y;
 
 		const bool x_within_bounds = nx >= 0 && nx < x_pixels;
 		const bool y_within_bounds = ny >= 0 && ny < y_pixels;
 
 		if (x_within_bounds && y_within_bounds) {
-			const HitInfo& hi = hit_infos[ny * x_pixels + nx];
+			const int n = ny * x_pixels + nx;
 
 			// If the neighbour has no hit or is a light source, skip it, since it's reservoir is not valid
-			auto material = hi.mat_ptr.lock();
-			const bool invalid_sample = hi.t == 1E30f || material->emits_light();
+			const bool invalid_sample = !gbuffer.is_hit(n) || gbuffer.material(n)->emits_light();
 
 			// Check if the normals are similar
-			const glm::vec3 N2 = hi.triangle.normal(hi.uv);
+			const glm::vec3 N2 = gbuffer.get_normal(n);
 			const bool different_normals = glm::distance(N, N2) > NORMAL_DEVIATION;
 
 			// Check if the hits are not far away from each other
-			const float dist = glm::distance(current_hit.r.at(current_hit.t), hi.r.at(hi.t));
+			const float dist = glm::distance(gbuffer.position[i], gbuffer.position[n]);
 			const bool different_t = dist > T_DEVIATION;
 
-			Reservoir& candidate = prev_reservoirs[ny * x_pixels + nx];
-
 			if (!invalid_sample && !different_normals && !different_t) {
-				//visibility_check(candidate, current_hit, scene, true);
-				if (is_visible(candidate, current_hit, scene)) {
-					candidates.push_back(&candidate);
-				}
-				
+				similar[similar_count] = source.load(n);
+				shadow_ray(similar[similar_count], current_hit, shadow_rays[similar_count], shadow_dists[similar_count]);
+				similar_count++;
 			}
 		}
 	}
 
-	current_reservoirs[y * x_pixels + x] = Reservoir::combineReservoirs(std::span(candidates));
+	scene.is_occluded(std::span<const Ray>(shadow_rays.data(), similar_count),
+		std::span<const float>(shadow_dists.data(), similar_count),
+		std::span<uint8_t>(occluded.data(), similar_count));
+
+	for (size_t s = 0; s < similar_count; s++) {
+		if (!occluded[s]) {
+			candidates[candidate_count++] = similar[s];
+		}
+	}
+
+	target.store(i, Reservoir::combineReservoirs(std::span<const Reservoir>(candidates.data(), candidate_count), rng));
+}
+
+[[nodiscard]] uint32_t RestirLightSampler::pick_light(const HitInfo& hi, const glm::vec2& u, float& pdf) const {
+	if (sampling_mode == SamplingMode::Uniform || light_distribution->size() != lights->size()) {
+		// Pick a random light source uniformly
+		const int index = sample_light_index(u.x);
+		pdf = 1.0f / static_cast<float>(num_lights());
+		return static_cast<uint32_t>(index);
+	}
+
+	if (light_selection == LightSelection::Tree && light_tree->size() == lights->size()) {
+		// Traverse the light tree towards the lights that matter for this hit
+		const glm::vec3 P = hi.r.at(hi.t);
+		const glm::vec3 N = hi.normal();
+		return light_tree->sample(P, N, u.x, pdf);
+	}
+
+	// Pick a light source proportional to its power
+	const uint32_t index = light_distribution->sample(u.x, u.y);
+	pdf = light_distribution->pdf(index);
+	return index;
 }
 
-void RestirLightSampler::swap_buffers() {
-	// Swap the current and previous reservoirs
-	current_reservoirs.swap(prev_reservoirs);
+bool RestirLightSampler::uses_lightcut() const {
+	return sampling_mode == SamplingMode::Lightcuts && !light_tree->empty() && light_tree->size() == lights->size();
 }
 
-[[nodiscard]] std::weak_ptr<PointLight> RestirLightSampler::pick_light(float& pdf) const {
-	// Pick a random light source uniformly (standard, change this if you want to use a different sampling strategy)
-	const int index = sample_light_index();
-	pdf = 1.0f / static_cast<float>(num_lights());
-	auto out = lights[index];
-	return out;
+float RestirLightSampler::light_pdf(const uint32_t light_index, const HitInfo& hi) const {
+	if (uses_lightcut()) {
+		const glm::vec3 P = hi.r.at(hi.t);
+		const glm::vec3 N = hi.normal();
+		return light_tree->pdf(light_tree->cut(P, N), light_index);
+	}
+
+	if (sampling_mode == SamplingMode::Uniform || light_distribution->size() != lights->size()) {
+		return 1.0f / static_cast<float>(num_lights());
+	}
+
+	if (light_selection == LightSelection::Tree && light_tree->size() == lights->size()) {
+		const glm::vec3 P = hi.r.at(hi.t);
+		const glm::vec3 N = hi.normal();
+		return light_tree->pdf(light_index, P, N);
+	}
+
+	return light_distribution->pdf(light_index);
 }
 
 
-int RestirLightSampler::sample_light_index() const {
+int RestirLightSampler::sample_light_index(const float u) const {
 	// Thread-local pair to track last used upper bound and distribution
 	thread_local int cached_num_lights = -1;
 
@@ -345,18 +548,14 @@ int RestirLightSampler::sample_light_index() const {
 		cached_num_lights = n;
 	}
 
-	const int out = static_cast<int>(dist(rng) * cached_num_lights);
+	const int out = static_cast<int>(u * cached_num_lights);
 
 	return out;
 }
 
-static float luminance(const glm::vec3& color) {
-	return 0.2126f * color.r + 0.7152f * color.g + 0.0722f * color.b;
-}
-
-void RestirLightSampler::get_light_weight(const SampleInfo& sample,
-														 const HitInfo &hi, float& W, float& phat) const {
-	auto light = sample.light.lock();
+void RestirLightSampler::get_light_weight(const SampleInfo& sample, const HitInfo &hi,
+	const float light_choose_pdf, float& W, float& phat) const {
+	const uint32_t light = sample.light_index;
 
 	// Geometry setup
 	const glm::vec3 hit_point = hi.r.at(hi.t);
@@ -374,8 +573,8 @@ void RestirLightSampler::get_light_weight(const SampleInfo& sample,
 
 	const glm::vec3 L = glm::normalize(light_vec);                // Direction to light
 
-	const glm::vec3 N = hi.triangle.normal(hi.uv);                // Surface normal
-	const glm::vec3 Nl = light->normal(sample.light_point);       // Light normal
+	const glm::vec3 N = hi.normal();                // Surface normal
+	const glm::vec3 Nl = lights->normal[light];                   // Light normal
 
 	const float cos_theta_light = glm::dot(Nl, -L);               // Light angle
 	const float cos_theta = glm::dot(N, L);                       // Surface angle
@@ -387,9 +586,9 @@ void RestirLightSampler::get_light_weight(const SampleInfo& sample,
 	}
 
 	// BRDF
-	auto material = hi.mat_ptr.lock();
+	const Material* material = hi.material;
 	const glm::vec3 fr = material->evaluate(hi, L);               // f_r
-	const glm::vec3 Le = light->intensity * light->c;             // L_i
+	const glm::vec3 Le = lights->emission[light];                 // L_i
 
 	// Target importance (importance of this sample for the current pixel)
 	const float G = cos_theta;
@@ -402,8 +601,7 @@ void RestirLightSampler::get_light_weight(const SampleInfo& sample,
 	}
 
 	// Source PDF: converting from area to solid angle
-	const float light_choose_pdf = 1.0f / static_cast<float>(num_lights());
-	const float light_area_pdf = 1.0f / light->area();
+	const float light_area_pdf = 1.0f / lights->area[light];
 	const float source = light_choose_pdf * light_area_pdf * (dist2 / cos_theta_light); // dA → dOmega
 
 	// Final weight and importance
@@ -3,22 +3,48 @@
 #include <glm/vec3.hpp>
 #include <vector>
 #include <array>
+#include <algorithm>
 #include <span>
-#include <random>
 #include <iostream>
+#include <cstdint>
 
 #include "light.hpp"
 #include "ray.hpp"
 #include "world.hpp"
 #include "hit_info.hpp"
+#include "gbuffer.hpp"
+#include "alias_table.hpp"
+#include "light_tree.hpp"
+#include "tile_scheduler.hpp"
+#include "rng.hpp"
+#include "sampler.hpp"
 
 
 enum class SamplingMode {
     ReSTIR,
     Uniform,
     RIS,
+    Lightcuts, // ReSTIR with candidates drawn from a per-pixel lightcut over the light tree
 };
 
+// How RIS and ReSTIR pick their initial candidates
+enum class LightSelection {
+    Power, // Proportional to light power (alias table)
+    Tree,  // Light tree traversal, aware of distance and orientation
+};
+
+inline std::ostream& operator<<(std::ostream& out, const LightSelection& selection) {
+    switch (selection) {
+    case LightSelection::Power:
+        out << std::string("Power");
+        break;
+    case LightSelection::Tree:
+        out << std::string("Tree");
+        break;
+    }
+    return out;
+}
+
 inline std::ostream& operator<<(std::ostream& out, const SamplingMode& mode) {
     switch (mode) {
     case SamplingMode::ReSTIR:
@@ -30,6 +56,9 @@ inline std::ostream& operator<<(std::ostream& out, const SamplingMode& mode) {
     case SamplingMode::RIS:
         out << std::string("RIS");
         break;
+    case SamplingMode::Lightcuts:
+        out << std::string("Lightcuts");
+        break;
     }
     return out;
 }
@@ -39,17 +68,17 @@ struct SamplerResult {
     glm::vec3 light_point;
     glm::vec3 light_dir;
     float W;
-    std::weak_ptr<PointLight> light;
+    uint32_t light_index; // Index into the light table, INVALID_LIGHT if there is no sample
 
     SamplerResult();
 };
 
 struct SampleInfo {
-    std::weak_ptr<PointLight> light;
+    uint32_t light_index; // Index into the sampler's flat light list
 	glm::vec3 light_point;
 
     SampleInfo();
-	SampleInfo(const std::weak_ptr<PointLight> light, const glm::vec3& light_point);
+	SampleInfo(const uint32_t light_index, const glm::vec3& light_point);
 };
 
 class Reservoir {
@@ -61,51 +90,136 @@ public:
     float W;
 
     Reservoir();
-    bool update(const SampleInfo x_i, const float w_i, const float n_phat);
-    static Reservoir combineReservoirs(const std::span<const Reservoir*>& reservoirs);
-	static Reservoir combineReservoirsUnbiased(const std::span<const Reservoir*>& reservoirs);
+    bool update(const SampleInfo& x_i, const float w_i, const float n_phat, Rng& rng);
+    static Reservoir combineReservoirs(std::span<const Reservoir> reservoirs, Rng& rng);
+	static Reservoir combineReservoirsUnbiased(std::span<const Reservoir> reservoirs, Rng& rng);
     void replace(const Reservoir& other);
     void reset();
 };
 
+// Structure-of-arrays storage for the reservoirs of a whole frame (one entry per pixel).
+// Reservoirs are loaded into a Reservoir value for processing and stored back afterwards,
+// so the passes only stream through the fields they actually touch.
+class ReservoirBuffer {
+public:
+    aligned_vector<uint32_t> light_index;
+    aligned_vector<glm::vec3> light_point;
+    aligned_vector<float> w_sum;
+    aligned_vector<int> M;
+    aligned_vector<float> phat;
+    aligned_vector<float> W;
+
+    ReservoirBuffer() = default;
+    explicit ReservoirBuffer(const size_t n);
+
+    inline size_t size() const {
+        return W.size();
+    }
+
+    Reservoir load(const size_t i) const;
+    void store(const size_t i, const Reservoir& r);
+    void reset(const size_t i);
+    void reset();
+    // Point every reservoir at the new index of its light, reservoirs of erased lights are reset
+    void remap(const LightRemap& remap);
+    void swap(ReservoirBuffer& other) noexcept;
+};
+
+// One iteration of spatial reuse: every pixel combines k neighbours drawn within radius pixels
+struct SpatialIteration {
+    int k;      // At most MAX_NEIGHBOUR_K
+    int radius; // pixels
+};
+
+// Every iteration reuses the result of the one before it, so the samples spread further at a lower
+// cost per pixel than with one wide iteration (Bitterli et al. use two to four iterations of five)
+constexpr std::array<SpatialIteration, 2> SPATIAL_ITERATIONS = { { { 4, 20 }, { 4, 10 } } };
+
+// A radius under 1 pixel has no neighbours to draw
+static_assert(std::ranges::all_of(SPATIAL_ITERATIONS, [](const SpatialIteration& it) {
+    return it.k >= 1 && it.k <= MAX_NEIGHBOUR_K && it.radius >= 1;
+}), "Spatial iterations need k in [1, MAX_NEIGHBOUR_K] and a radius of at least 1 pixel");
+
 class RestirLightSampler {
 public:
-    RestirLightSampler(const int x, const int y,
-        std::vector<std::weak_ptr<PointLight>>& lights_vec);
+    RestirLightSampler(const int x, const int y, World& world);
 
     void reset();
 
-    std::vector<std::vector<SamplerResult>> sample_lights(std::vector<HitInfo> hit_infos, World& scene);
+    // Keep the reservoirs after lights were erased from the light table (see World::remove_point_light).
+    // Reservoirs of the surviving lights keep their sample and history, only those of erased lights are cleared.
+    // Lights appended to the table need nothing, every index stays valid.
+    void remap_lights(const LightRemap& remap);
 
-    void set_initial_sample(Reservoir& r, const HitInfo& hi);
+    // Start a frame. With reuse, the results of the last frame become the history the initial pass reuses
+    // from, found through the reprojection of the camera.
+    void begin_frame(const uint32_t frame, const Reprojection& reprojection);
 
-    bool visibility_check(Reservoir& res, const HitInfo& hi, World& world, bool reset_phat = false);
-    bool is_visible(Reservoir& res, const HitInfo& hi, World& world);
+    // Tiled passes for a render scheduler with a halo of spatial_halo() pixels. initial_pass draws the candidates of
+    // a tile and reuses the last frame, then spatial_pass runs for every iteration in spatial_pass_count() and
+    // combines neighbours. Iteration n of a tile may only run once iteration n - 1 (the initial pass for the first)
+    // of every tile within the halo is done. After the last one, result() holds the sample of every pixel of the tile.
+    void initial_pass(const Tile& tile, const GBuffer& gbuffer, World& scene);
+    void spatial_pass(const int iteration, const Tile& tile, const GBuffer& gbuffer, World& scene);
+    [[nodiscard]] int spatial_pass_count() const;
+    [[nodiscard]] int spatial_halo() const;
+    [[nodiscard]] SamplerResult result(const int i, const GBuffer& gbuffer) const;
 
-    Reservoir temporal_update(const Reservoir& current, const Reservoir& prev);
+    // The candidates are drawn from sampler, rng decides which one the reservoir keeps
+    void set_initial_sample(Reservoir& r, const HitInfo& hi, Sampler& sampler, Rng& rng);
 
-    void spatial_update(const int x, const int y, const std::vector<HitInfo>& hit_infos, World& scene);
+    Reservoir temporal_update(const Reservoir& current, const Reservoir& prev, Rng& rng);
 
-    void swap_buffers();
+    void spatial_update(const int iteration, const int x, const int y, const GBuffer& gbuffer, World& scene,
+        const ReservoirBuffer& source, ReservoirBuffer& target);
 
     int m = 3;
 
+    // Frame number, keys the random numbers of every pixel so a frame can be reproduced exactly
+    uint32_t frame = 0;
+
     SamplingMode sampling_mode = SamplingMode::Uniform;
 
+    LightSelection light_selection = LightSelection::Power;
+
 	inline int num_lights() const {
-		return static_cast<int>(lights.size());
+		return static_cast<int>(lights->size());
 	}
+
+    // Probability of picking the given light as an initial candidate for the hit
+    [[nodiscard]] float light_pdf(const uint32_t light_index, const HitInfo& hi) const;
 private:
     int x_pixels;
     int y_pixels;
-    std::vector<Reservoir> prev_reservoirs;
-    std::vector<Reservoir> current_reservoirs;
-    std::vector<std::weak_ptr<PointLight>> lights;
+    ReservoirBuffer final_reservoirs;    // Result of the current frame
+    ReservoirBuffer history_reservoirs;  // Result of the last frame, read by the temporal reuse
+    ReservoirBuffer temporal_reservoirs; // Reservoirs after temporal reuse, read by the first spatial iteration
+    ReservoirBuffer spatial_reservoirs;  // Ping-pong partner of final_reservoirs between spatial iterations
+    Reprojection reprojection;           // From the current G-buffer to the one of the history
+    const LightTable* lights;
+    const AliasTable* light_distribution;
+    const LightTree* light_tree;
+
+    [[nodiscard]] uint32_t pick_light(const HitInfo& hi, const glm::vec2& u, float& pdf) const;
+
+    // Lightcuts only works once the light tree covers the current light table
+    [[nodiscard]] bool uses_lightcut() const;
+
+    // ReSTIR and Lightcuts reuse reservoirs over time and space, Uniform and RIS do not
+    [[nodiscard]] bool uses_reuse() const;
+
+    // Pixel of the history that saw the same surface as pixel i, -1 if there is none
+    [[nodiscard]] int history_pixel(const int i, const GBuffer& gbuffer) const;
+
+    // Buffers a spatial iteration reads from and writes to, the last one writes final_reservoirs
+    [[nodiscard]] ReservoirBuffer& spatial_target(const int iteration);
+    [[nodiscard]] const ReservoirBuffer& spatial_source(const int iteration);
 
-    [[nodiscard]] std::weak_ptr<PointLight> pick_light(float& pdf) const;
+    // Ray from the hit towards the light sample of the reservoir, occluded if anything is hit before max_t
+    void shadow_ray(const Reservoir& res, const HitInfo& hi, Ray& ray, float& max_t) const;
 
-    [[nodiscard]] int sample_light_index() const;
+    [[nodiscard]] int sample_light_index(const float u) const;
 
-    void get_light_weight(const SampleInfo& sample,
-        const HitInfo& hi, float& W, float& phat) const;
+    void get_light_weight(const SampleInfo& sample, const HitInfo& hi,
+        const float light_choose_pdf, float& W, float& phat) const;
 };
\ No newline at end of file
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <glm/vec2.hpp>
+
+// Counter-based random numbers. Every number is a pure function of a key and a counter, so a pixel or
+// a photon draws the same sequence whichever thread runs it and in whatever order, and there is no
+// shared state to contend on. Keys are built from what identifies the work, e.g. (pixel, frame, stream).
+
+// Seed of every key, change it to get a different but equally reproducible image
+constexpr uint32_t RNG_SEED = 0x2545F491u;
+
+// Separates the sequences of the parts of the renderer that are keyed by the same index
+enum RngStream : uint32_t {
+    RNG_STREAM_INITIAL = 1, // ReSTIR initial candidates and temporal reuse
+    RNG_STREAM_SPATIAL,     // ReSTIR spatial reuse
+    RNG_STREAM_PATH,        // Path tracer
+    RNG_STREAM_LIGHT,       // Point lights spawned on emissive triangles
+    RNG_STREAM_PHOTON,      // GI photons
+};
+
+// PCG RXS-M-XS permutation of a 32 bit integer (Jarzynski and Olano, "Hash Functions for GPU Rendering")
+inline uint32_t pcg_hash(const uint32_t v) {
+    const uint32_t state = v * 747796405u + 2891336453u;
+    const uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+inline uint32_t rng_key(const uint32_t index, const uint32_t frame, const uint32_t stream) {
+    return pcg_hash(index ^ pcg_hash(frame ^ pcg_hash(stream ^ RNG_SEED)));
+}
+
+class Rng {
+public:
+    Rng() = default;
+
+    explicit Rng(const uint32_t key) : key(key) {
+    }
+
+    Rng(const uint32_t index, const uint32_t frame, const uint32_t stream) : key(rng_key(index, frame, stream)) {
+    }
+
+    // The number at the given dimension of the sequence, without advancing it
+    inline uint32_t at(const uint32_t dimension) const {
+        return pcg_hash(key ^ pcg_hash(dimension));
+    }
+
+    inline uint32_t next_uint() {
+        return at(dimension++);
+    }
+
+    // Uniform in [0, 1)
+    inline float next_float() {
+        return static_cast<float>(next_uint() >> 8) * 0x1p-24f;
+    }
+
+    inline glm::vec2 next_2d() {
+        const float u = next_float();
+        return glm::vec2(u, next_float());
+    }
+
+private:
+    uint32_t key = 0;
+    uint32_t dimension = 0;
+};
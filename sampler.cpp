@@ -0,0 +1,219 @@
+#include "sampler.hpp"
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+static uint32_t reverse_bits(uint32_t x) {
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+	x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// The second Sobol dimension as a lookup per byte of the index. Table b holds the xor of the direction
+// numbers of the set bits of byte b, so a point takes four loads instead of a branch per index bit.
+struct SobolTables {
+	uint32_t t[4][256];
+};
+
+static constexpr SobolTables make_sobol_tables() {
+	// Primitive polynomial x + 1, every direction number is the previous one xor itself shifted by one
+	uint32_t v[32] = {};
+	v[0] = 1u << 31;
+	for (int k = 1; k < 32; k++) {
+		v[k] = v[k - 1] ^ (v[k - 1] >> 1);
+	}
+
+	SobolTables tables{};
+	for (int b = 0; b < 4; b++) {
+		for (int byte = 0; byte < 256; byte++) {
+			uint32_t x = 0;
+			for (int bit = 0; bit < 8; bit++) {
+				if (byte & (1 << bit)) {
+					x ^= v[b * 8 + bit];
+				}
+			}
+			tables.t[b][byte] = x;
+		}
+	}
+	return tables;
+}
+
+static constexpr SobolTables SOBOL_1 = make_sobol_tables();
+
+static uint32_t sobol_1(const uint32_t index) {
+	return SOBOL_1.t[0][index & 0xFF] ^ SOBOL_1.t[1][(index >> 8) & 0xFF] ^
+		SOBOL_1.t[2][(index >> 16) & 0xFF] ^ SOBOL_1.t[3][index >> 24];
+}
+
+// Hash in which every bit only depends on the bits below it
+// (Burley, "Practical Hash-based Owen Scrambling", with the hash of N. Vegdahl)
+static uint32_t laine_karras_permutation(uint32_t x, const uint32_t seed) {
+	x ^= x * 0x3d20adeau;
+	x += seed;
+	x *= (seed >> 16) | 1u;
+	x ^= x * 0x05526c56u;
+	x ^= x * 0x53a22864u;
+	return x;
+}
+
+// Owen scrambling: every bit is flipped depending on the bits above it only
+static uint32_t nested_uniform_scramble(const uint32_t x, const uint32_t seed) {
+	return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+static inline float to_unit_float(const uint32_t x) {
+	return static_cast<float>(x >> 8) * 0x1p-24f;
+}
+
+float Sampler::get_1d(const SequenceType type) {
+	return get_2d(type).x;
+}
+
+glm::vec2 Sampler::get_2d(const SequenceType type) {
+	glm::vec2 u;
+	if (type == SequenceType::BlueNoise && x >= 0) {
+		u = glm::vec2(blue_noise(0), blue_noise(1));
+	}
+	else if (type == SequenceType::Random) {
+		Rng rng(rng_key(sequence_index(), dimension, key));
+		u = rng.next_2d();
+	}
+	else {
+		// Every dimension shuffles the points with its own seed, so the dimensions are not correlated
+		const uint32_t seed = pcg_hash(key ^ pcg_hash(dimension));
+		const uint32_t index = nested_uniform_scramble(sequence_index(), seed);
+		// The first dimension is the bit reversed index, which the scramble reverses back
+		const uint32_t x0 = reverse_bits(laine_karras_permutation(index, pcg_hash(seed ^ 1u)));
+		const uint32_t x1 = nested_uniform_scramble(sobol_1(index), pcg_hash(seed ^ 2u));
+		u = glm::vec2(to_unit_float(x0), to_unit_float(x1));
+	}
+	dimension++;
+	return u;
+}
+
+float Sampler::blue_noise(const uint32_t component) const {
+	// Every dimension reads the mask at its own offset, which is the same for all pixels so the
+	// values of neighbouring pixels stay blue. A golden ratio step rotates the mask every sample.
+	constexpr uint32_t mask = BLUE_NOISE_SIZE - 1;
+	const uint32_t offset = rng_key(dimension * 2 + component, 0, stream);
+	const uint32_t mx = (static_cast<uint32_t>(x) + offset) & mask;
+	const uint32_t my = (static_cast<uint32_t>(y) + (offset >> 8)) & mask;
+
+	const float value = blue_noise_mask()[my * BLUE_NOISE_SIZE + mx];
+	const float rotated = value + 0.618033988749895f * static_cast<float>(sequence_index() & 0xFFFF);
+	return std::min(rotated - std::floor(rotated), 0x1.fffffep-1f);
+}
+
+// Energy of every pixel of the mask: the sum of a gaussian of its toroidal distance to every set pixel
+struct VoidAndCluster {
+	static constexpr int N = BLUE_NOISE_SIZE;
+	static constexpr int COUNT = N * N;
+
+	std::vector<float> kernel = std::vector<float>(COUNT);
+	std::vector<float> energy = std::vector<float>(COUNT, 0.0f);
+	std::vector<uint8_t> set = std::vector<uint8_t>(COUNT, 0);
+
+	VoidAndCluster() {
+		constexpr float sigma = 1.5f;
+		for (int dy = 0; dy < N; dy++) {
+			for (int dx = 0; dx < N; dx++) {
+				const int wx = std::min(dx, N - dx);
+				const int wy = std::min(dy, N - dy);
+				kernel[dy * N + dx] = std::exp(-static_cast<float>(wx * wx + wy * wy) / (2.0f * sigma * sigma));
+			}
+		}
+	}
+
+	void toggle(const int p) {
+		set[p] ^= 1;
+		const float sign = set[p] ? 1.0f : -1.0f;
+		const int px = p % N;
+		const int py = p / N;
+		for (int y = 0; y < N; y++) {
+			const float* row = &kernel[((y - py) & (N - 1)) * N];
+			for (int x = 0; x < N; x++) {
+				energy[y * N + x] += sign * row[(x - px) & (N - 1)];
+			}
+		}
+	}
+
+	// The set pixel with the most set pixels around it
+	int tightest_cluster() const {
+		int best = -1;
+		for (int p = 0; p < COUNT; p++) {
+			if (set[p] && (best < 0 || energy[p] > energy[best])) {
+				best = p;
+			}
+		}
+		return best;
+	}
+
+	// The free pixel furthest from the set pixels
+	int largest_void() const {
+		int best = -1;
+		for (int p = 0; p < COUNT; p++) {
+			if (!set[p] && (best < 0 || energy[p] < energy[best])) {
+				best = p;
+			}
+		}
+		return best;
+	}
+};
+
+// Ulichney, "The void-and-cluster method for dither array generation"
+static std::vector<float> build_blue_noise_mask() {
+	constexpr int COUNT = VoidAndCluster::COUNT;
+	VoidAndCluster pattern;
+
+	// Start from a tenth of the pixels at random and move the tightest cluster into the largest void
+	// until that no longer changes anything
+	const int initial = COUNT / 10;
+	Rng rng(RNG_SEED);
+	for (int placed = 0; placed < initial;) {
+		const int p = static_cast<int>(rng.next_uint() % COUNT);
+		if (!pattern.set[p]) {
+			pattern.toggle(p);
+			placed++;
+		}
+	}
+	for (;;) {
+		const int cluster = pattern.tightest_cluster();
+		pattern.toggle(cluster);
+		const int hole = pattern.largest_void();
+		pattern.toggle(hole);
+		if (hole == cluster) {
+			break;
+		}
+	}
+
+	std::vector<int> rank(COUNT);
+
+	// The initial pixels are ranked by taking the tightest cluster away from a copy of the pattern
+	VoidAndCluster removal = pattern;
+	for (int r = initial - 1; r >= 0; r--) {
+		const int cluster = removal.tightest_cluster();
+		rank[cluster] = r;
+		removal.toggle(cluster);
+	}
+
+	// The rest by filling the largest void until every pixel is set
+	for (int r = initial; r < COUNT; r++) {
+		const int hole = pattern.largest_void();
+		rank[hole] = r;
+		pattern.toggle(hole);
+	}
+
+	std::vector<float> mask(COUNT);
+	for (int p = 0; p < COUNT; p++) {
+		mask[p] = (static_cast<float>(rank[p]) + 0.5f) / static_cast<float>(COUNT);
+	}
+	return mask;
+}
+
+const float* blue_noise_mask() {
+	static const std::vector<float> mask = build_blue_noise_mask();
+	return mask.data();
+}
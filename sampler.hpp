@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <glm/vec2.hpp>
+
+#include "rng.hpp"
+
+// Kind of numbers a Sampler hands out for one sampling decision
+enum class SequenceType {
+    Random,    // Independent uniform numbers from Rng
+    Sobol,     // Owen-scrambled Sobol points, stratified over the samples of a pixel (or photon) and over frames
+    BlueNoise, // Tiled blue-noise mask rotated every frame, stratified over neighbouring pixels
+};
+
+// The sequence every sampling decision uses, see Sampler
+constexpr auto LIGHT_CHOICE_SEQUENCE = SequenceType::Sobol;    // Initial RIS candidates and path tracer NEE
+constexpr auto NEIGHBOUR_SEQUENCE = SequenceType::BlueNoise;   // Spatial reuse neighbour offsets
+constexpr auto SCATTER_SEQUENCE = SequenceType::Sobol;         // Path tracer bounce directions
+constexpr auto EMISSION_SEQUENCE = SequenceType::Sobol;        // Point lights on emissive triangles and GI photon emission
+
+constexpr int BLUE_NOISE_SIZE = 64; // Side of the tiled blue-noise mask
+
+// Blue-noise mask of BLUE_NOISE_SIZE^2 values in [0, 1), built with void-and-cluster on first use
+const float* blue_noise_mask();
+
+// Samples of one pixel (or other item, like a photon) in one frame. Every get_1d/get_2d call is a new
+// dimension and picks its own SequenceType, start_sample moves to the next sample and starts the
+// dimensions over. Sobol points are indexed by frame * samples_per_frame + sample, so the samples of
+// all frames together stay stratified. Items without a pixel have no blue noise and get Sobol instead.
+class Sampler {
+public:
+    Sampler() = default;
+
+    Sampler(const uint32_t key, const uint32_t frame, const uint32_t samples_per_frame = 1) :
+        key(key), frame(frame), samples_per_frame(samples_per_frame) {
+    }
+
+    Sampler(const int x, const int y, const int width, const uint32_t frame, const uint32_t stream, const uint32_t samples_per_frame = 1) :
+        key(rng_key(static_cast<uint32_t>(y * width + x), 0, stream)), frame(frame), samples_per_frame(samples_per_frame),
+        x(x), y(y), stream(stream) {
+    }
+
+    // Passes that draw from the same sample one after another can start at different dimensions
+    inline void start_sample(const uint32_t index, const uint32_t first_dimension = 0) {
+        sample = index;
+        dimension = first_dimension;
+    }
+
+    float get_1d(const SequenceType type);
+    glm::vec2 get_2d(const SequenceType type);
+
+private:
+    uint32_t key = 0;
+    uint32_t frame = 0;
+    uint32_t samples_per_frame = 1;
+    uint32_t sample = 0;
+    uint32_t dimension = 0;
+    int x = -1; // Pixel, negative if the sampler has none
+    int y = -1;
+    uint32_t stream = 0;
+
+    inline uint32_t sequence_index() const {
+        return frame * samples_per_frame + sample;
+    }
+
+    float blue_noise(const uint32_t component) const;
+};
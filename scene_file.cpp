@@ -0,0 +1,126 @@
+#include "scene_file.hpp"
+
+#include <string>
+#include <utility>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile() {
+	close();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept {
+	*this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+	if (this != &other) {
+		close();
+		mapped = std::exchange(other.mapped, nullptr);
+		length = std::exchange(other.length, 0);
+#ifdef _WIN32
+		file_handle = std::exchange(other.file_handle, nullptr);
+		mapping_handle = std::exchange(other.mapping_handle, nullptr);
+#endif
+	}
+	return *this;
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string& path) {
+	close();
+
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr) {
+		CloseHandle(file);
+		return false;
+	}
+
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (view == nullptr) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+
+	file_handle = file;
+	mapping_handle = mapping;
+	mapped = static_cast<const std::byte*>(view);
+	length = static_cast<size_t>(file_size.QuadPart);
+	return true;
+}
+
+void MappedFile::close() {
+	if (mapped != nullptr) {
+		UnmapViewOfFile(mapped);
+	}
+	if (mapping_handle != nullptr) {
+		CloseHandle(mapping_handle);
+	}
+	if (file_handle != nullptr) {
+		CloseHandle(file_handle);
+	}
+	mapped = nullptr;
+	length = 0;
+	file_handle = nullptr;
+	mapping_handle = nullptr;
+}
+
+#else
+
+bool MappedFile::open(const std::string& path) {
+	close();
+
+	const int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+
+	void* view = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	// The mapping stays valid after the descriptor is closed
+	::close(fd);
+	if (view == MAP_FAILED) {
+		return false;
+	}
+
+	mapped = static_cast<const std::byte*>(view);
+	length = static_cast<size_t>(st.st_size);
+	return true;
+}
+
+void MappedFile::close() {
+	if (mapped != nullptr) {
+		munmap(const_cast<std::byte*>(mapped), length);
+	}
+	mapped = nullptr;
+	length = 0;
+}
+
+#endif
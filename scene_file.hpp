@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <glm/glm.hpp>
+
+#include "mesh.hpp"
+
+// Read-only memory mapping of a whole file. Pages are only read from disk when they are touched.
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+
+    bool open(const std::string& path);
+    void close();
+
+    inline bool is_open() const {
+        return mapped != nullptr;
+    }
+
+    inline const std::byte* data() const {
+        return mapped;
+    }
+
+    inline size_t size() const {
+        return length;
+    }
+
+    template <typename T>
+    inline const T* at(const uint64_t offset) const {
+        return reinterpret_cast<const T*>(mapped + offset);
+    }
+
+private:
+    const std::byte* mapped = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    void* file_handle = nullptr;
+    void* mapping_handle = nullptr;
+#endif
+};
+
+constexpr char SCENE_FILE_MAGIC[8] = { 'R', 'V', 'S', 'C', 'E', 'N', 'E', '\0' };
+constexpr uint32_t SCENE_FILE_VERSION = 4;
+constexpr uint64_t SCENE_FILE_ALIGNMENT = 64;
+
+// Layout of a compiled scene, written by World::save_scene_file.
+// Every section starts on a SCENE_FILE_ALIGNMENT boundary so it can be used in place once mapped.
+// The mesh is stored indexed, exactly as World::mesh views it: every asset once in object space,
+// plus the instances that place them. Everything is in native byte order.
+struct SceneFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t vertex_count;
+    uint32_t triangle_count;
+    uint32_t light_count;      // Number of emissive triangles
+    uint32_t material_count;
+    uint32_t asset_count;
+    uint32_t instance_count;
+    uint32_t material_library_count; // mtl files the obj files named, checked for changes before the scene is loaded
+    uint64_t positions_offset; // tinybvh::bvhvec4[vertex_count]
+    uint64_t normals_offset;   // glm::vec3[vertex_count]
+    uint64_t texcoords_offset; // glm::vec2[vertex_count]
+    uint64_t indices_offset;   // uint32_t[3 * triangle_count]
+    uint64_t material_ids_offset; // int32_t[triangle_count]
+    uint64_t face_normals_offset; // glm::vec3[triangle_count]
+    uint64_t lights_offset;    // uint32_t[light_count], indices of the emissive triangles
+    uint64_t assets_offset;    // MeshAsset[asset_count]
+    uint64_t instances_offset; // SceneFileInstance[instance_count]
+    uint64_t materials_offset; // SceneFileMaterial[material_count]
+    uint64_t material_libraries_offset; // uint32_t[material_library_count], offsets into the strings of their paths
+    uint64_t strings_offset;   // Null-terminated strings referenced by the materials and material libraries
+    uint64_t strings_size;
+};
+
+// The subset of tinyobj::material_t the renderer uses
+struct SceneFileMaterial {
+    float ambient[3];
+    float diffuse[3];
+    float emission[3];
+    uint32_t name;             // Offsets into the strings section
+    uint32_t diffuse_texname;
+    uint32_t emissive_texname;
+};
+
+struct SceneFileInstance {
+    uint32_t asset;
+    uint32_t padding[3];
+    float transform[16];       // Column-major, as glm::mat4
+};
+
+static_assert(sizeof(glm::vec3) == 12 && sizeof(glm::vec2) == 8, "Scene files expect tightly packed glm vectors");
+
+inline uint64_t align_scene_offset(const uint64_t offset) {
+    return (offset + SCENE_FILE_ALIGNMENT - 1) & ~(SCENE_FILE_ALIGNMENT - 1);
+}
@@ -1,12 +1,15 @@
 #include "shading.hpp"
 
 #include <glm/glm.hpp>
+#include <vector>
+#include <limits>
 
 #include "hit_info.hpp"
 #include "restir.hpp"
 #include "world.hpp"
 #include "ray.hpp"
 #include "constants.hpp"
+#include "spheres.hpp"
 
 #define RED glm::vec3(1.0f,0.0f,0.0f)
 #define GREEN glm::vec3(0.0f,1.0f,0.0f)
@@ -29,61 +32,93 @@ glm::vec3 shade_normal(const HitInfo& hit, const SamplerResult& sample, World& s
         return sky_color(hit.r.direction());
     }
 
-    return hit.triangle.normal(hit.uv);
+    return hit.normal();
 }
 
-glm::vec3 shade_debug(const HitInfo& hit, const SamplerResult& sample, World& scene) {
-    // visualize uv coordinates;
+static glm::vec3 shade_debug(const HitInfo& hit, const float point_light_dist_sqr, const float vpl_dist_sqr) {
     if (hit.t == 1E30f) {
 		return sky_color(hit.r.direction());
     }
 
-    // loop through all vpls and find out if the hit point is within a certain radius r of any of the vpls
-	glm::vec3 hit_point = hit.r.at(hit.t);
-
-    glm::vec3 closest_pl = scene.point_light_cloud.find_closest(hit_point);
-    float dist = glm::length(hit_point - closest_pl);
-    if (dist < SPHERE_R) {
+    // Hit points within a radius r of a point light or a vpl are drawn as spheres
+    if (point_light_dist_sqr < SPHERE_R * SPHERE_R) {
         return BLUE;
     }
-
-    if (!scene.vpls.empty()) {
-        glm::vec3 closest_vpl = scene.vpl_cloud.find_closest(hit_point);
-        dist = glm::length(hit_point - closest_vpl);
-        if (dist < SPHERE_R) {
-            return RED;
-        }
+    if (vpl_dist_sqr < SPHERE_R * SPHERE_R) {
+        return RED;
     }
 
     // Albedo
-    auto material = hit.mat_ptr.lock();
+    const Material* material = hit.material;
 	glm::vec3 fr = material->albedo(hit);
 
 	// Cosine of the angle between the surface normal and the ray direction
-	const glm::vec3 N = hit.triangle.normal(hit.uv);
+	const glm::vec3 N = hit.normal();
 	const float cos_theta = fmax(glm::dot(N, -hit.r.direction()), 0.0f);
 
     return fr * cos_theta;
 }
 
+void shade_debug(const GBuffer& gbuffer, World& scene, Framebuffer<glm::vec3>& colors) {
+    const int width = gbuffer.get_width();
+    const int height = gbuffer.get_height();
+
+    // One batched query per sphere cloud over the hit points of the frame
+    std::vector<uint32_t> pixels;
+    std::vector<glm::vec3> points;
+    pixels.reserve(gbuffer.size());
+    points.reserve(gbuffer.size());
+    for (size_t i = 0; i < gbuffer.size(); i++) {
+        if (gbuffer.is_hit(i)) {
+            pixels.push_back(static_cast<uint32_t>(i));
+            points.push_back(gbuffer.position[i]);
+        }
+    }
+
+    std::vector<uint32_t> closest(points.size());
+    std::vector<float> point_light_dist_sqr(points.size());
+    std::vector<float> vpl_dist_sqr(points.size(), std::numeric_limits<float>::max());
+    scene.point_light_cloud.knn(points, 1, closest, point_light_dist_sqr);
+    // The cloud also holds the VPLs of spawned lights, which scene.vpls does not
+    scene.vpl_cloud.knn(points, 1, closest, vpl_dist_sqr);
+
+    // Misses have no entry in the query lists
+    std::vector<uint32_t> query(gbuffer.size(), SphereCloud::NO_POINT);
+    for (size_t q = 0; q < pixels.size(); q++) {
+        query[pixels[q]] = static_cast<uint32_t>(q);
+    }
+
+#pragma omp parallel for
+    for (int y = 0; y < height; y++) {
+        glm::vec3* row = colors.row(y);
+        for (int x = 0; x < width; x++) {
+            const size_t i = static_cast<size_t>(y) * width + x;
+            const uint32_t q = query[i];
+            row[x] = q == SphereCloud::NO_POINT ? shade_debug(gbuffer.hit(i), 0.0f, 0.0f)
+                : shade_debug(gbuffer.hit(i), point_light_dist_sqr[q], vpl_dist_sqr[q]);
+        }
+    }
+}
+
 
 // Reference: https://momentsingraphics.de/ToyRenderer4RayTracing.html
 
 static glm::vec3 shade(const HitInfo& hit, const SamplerResult& sample, World& scene) {
-	if (sample.light.expired()) {
+	if (sample.light_index == INVALID_LIGHT) {
 		return glm::vec3(0.0f);
 	}
 
-	auto light = sample.light.lock();
+	const LightTable& lights = scene.point_lights;
+	const uint32_t light = sample.light_index;
 
 	// Sampled light direction
     const glm::vec3 L = sample.light_dir;
 
 	// Normal of the intersection point
-    const glm::vec3 N = hit.triangle.normal(hit.uv);
+    const glm::vec3 N = hit.normal();
 
     // Normal of the light source
-    const glm::vec3 Nl = light->normal(sample.light_point);
+    const glm::vec3 Nl = lights.normal[light];
 
     // Point of intersection [x]
     const glm::vec3 I = hit.r.at(hit.t);
@@ -92,7 +127,7 @@ static glm::vec3 shade(const HitInfo& hit, const SamplerResult& sample, World& s
     const float dist = glm::length(sample.light_point - I);
 
     // Emitted radiance from the light source towards x. For uniform area lights, it's constant: L0.
-	const glm::vec3 Le = light->c * light->intensity;
+	const glm::vec3 Le = lights.emission[light];
 
     // Visibility term
     Ray shadow_ray = Ray(I + EPS * L, L);
@@ -105,7 +140,7 @@ static glm::vec3 shade(const HitInfo& hit, const SamplerResult& sample, World& s
     }
 
 	// BRDF term
-	auto material = hit.mat_ptr.lock();
+	const Material* material = hit.material;
 	glm::vec3 fr = material->evaluate(hit, L);
 
     // Geometry term
@@ -139,24 +174,23 @@ glm::vec3 shadeRIS(const HitInfo& hit, const SamplerResult& sample, World& scene
     }
 
     // If the material emits light, return the emitted radiance directly
-	auto material = hit.mat_ptr.lock();
+	const Material* material = hit.material;
     if (material->emits_light()) {
         return material->albedo(hit);
     }
 
-    if (sample.light.expired() && sample.W != 0.0f) {
+    if (sample.light_index == INVALID_LIGHT && sample.W != 0.0f) {
         return PURPLE;
     }
 
-    if (sample.light.expired()) {
+    if (sample.light_index == INVALID_LIGHT) {
         return BLACK;
     }
 
     const glm::vec3 hit_point = hit.r.at(hit.t);
 
-    const glm::vec3 light_point = sample.light.lock().get()->position;
-    const Triangle plane = hit.triangle;
-    //if (distancePointToPlane(light_point, plane) < 1.0f) {
+    const glm::vec3 light_point = scene.point_lights.position[sample.light_index];
+    //if (distancePointToPlane(light_point, hit.mesh->triangle(hit.prim)) < 1.0f) {
     //    return RED;
     //}
 
@@ -179,26 +213,27 @@ glm::vec3 shadeUniform(const HitInfo& hit, const SamplerResult& sample, World& s
     }
 
     // If the material emits light, return the emitted radiance directly
-	auto material = hit.mat_ptr.lock();
+	const Material* material = hit.material;
     if (material->emits_light()) {
         return material->albedo(hit);
     }
 
-    if (sample.light.expired() && sample.W != 0.0f) {
+    if (sample.light_index == INVALID_LIGHT && sample.W != 0.0f) {
 		return PURPLE;
     }
 
-    if (sample.light.expired()) {
+    if (sample.light_index == INVALID_LIGHT) {
         return BLACK;
     }
 
-    auto light = sample.light.lock();
+    const LightTable& lights = scene.point_lights;
+    const uint32_t light = sample.light_index;
 
     // Sampled light direction
     const glm::vec3 L = sample.light_dir;
 
     // Normal of the light source
-    const glm::vec3 Nl = light->normal(sample.light_point);
+    const glm::vec3 Nl = lights.normal[light];
 
     // Point of intersection [x]
     const glm::vec3 I = hit.r.at(hit.t);
@@ -209,8 +244,8 @@ glm::vec3 shadeUniform(const HitInfo& hit, const SamplerResult& sample, World& s
 	glm::vec3 f = shade(hit, sample, scene);
 
     // Source PDF: converting from area to solid angle
-    const float light_choose_pdf = 1.0f / sampler.num_lights();
-    const float light_area_pdf = 1.0f / light->area();
+    const float light_choose_pdf = sampler.light_pdf(light, hit);
+    const float light_area_pdf = 1.0f / lights.area[light];
     const float _dist2 = dist * dist;
 	const float _dist = sqrtf(_dist2);
 	constexpr float _r = 3.0f;
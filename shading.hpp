@@ -4,6 +4,8 @@
 
 #include "hit_info.hpp"
 #include "restir.hpp" 
+#include "gbuffer.hpp"
+#include "framebuffer.hpp"
 
 enum ShadingMode {
     RENDER_NORMALS,
@@ -15,7 +17,8 @@ glm::vec3 sky_color(const glm::vec3& direction);
 
 glm::vec3 shade_normal(const HitInfo& hit, const SamplerResult& sample, World& scene);
 
-glm::vec3 shade_debug(const HitInfo& hit, const SamplerResult& sample, World& scene);
+// Point lights and VPLs as small spheres over the albedo, for a whole frame at once
+void shade_debug(const GBuffer& gbuffer, World& scene, Framebuffer<glm::vec3>& colors);
 
 glm::vec3 shadeRIS(const HitInfo& hit, const SamplerResult& sample, World& scene);
 glm::vec3 shadeUniform(const HitInfo& hit, const SamplerResult& sample, World& scene, RestirLightSampler& sampler);
\ No newline at end of file
@@ -6,29 +6,227 @@
 #include <vector>
 #include <limits>
 #include <memory>
+#include <numeric>
+#include <algorithm>
+#include <span>
 
 
-SphereCloud::SphereCloud(std::unique_ptr<std::vector<glm::vec3>> pts) : points(std::move(pts)) {
-    build_index();
+SphereCloud::SphereCloud(std::vector<glm::vec3> pts) {
+    build(std::move(pts));
 }
 
-void SphereCloud::build_index() {
-    if (points->empty()) return;
+void SphereCloud::Level::build_index() {
     index = std::make_unique<KDTree>(3, *this, nanoflann::KDTreeSingleIndexAdaptorParams(10));
     index->buildIndex();
 }
 
+// Passes the points of a level on as slots, leaving out the erased ones
+template <class RESULTSET, class LEVEL>
+struct LiveResultSet {
+    using DistanceType = float;
+    using IndexType = uint32_t;
+
+    RESULTSET& result;
+    const LEVEL& level;
+    const std::vector<uint8_t>& erased;
+
+    inline bool addPoint(const float dist, const uint32_t i) {
+        const uint32_t slot = level.slots[i];
+        return erased[slot] || result.addPoint(dist, slot);
+    }
+
+    inline float worstDist() const {
+        return result.worstDist();
+    }
+
+    inline bool full() const {
+        return result.full();
+    }
+
+    // The k nearest are kept in order already, points within a radius are returned unordered
+    inline void sort() {
+    }
+};
+
+template <class RESULTSET>
+void SphereCloud::find_neighbors(RESULTSET& result, const glm::vec3& point) const {
+    for (const std::unique_ptr<Level>& level : levels) {
+        LiveResultSet<RESULTSET, Level> live{ result, *level, erased };
+        level->index->findNeighbors(live, &point[0], nanoflann::SearchParameters());
+    }
+}
+
+void SphereCloud::build(std::vector<glm::vec3> new_points) {
+    points = std::move(new_points);
+    erased.assign(points.size(), 0);
+    slots.resize(points.size());
+    std::iota(slots.begin(), slots.end(), 0u);
+
+    levels.clear();
+    if (!points.empty()) {
+        auto level = std::make_unique<Level>();
+        level->positions = points;
+        level->slots = slots;
+        level->build_index();
+        levels.push_back(std::move(level));
+    }
+}
+
+void SphereCloud::append(const std::vector<glm::vec3>& new_points) {
+    if (new_points.empty()) return;
+
+    auto level = std::make_unique<Level>();
+    const uint32_t first = static_cast<uint32_t>(points.size());
+    points.insert(points.end(), new_points.begin(), new_points.end());
+    erased.resize(points.size(), 0);
+    for (uint32_t slot = first; slot < points.size(); slot++) {
+        slots.push_back(slot);
+        level->slots.push_back(slot);
+    }
+    level->positions = new_points;
+
+    // Merge the smaller trees into the new one, so the sizes keep at least doubling towards the front
+    while (!levels.empty() && levels.back()->slots.size() <= level->slots.size()) {
+        const Level& smaller = *levels.back();
+        level->positions.insert(level->positions.end(), smaller.positions.begin(), smaller.positions.end());
+        level->slots.insert(level->slots.end(), smaller.slots.begin(), smaller.slots.end());
+        levels.pop_back();
+    }
+    level->build_index();
+    levels.push_back(std::move(level));
+}
+
+std::vector<uint32_t> SphereCloud::erase(const size_t first, const size_t count) {
+    if (count == 0 || first + count > slots.size()) return {};
+
+    for (size_t i = first; i < first + count; i++) {
+        erased[slots[i]] = 1;
+    }
+    slots.erase(slots.begin() + first, slots.begin() + first + count);
+
+    // Erased points are only skipped by the search, compact the slots once they are the majority
+    if (points.size() - slots.size() > slots.size()) {
+        std::vector<uint32_t> remap(points.size(), NO_POINT);
+        std::vector<glm::vec3> live(slots.size());
+        for (size_t i = 0; i < slots.size(); i++) {
+            remap[slots[i]] = static_cast<uint32_t>(i);
+            live[i] = points[slots[i]];
+        }
+        build(std::move(live));
+        return remap;
+    }
+    return {};
+}
+
 glm::vec3 SphereCloud::find_closest(const glm::vec3& point) const {
-    if (!index || points->empty()) {
+    if (slots.empty()) {
         std::cerr << "Error: KD-tree not built or SphereCloud is empty!" << std::endl;
         return glm::vec3(0.0f);
     }
 
-    size_t retIndex = 0;
+    uint32_t retIndex = 0;
     float outDistSqr = 0.0f;
-    nanoflann::KNNResultSet<float> resultSet(1);
+    nanoflann::KNNResultSet<float, uint32_t> resultSet(1);
     resultSet.init(&retIndex, &outDistSqr);
-    index->findNeighbors(resultSet, &point[0], nanoflann::SearchParameters());
+    find_neighbors(resultSet, point);
+
+    return points[retIndex];
+}
+
+// Spread the lower 10 bits of x out to every third bit
+static uint32_t expand_bits(uint32_t x) {
+    x = (x | (x << 16)) & 0x030000FFu;
+    x = (x | (x << 8)) & 0x0300F00Fu;
+    x = (x | (x << 4)) & 0x030C30C3u;
+    x = (x | (x << 2)) & 0x09249249u;
+    return x;
+}
+
+// Order of the queries along a Morton curve through their bounding box
+static std::vector<uint32_t> morton_order(std::span<const glm::vec3> queries) {
+    const int64_t n = static_cast<int64_t>(queries.size());
+
+    glm::vec3 lo(std::numeric_limits<float>::max());
+    glm::vec3 hi(std::numeric_limits<float>::lowest());
+    for (const glm::vec3& q : queries) {
+        lo = glm::min(lo, q);
+        hi = glm::max(hi, q);
+    }
+    const glm::vec3 scale = 1023.0f / glm::max(hi - lo, glm::vec3(1e-6f));
+
+    // Code in the high half, query in the low half
+    std::vector<uint64_t> keys(n);
+#pragma omp parallel for
+    for (int64_t i = 0; i < n; i++) {
+        const glm::uvec3 cell = glm::uvec3(glm::clamp((queries[i] - lo) * scale, glm::vec3(0.0f), glm::vec3(1023.0f)));
+        const uint32_t code = (expand_bits(cell.x) << 2) | (expand_bits(cell.y) << 1) | expand_bits(cell.z);
+        keys[i] = (static_cast<uint64_t>(code) << 32) | static_cast<uint64_t>(i);
+    }
+
+    // LSD radix sort of the 30 bit codes, 10 bits per pass
+    std::vector<uint64_t> sorted(n);
+    for (int shift = 32; shift < 62; shift += 10) {
+        std::vector<uint32_t> start(1025, 0);
+        for (const uint64_t key : keys) {
+            start[((key >> shift) & 1023) + 1]++;
+        }
+        for (size_t b = 1; b < start.size(); b++) {
+            start[b] += start[b - 1];
+        }
+        for (const uint64_t key : keys) {
+            sorted[start[(key >> shift) & 1023]++] = key;
+        }
+        keys.swap(sorted);
+    }
 
-    return (*points)[retIndex];
-}
\ No newline at end of file
+    std::vector<uint32_t> order(n);
+    for (int64_t i = 0; i < n; i++) {
+        order[i] = static_cast<uint32_t>(keys[i]);
+    }
+    return order;
+}
+
+void SphereCloud::knn(std::span<const glm::vec3> queries, const size_t k, std::span<uint32_t> indices, std::span<float> dist_sqr) const {
+    std::fill(indices.begin(), indices.end(), NO_POINT);
+    std::fill(dist_sqr.begin(), dist_sqr.end(), std::numeric_limits<float>::max());
+    if (slots.empty() || k == 0) return;
+
+    const std::vector<uint32_t> order = morton_order(queries);
+    const int64_t n = static_cast<int64_t>(queries.size());
+#pragma omp parallel for schedule(dynamic, 256)
+    for (int64_t i = 0; i < n; i++) {
+        const uint32_t q = order[i];
+        nanoflann::KNNResultSet<float, uint32_t> resultSet(k);
+        resultSet.init(&indices[q * k], &dist_sqr[q * k]);
+        find_neighbors(resultSet, queries[q]);
+    }
+}
+
+void SphereCloud::radius_search(std::span<const glm::vec3> queries, const float radius,
+    std::vector<uint32_t>& offsets, std::vector<uint32_t>& indices) const {
+    const int64_t n = static_cast<int64_t>(queries.size());
+    offsets.assign(n + 1, 0);
+    indices.clear();
+    if (slots.empty()) return;
+
+    // Search into a list per query, then pack the lists
+    const std::vector<uint32_t> order = morton_order(queries);
+    std::vector<std::vector<nanoflann::ResultItem<uint32_t, float>>> found(n);
+#pragma omp parallel for schedule(dynamic, 256)
+    for (int64_t i = 0; i < n; i++) {
+        const uint32_t q = order[i];
+        nanoflann::RadiusResultSet<float, uint32_t> resultSet(radius * radius, found[q]);
+        find_neighbors(resultSet, queries[q]);
+    }
+
+    for (int64_t q = 0; q < n; q++) {
+        offsets[q + 1] = offsets[q] + static_cast<uint32_t>(found[q].size());
+    }
+    indices.resize(offsets[n]);
+#pragma omp parallel for
+    for (int64_t q = 0; q < n; q++) {
+        for (size_t j = 0; j < found[q].size(); j++) {
+            indices[offsets[q] + j] = found[q][j].first;
+        }
+    }
+}
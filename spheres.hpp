@@ -6,31 +6,80 @@
 #include <vector>
 #include <limits>
 #include <memory>
+#include <span>
+#include <cstdint>
 
+// Point set with a nearest-neighbour index that can be edited without a rebuild. The index is a
+// logarithmic set of static KD-trees: appended points get a tree of their own, which is merged with the
+// trees that are not larger than it, so every point takes part in O(log n) tree builds. Erasing a point
+// only marks its slot, the search skips it. Slots never move, so the trees can keep referring to them;
+// erased slots are reclaimed by a rebuild once they outnumber the live points.
 struct SphereCloud {
-    std::unique_ptr<std::vector<glm::vec3>> points;
-
-    // KD-tree typedef
-    using KDTree = nanoflann::KDTreeSingleIndexAdaptor<
-        nanoflann::L2_Simple_Adaptor<float, SphereCloud>,
-        SphereCloud,
-        3 // dimensions
-    >;
-
-    std::unique_ptr<KDTree> index;
+    std::vector<glm::vec3> points; // Every slot, including the erased ones
+    std::vector<uint8_t> erased;   // Whether the point in a slot was erased
+    std::vector<uint32_t> slots;   // Slot of every live point, in the order they were added
 
     SphereCloud() = default;
-    explicit SphereCloud(std::unique_ptr<std::vector<glm::vec3>> points);
+    explicit SphereCloud(std::vector<glm::vec3> points);
 
-    inline size_t kdtree_get_point_count() const { return points->size(); }
+    // Number of live points
+    inline size_t size() const { return slots.size(); }
 
-    inline float kdtree_get_pt(const size_t idx, int dim) const {
-        return (*points)[idx][dim]; // dim = 0 (x), 1 (y), 2 (z)
-    }
+    inline bool empty() const { return slots.empty(); }
 
-    template <class BBOX>
-    bool kdtree_get_bbox(BBOX&) const { return false; }
+    // Replace all points and build the index over them
+    void build(std::vector<glm::vec3> new_points);
+
+    // Add points at the end or remove the live points [first, first + count), the index is updated in place
+    void append(const std::vector<glm::vec3>& new_points);
+    // When erase reclaims the erased slots it returns the new slot of every old one (NO_POINT if it was
+    // erased), so data kept per slot elsewhere can follow. It returns nothing if every slot stayed put.
+    std::vector<uint32_t> erase(const size_t first, const size_t count);
 
-    void build_index();
     glm::vec3 find_closest(const glm::vec3& point) const;
-};
\ No newline at end of file
+
+    // Batched queries. The queries are sorted along a Morton curve first, so consecutive searches walk the
+    // same branches of the trees, and searched in parallel. Results are indices into points.
+    static constexpr uint32_t NO_POINT = ~0u;
+
+    // The k nearest points of every query, closest first, in indices[q * k + j] (NO_POINT if there are fewer)
+    void knn(std::span<const glm::vec3> queries, const size_t k, std::span<uint32_t> indices, std::span<float> dist_sqr) const;
+
+    // Every point within the radius of each query: those of query q are indices[offsets[q]] to indices[offsets[q + 1]]
+    void radius_search(std::span<const glm::vec3> queries, const float radius,
+        std::vector<uint32_t>& offsets, std::vector<uint32_t>& indices) const;
+
+private:
+    // One tree of the index over a copy of the positions of its slots
+    struct Level {
+        std::vector<glm::vec3> positions;
+        std::vector<uint32_t> slots;
+
+        // KD-tree typedef
+        using KDTree = nanoflann::KDTreeSingleIndexAdaptor<
+            nanoflann::L2_Simple_Adaptor<float, Level>,
+            Level,
+            3 // dimensions
+        >;
+
+        std::unique_ptr<KDTree> index;
+
+        inline size_t kdtree_get_point_count() const { return positions.size(); }
+
+        inline float kdtree_get_pt(const size_t idx, int dim) const {
+            return positions[idx][dim]; // dim = 0 (x), 1 (y), 2 (z)
+        }
+
+        template <class BBOX>
+        bool kdtree_get_bbox(BBOX&) const { return false; }
+
+        void build_index();
+    };
+
+    // Largest first, the trees refer to their level so it cannot move
+    std::vector<std::unique_ptr<Level>> levels;
+
+    // Search every level, results are slots
+    template <class RESULTSET>
+    void find_neighbors(RESULTSET& result, const glm::vec3& point) const;
+};
@@ -0,0 +1,16 @@
+#include "tile_scheduler.hpp"
+
+TileScheduler::TileScheduler(const int width, const int height, const int tile_size, const int halo) {
+	tiles_x = (width + tile_size - 1) / tile_size;
+	tiles_y = (height + tile_size - 1) / tile_size;
+	halo_tiles = (halo + tile_size - 1) / tile_size;
+
+	tiles.reserve(static_cast<size_t>(tiles_x) * tiles_y);
+	for (int ty = 0; ty < tiles_y; ty++) {
+		for (int tx = 0; tx < tiles_x; tx++) {
+			const int x0 = tx * tile_size;
+			const int y0 = ty * tile_size;
+			tiles.push_back({ x0, y0, std::min(x0 + tile_size, width), std::min(y0 + tile_size, height) });
+		}
+	}
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <cstddef>
+#include <algorithm>
+
+// Pixel rectangle [x0, x1) x [y0, y1)
+struct Tile {
+    int x0, y0;
+    int x1, y1;
+};
+
+// Runs a chain of passes over the tiles of an image without a barrier in between. Pass p of a tile may
+// read the results of pass p - 1 up to halo pixels outside of it, so it is started as soon as pass p - 1
+// of every tile in that halo is done. As the halo is the same for every pass, a tile can also overwrite
+// what an earlier pass wrote: the tiles that read it have all moved on by then. Every pass of a tile is
+// an OpenMP task, so idle threads pick up (steal) the remaining tiles and expensive parts of the image
+// do not stall the rest.
+class TileScheduler {
+public:
+    TileScheduler(const int width, const int height, const int tile_size, const int halo);
+
+    inline const std::vector<Tile>& get_tiles() const {
+        return tiles;
+    }
+
+    // Calls pass(p, tile) for every tile and every p in [0, pass_count). Must not be called from inside
+    // a parallel region.
+    template <typename Pass>
+    void run(const int pass_count, const Pass& pass) const;
+
+private:
+    std::vector<Tile> tiles;
+    int tiles_x = 0;
+    int tiles_y = 0;
+    int halo_tiles = 0; // The halo in whole tiles
+
+    // Range of tiles within the halo of a tile, along one axis
+    inline void halo_range(const int t, const int count, int& first, int& last) const {
+        first = std::max(t - halo_tiles, 0);
+        last = std::min(t + halo_tiles, count - 1);
+    }
+
+    template <typename Pass>
+    void run_tile(const int p, const int t, const int pass_count, const Pass& pass, std::vector<std::atomic<int>>& pending) const;
+};
+
+template <typename Pass>
+void TileScheduler::run(const int pass_count, const Pass& pass) const {
+    // Number of tiles whose pass p - 1 pass p of every tile still waits for, at pending[(p - 1) * tiles + t].
+    // The halo is symmetric, so a tile finishing a pass counts down every tile in its own halo.
+    const size_t tile_count = tiles.size();
+    std::vector<std::atomic<int>> pending(tile_count * std::max(pass_count - 1, 0));
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            int x_first, x_last, y_first, y_last;
+            halo_range(tx, tiles_x, x_first, x_last);
+            halo_range(ty, tiles_y, y_first, y_last);
+            const int count = (x_last - x_first + 1) * (y_last - y_first + 1);
+            for (int p = 1; p < pass_count; p++) {
+                pending[(p - 1) * tile_count + ty * tiles_x + tx].store(count, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    if (pass_count <= 0) {
+        return;
+    }
+
+#pragma omp parallel
+#pragma omp single
+    for (int t = 0; t < static_cast<int>(tile_count); t++) {
+#pragma omp task firstprivate(t) shared(pass, pending)
+        run_tile(0, t, pass_count, pass, pending);
+    }
+}
+
+template <typename Pass>
+void TileScheduler::run_tile(const int p, const int t, const int pass_count, const Pass& pass, std::vector<std::atomic<int>>& pending) const {
+    pass(p, tiles[t]);
+    if (p + 1 == pass_count) {
+        return;
+    }
+
+    std::atomic<int>* next = pending.data() + static_cast<size_t>(p) * tiles.size();
+    int x_first, x_last, y_first, y_last;
+    halo_range(t % tiles_x, tiles_x, x_first, x_last);
+    halo_range(t / tiles_x, tiles_y, y_first, y_last);
+    for (int ty = y_first; ty <= y_last; ty++) {
+        for (int tx = x_first; tx <= x_last; tx++) {
+            const int u = ty * tiles_x + tx;
+            if (next[u].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+#pragma omp task firstprivate(u) shared(pass, pending)
+                run_tile(p + 1, u, pass_count, pass, pending);
+            }
+        }
+    }
+}
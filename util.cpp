@@ -1,19 +1,24 @@
 #include "util.hpp"
 
 #include <glm/glm.hpp>
+#include <fstream>
+#include <vector>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <immintrin.h>
+#endif
 
-#define RANDVEC3 glm::vec3(float(rand()) / RAND_MAX, float(rand()) / RAND_MAX, float(rand()) / RAND_MAX)
-
-glm::vec3 random_in_unit_sphere() {
+glm::vec3 random_in_unit_sphere(Rng& rng) {
 	glm::vec3 p;
 	do {
-		p = 2.0f * RANDVEC3 - glm::vec3(1, 1, 1);
+		const glm::vec2 u = rng.next_2d();
+		p = 2.0f * glm::vec3(u, rng.next_float()) - glm::vec3(1, 1, 1);
 	} while (glm::dot(p, p) >= 1.0f);
 	return p;
 }
 
-glm::vec3 random_in_hemisphere(const glm::vec3 normal) {
-	glm::vec3 in_unit_sphere = random_in_unit_sphere();
+glm::vec3 random_in_hemisphere(const glm::vec3 normal, Rng& rng) {
+	glm::vec3 in_unit_sphere = random_in_unit_sphere(rng);
 
 	if (glm::dot(in_unit_sphere, normal) > 0.0) {
 		return in_unit_sphere;
@@ -35,4 +40,80 @@ glm::vec3 refract(const glm::vec3& uv, const glm::vec3& n, float etai_over_etat)
 	glm::vec3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
 	glm::vec3 r_out_parallel = -sqrtf(fabsf(1.0 - glm::dot(r_out_perp, r_out_perp))) * n;
 	return r_out_perp + r_out_parallel;
-}
\ No newline at end of file
+}
+
+float luminance(const glm::vec3& color) {
+	return 0.2126f * color.r + 0.7152f * color.g + 0.0722f * color.b;
+}
+
+uint64_t hash_bytes(const void* data, size_t size, uint64_t hash) {
+	constexpr uint64_t FNV_PRIME = 1099511628211ull;
+	const auto* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+uint64_t hash_file(const std::string& file_path, uint64_t hash) {
+	std::ifstream file(file_path, std::ios::binary);
+	if (!file) {
+		return hash;
+	}
+
+	std::vector<char> buffer(1 << 16);
+	while (file) {
+		file.read(buffer.data(), buffer.size());
+		hash = hash_bytes(buffer.data(), static_cast<size_t>(file.gcount()), hash);
+	}
+	return hash;
+}
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+
+bool cpu_supports_avx2_fma() {
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) {
+		return false;
+	}
+
+	__cpuid(info, 1);
+	const bool fma = info[2] & (1 << 12);
+	const bool osxsave = info[2] & (1 << 27);
+	const bool avx = info[2] & (1 << 28);
+	__cpuidex(info, 7, 0);
+	const bool avx2 = info[1] & (1 << 5);
+
+	// The OS also has to preserve the ymm registers across context switches
+	return fma && osxsave && avx && avx2 && (_xgetbv(0) & 6) == 6;
+}
+
+bool cpu_supports_sse42() {
+	int info[4];
+	__cpuid(info, 1);
+	return info[2] & (1 << 20);
+}
+
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+
+bool cpu_supports_avx2_fma() {
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+bool cpu_supports_sse42() {
+	return __builtin_cpu_supports("sse4.2");
+}
+
+#else
+
+bool cpu_supports_avx2_fma() {
+	return false;
+}
+
+bool cpu_supports_sse42() {
+	return false;
+}
+
+#endif
@@ -1,9 +1,23 @@
 #pragma once
 
 #include <glm/vec3.hpp>
+#include <cstdint>
+#include <cstddef>
+#include <string>
 
-glm::vec3 random_in_unit_sphere();
-glm::vec3 random_in_hemisphere(const glm::vec3 normal);
+#include "rng.hpp"
+
+glm::vec3 random_in_unit_sphere(Rng& rng);
+glm::vec3 random_in_hemisphere(const glm::vec3 normal, Rng& rng);
 glm::vec3 reflect(const glm::vec3& v, const glm::vec3& n);
 bool near_zero(const glm::vec3& v);
-glm::vec3 refract(const glm::vec3& uv, const glm::vec3& n, float etai_over_etat);
\ No newline at end of file
+glm::vec3 refract(const glm::vec3& uv, const glm::vec3& n, float etai_over_etat);
+float luminance(const glm::vec3& color);
+// 64-bit FNV-1a, pass the previous result as hash to chain several buffers
+constexpr uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+uint64_t hash_bytes(const void* data, size_t size, uint64_t hash = FNV_OFFSET_BASIS);
+uint64_t hash_file(const std::string& file_path, uint64_t hash = FNV_OFFSET_BASIS);
+
+// Runtime CPU feature checks, the build flags only say what the compiler was allowed to emit
+bool cpu_supports_avx2_fma();
+bool cpu_supports_sse42();
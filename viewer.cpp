@@ -67,9 +67,9 @@ bool create_view_window(int width, int height,
 // Call once per frame after you've filled `pixels`:
 void update_and_present(SDL_Renderer *renderer,
                         SDL_Texture *texture,
-                        const std::vector<std::vector<glm::vec3> > &pixels) {
-    int height = int(pixels.size());
-    int width = int(pixels[0].size());
+                        const Framebuffer<glm::vec3> &pixels) {
+    int height = pixels.height();
+    int width = pixels.width();
 
     // Lock texture to get raw pointer
     void *texPixels;
@@ -83,8 +83,9 @@ void update_and_present(SDL_Renderer *renderer,
     // otherwise just iterate y from 0→height.
     for (int y = 0; y < height; ++y) {
         unsigned char *row = dst + y * pitch;
+        const glm::vec3 *src = pixels.row(height - 1 - y);
         for (int x = 0; x < width; ++x) {
-            glm::vec3 c = glm::clamp(pixels[height - 1 - y][x], 0.0f, 1.0f);
+            glm::vec3 c = glm::clamp(src[x], 0.0f, 1.0f);
             int idx = x * 3;
             row[idx + 0] = static_cast<unsigned char>(c.r * 255.0f);
             row[idx + 1] = static_cast<unsigned char>(c.g * 255.0f);
@@ -106,10 +107,12 @@ std::string get_frame_filename(int i) {
     return oss.str();
 }
 
-void accumulate(std::vector<std::vector<glm::vec3>>& colors, std::vector<std::vector<glm::vec3>>& new_color, int frame) {
-	for (int j = 0; j < colors.size(); j++) {
-		for (int i = 0; i < colors[j].size(); i++) {
-			colors[j][i] = (colors[j][i] * static_cast<float>(frame) + new_color[j][i]) /
+void accumulate(Framebuffer<glm::vec3>& colors, const Framebuffer<glm::vec3>& new_color, int frame) {
+	for (int j = 0; j < colors.height(); j++) {
+		glm::vec3* row = colors.row(j);
+		const glm::vec3* new_row = new_color.row(j);
+		for (int i = 0; i < colors.width(); i++) {
+			row[i] = (row[i] * static_cast<float>(frame) + new_row[i]) /
 				static_cast<float>(frame + 1);
 		}
 	}
@@ -146,7 +149,7 @@ static void progress_bar(int current_frame, float time, int framecount) {
 	std::cout.flush();
 }
 
-void render(Camera &cam, World &world, int framecount, bool accumulate_flag, SamplingMode sampling_mode, ShadingMode shading_mode) {
+void render(Camera &cam, World &world, int framecount, bool accumulate_flag, SamplingMode sampling_mode, ShadingMode shading_mode, LightSelection light_selection) {
     if (shading_mode != RENDER_SHADING) {
         framecount = 1;
     }
@@ -164,17 +167,17 @@ void render(Camera &cam, World &world, int framecount, bool accumulate_flag, Sam
     world.bvh();
     world.get_materials(!ENABLE_TEXTURES);
 
-    auto lights = world.get_lights();
-    auto light_sampler = RestirLightSampler(render_cam.image_width, render_cam.image_height, lights);
+    auto light_sampler = RestirLightSampler(render_cam.image_width, render_cam.image_height, world);
     light_sampler.sampling_mode = sampling_mode;
+    light_sampler.light_selection = light_selection;
     light_sampler.m = 32;
 
-    std::vector<std::vector<glm::vec3> > accumulated_colors;
+    Framebuffer<glm::vec3> accumulated_colors;
     if (accumulate_flag) {
-        accumulated_colors =
-            std::vector(render_cam.image_height,
-                std::vector<glm::vec3>(render_cam.image_width, glm::vec3(0.0f)));
+        accumulated_colors = Framebuffer(render_cam.image_width, render_cam.image_height, glm::vec3(0.0f));
     }
+    Framebuffer<glm::vec3> colors;
+    PathBuffer paths;
 
     std::string sampling_mode_str;
     std::ostringstream oss;
@@ -205,15 +208,13 @@ void render(Camera &cam, World &world, int framecount, bool accumulate_flag, Sam
     for (int i = 0; i < framecount; i++) {
         auto render_start = std::chrono::high_resolution_clock::now();
 
-        RenderInfo info = RenderInfo{render_cam, world, light_sampler};
-
-        std::vector<std::vector<glm::vec3>> colors;
+        RenderInfo info = RenderInfo{render_cam, world, light_sampler, static_cast<uint32_t>(i)};
 
         if (!ENABLE_PT) {
-            colors = raytrace(light_sampler.sampling_mode, shading_mode, info);
+            raytrace(light_sampler.sampling_mode, shading_mode, info, colors);
         }
         else {
-            colors = pathtrace(info);
+            pathtrace(info, paths, colors);
         }
 
 		if (accumulate_flag) {
@@ -294,8 +295,7 @@ void render_live(Camera &cam, World &world, bool progressive) {
     world.bvh();
     world.get_materials(!ENABLE_TEXTURES);
 
-    auto lights = world.get_lights();
-    auto light_sampler = RestirLightSampler(cam.image_width, cam.image_height, lights);
+    auto light_sampler = RestirLightSampler(cam.image_width, cam.image_height, world);
 
     // 1) Init SDL
     if (!init_sdl()) return;
@@ -316,10 +316,12 @@ void render_live(Camera &cam, World &world, bool progressive) {
     bool camera_moved = false;
     SDL_Event e;
 
-    std::vector<std::vector<glm::vec3> > accumulated_colors =
-            std::vector(cam.image_height,
-                        std::vector<glm::vec3>(cam.image_width, glm::vec3(0.0f)));
+    // The framebuffers and the path state live for the whole session, frames are rendered into them in place
+    Framebuffer<glm::vec3> accumulated_colors(cam.image_width, cam.image_height, glm::vec3(0.0f));
+    Framebuffer<glm::vec3> colors;
+    PathBuffer paths;
     int frame = 0;
+    uint32_t frame_index = 0; // Unlike frame this is never reset, so every frame gets new random numbers
 
     // Handle key input such as combos
     KeyState keys;
@@ -345,13 +347,15 @@ void render_live(Camera &cam, World &world, bool progressive) {
                         running = false;
                         break;
                     case SDLK_1:
-                        light_sampler.sampling_mode = SamplingMode::Uniform; camera_moved = true; ENABLE_PT = false; break;
+                        light_sampler.sampling_mode = SamplingMode::Uniform; light_sampler.reset(); camera_moved = true; ENABLE_PT = false; break;
                     case SDLK_2:
-                        light_sampler.sampling_mode = SamplingMode::RIS; camera_moved = true; ENABLE_PT = false; break;
+                        light_sampler.sampling_mode = SamplingMode::RIS; light_sampler.reset(); camera_moved = true; ENABLE_PT = false; break;
                     case SDLK_3:
-                        light_sampler.sampling_mode = SamplingMode::ReSTIR; camera_moved = true; ENABLE_PT = false; break;
+                        light_sampler.sampling_mode = SamplingMode::ReSTIR; light_sampler.reset(); camera_moved = true; ENABLE_PT = false; break;
                     case SDLK_4:
                         ENABLE_PT = true; camera_moved = true; break;
+                    case SDLK_5:
+                        light_sampler.sampling_mode = SamplingMode::Lightcuts; light_sampler.reset(); camera_moved = true; ENABLE_PT = false; break;
                     case SDLK_w: keys.w = isDown;
                         break;
                     case SDLK_a: keys.a = isDown;
@@ -381,14 +385,21 @@ void render_live(Camera &cam, World &world, bool progressive) {
                     case SDLK_BACKSPACE: keys.backspace = isDown;
                         break;
 					case SDLK_g: 
+					case SDLK_f:
                         if (isDown) {
-                            DISABLE_GI = !DISABLE_GI;
-                            world.point_lights.clear();
-                            world.vpls.clear();
-                            lights = world.get_lights();
+                            // The lights (and GI photons) are generated again with the new setting
+                            if (key == SDLK_g) {
+                                DISABLE_GI = !DISABLE_GI;
+                            }
+                            else {
+                                PHOTON_MAP_GI = !PHOTON_MAP_GI;
+                            }
+                            world.clear_lights();
                             auto mode = light_sampler.sampling_mode;
-                            light_sampler = RestirLightSampler(cam.image_width, cam.image_height, lights);
+                            auto selection = light_sampler.light_selection;
+                            light_sampler = RestirLightSampler(cam.image_width, cam.image_height, world);
 							light_sampler.sampling_mode = mode;
+                            light_sampler.light_selection = selection;
 							camera_moved = true;
                         }
 						break;
@@ -411,6 +422,14 @@ void render_live(Camera &cam, World &world, bool progressive) {
                     case SDLK_p:
                         if (isDown) progressive = !progressive;
                         break;
+                    case SDLK_t:
+                        if (isDown) {
+                            light_sampler.light_selection = light_sampler.light_selection == LightSelection::Power
+                                ? LightSelection::Tree : LightSelection::Power;
+                            std::clog << "\nLight selection: " << light_sampler.light_selection << "\n";
+                            camera_moved = true;
+                        }
+                        break;
                     default: break;
                 }
             }
@@ -427,17 +446,14 @@ void render_live(Camera &cam, World &world, bool progressive) {
 			// Render the current frame
 			std::clog << "\nOutput render with current camera" << std::endl;
             currently_outputting_render = true;
-            render(cam, world, RENDER_FRAME_COUNT, progressive, light_sampler.sampling_mode, render_mode);
+            render(cam, world, RENDER_FRAME_COUNT, progressive, light_sampler.sampling_mode, render_mode, light_sampler.light_selection);
 			keys.enter = false;
         }
 
         if (keys.backspace) {
             // Remove most recently spawned light
             std::clog << "\nRemoving most recently spawned light" << "\n";
-            world.remove_last_point_light();
-            auto lights = world.get_lights();
-            light_sampler = RestirLightSampler(cam.image_width, cam.image_height, lights);
-            light_sampler.reset();
+            light_sampler.remap_lights(world.remove_last_point_light());
             keys.backspace = false;
         }
 
@@ -448,9 +464,7 @@ void render_live(Camera &cam, World &world, bool progressive) {
             // generate random color
             glm::vec3 color = glm::vec3(1.0f, 1.0f, 1.0f);
             world.spawn_point_light(cam.position, cam.forward, color, 1.0f);
-            auto lights = world.get_lights();
-            light_sampler = RestirLightSampler(cam.image_width, cam.image_height, lights);
-            light_sampler.reset();
+            // Spawning only appends lights, the reservoirs still point at the same ones
             keys.l = false;
         }
 
@@ -513,26 +527,21 @@ void render_live(Camera &cam, World &world, bool progressive) {
         }
 
         if (camera_moved) {
-            //std::clog << "Camera moved, resetting light sampler" << std::endl;
-            light_sampler.reset();
-            accumulated_colors =
-                    std::vector(cam.image_height,
-                                std::vector<glm::vec3>(cam.image_width, glm::vec3(0.0f)));
+            // The light sampler keeps its reservoirs, they are reprojected to the new camera
+            accumulated_colors.fill(glm::vec3(0.0f));
             frame = 0;
             camera_moved = false;
         }
 
         auto render_start = std::chrono::high_resolution_clock::now();
 
-        RenderInfo info = RenderInfo{cam, world, light_sampler};
-
-        std::vector<std::vector<glm::vec3>> colors;
+        RenderInfo info = RenderInfo{cam, world, light_sampler, frame_index++};
 
         if (!ENABLE_PT) {
-            colors = raytrace(light_sampler.sampling_mode, render_mode, info);
+            raytrace(light_sampler.sampling_mode, render_mode, info, colors);
         }
         else {
-			colors = pathtrace(info);
+			pathtrace(info, paths, colors);
             //colors = raytrace(light_sampler.sampling_mode, RENDER_NORMALS, info);
         }
 
@@ -541,7 +550,8 @@ void render_live(Camera &cam, World &world, bool progressive) {
         float duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(render_stop - render_start).count();
 
         std::string sampling_mode_str = light_sampler.sampling_mode == SamplingMode::Uniform ? "Uniform" :
-			(light_sampler.sampling_mode == SamplingMode::RIS ? "RIS    " : "ReSTIR ");
+			(light_sampler.sampling_mode == SamplingMode::RIS ? "RIS    " :
+			(light_sampler.sampling_mode == SamplingMode::Lightcuts ? "Lightcuts" : "ReSTIR "));
 
         if (ENABLE_PT) {
 			sampling_mode_str = "PT";
@@ -565,9 +575,7 @@ void render_live(Camera &cam, World &world, bool progressive) {
             frame++;
         }
         else {
-            accumulated_colors =
-                std::vector(cam.image_height,
-                    std::vector<glm::vec3>(cam.image_width, glm::vec3(0.0f)));
+            accumulated_colors.fill(glm::vec3(0.0f));
             frame = 0;
         }
         accumulate(accumulated_colors, colors, frame);
@@ -5,6 +5,6 @@
 #include "restir.hpp"
 #include "shading.hpp"
 
-void render(Camera& cam, World& world, int framecount, bool accumulate = false, SamplingMode sampling_mode = SamplingMode::Uniform, ShadingMode shading_mode = ShadingMode::RENDER_SHADING);
+void render(Camera& cam, World& world, int framecount, bool accumulate = false, SamplingMode sampling_mode = SamplingMode::Uniform, ShadingMode shading_mode = ShadingMode::RENDER_SHADING, LightSelection light_selection = LightSelection::Power);
 
 void render_live(Camera& cam, World& world, bool progressive = true);
\ No newline at end of file
@@ -3,11 +3,17 @@
 #include <filesystem>
 #include <chrono>
 #include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
 #ifndef TINY_BVH_H_
 #include "lib/tiny_bvh.h"
 #endif
 #include <memory>
-#include <random>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <array>
+#include <cstring>
 
 #include "camera.hpp"
 #include "texture.hpp"
@@ -16,23 +22,29 @@
 #include "constants.hpp"
 #include "photon.hpp"
 #include "spheres.hpp"
+#include "util.hpp"
+#include "rng.hpp"
+#include "sampler.hpp"
 
 bool DISABLE_GI = true;
+bool PHOTON_MAP_GI = false;
 
 
-World load_world() {
+World load_world(bool recompile) {
 	auto loading_start = std::chrono::high_resolution_clock::now();
 
 	World world;
-	// Scene 1
-	//world.place_obj("objects/sahur.obj", false, glm::vec3(0, 0, 0));
-	
-	// Scene 2
-	//world.place_obj("objects/cornell-box.obj", false, glm::vec3(0, 0, 0));
+	world.load_scene({
+		// Scene 1
+		//{ "objects/sahur.obj", false, glm::vec3(0, 0, 0) },
 
-	// Scene 3
-	world.place_obj("objects/bigCubeLight.obj", true, glm::vec3(5, 5, 0));
-	world.place_obj("objects/modern_living_room.obj", false, glm::vec3(0, 0, 0));
+		// Scene 2
+		//{ "objects/cornell-box.obj", false, glm::vec3(0, 0, 0) },
+
+		// Scene 3
+		{ "objects/bigCubeLight.obj", true, glm::vec3(5, 5, 0) },
+		{ "objects/modern_living_room.obj", false, glm::vec3(0, 0, 0) },
+	}, recompile);
 
 	auto loading_stop = std::chrono::high_resolution_clock::now();
 
@@ -43,8 +55,43 @@ World load_world() {
 	return world;
 }
 
+// Identifies a vertex of an obj file by its position, normal and texcoord index
+struct ObjVertexKey {
+	int vertex_index;
+	int normal_index;
+	int texcoord_index;
+
+	bool operator==(const ObjVertexKey&) const = default;
+};
 
-void World::load_obj_at(std::string& file_path, glm::vec3 position, bool force_light) {
+struct ObjVertexKeyHash {
+	size_t operator()(const ObjVertexKey& key) const {
+		return static_cast<size_t>(hash_bytes(&key, sizeof(key)));
+	}
+};
+
+// The mtl files the mtllib lines of an obj file name, in the directory of the obj file like tinyobjloader looks for them
+static std::vector<std::string> find_material_libraries(const std::string& obj_path) {
+	std::vector<std::string> libraries;
+	const std::filesystem::path directory = std::filesystem::path(obj_path).parent_path();
+	std::ifstream in(obj_path);
+	std::string line;
+	while (std::getline(in, line)) {
+		const size_t start = line.find_first_not_of(" \t");
+		if (start == std::string::npos || line.compare(start, 6, "mtllib") != 0 || start + 6 >= line.size() ||
+			(line[start + 6] != ' ' && line[start + 6] != '\t')) {
+			continue;
+		}
+		std::istringstream names(line.substr(start + 7));
+		std::string name;
+		while (names >> name) {
+			libraries.push_back((directory / name).string());
+		}
+	}
+	return libraries;
+}
+
+uint32_t World::load_obj(std::string& file_path, bool force_light) {
 	// this function is copied from Rafayels original implementation with slight changes
 
 	// Load the OBJ file using tinyobjloader
@@ -63,6 +110,18 @@ void World::load_obj_at(std::string& file_path, glm::vec3 position, bool force_l
 		std::cerr << "TinyObjReader: " << reader.Warning() << std::endl;
 	}
 
+	detach_scene_file();
+
+	for (std::string& library : find_material_libraries(file_path)) {
+		if (std::find(material_libraries.begin(), material_libraries.end(), library) == material_libraries.end()) {
+			material_libraries.push_back(std::move(library));
+		}
+	}
+
+	MeshAsset asset{};
+	asset.first_triangle = static_cast<uint32_t>(owned_material_ids.size());
+	asset.source_hash = hash_file(file_path);
+
 	int num_starting_mats = all_materials.size();
 
 	// Access the loaded shapes and materials
@@ -85,8 +144,12 @@ void World::load_obj_at(std::string& file_path, glm::vec3 position, bool force_l
 		std::cerr << "Texcoords are not included in " << file_path << std::endl;
 	}
 
+	// Vertices are shared by every face that uses the same position, normal and texcoord of this file
+	std::unordered_map<ObjVertexKey, uint32_t, ObjVertexKeyHash> vertex_lookup;
+	vertex_lookup.reserve(attrib.vertices.size() / 3);
+
 	// Iterate through the shapes and extract the triangles
-	for (tinyobj::shape_t shape : shapes) {
+	for (const tinyobj::shape_t& shape : shapes) {
 		int face_id = 0;
 		size_t index_offset = 0;
 		for (int fv : shape.mesh.num_face_vertices) {
@@ -98,11 +161,17 @@ void World::load_obj_at(std::string& file_path, glm::vec3 position, bool force_l
 			if (face_id < shape.mesh.material_ids.size()) {
 				material_id = shape.mesh.material_ids[face_id] + num_starting_mats;
 			}
-			all_material_ids.push_back(material_id);
-			Vertex triangle_verts[3];
+			uint32_t triangle_indices[3];
 			for (size_t v = 0; v < fv; v++) {
 				tinyobj::index_t idx = shape.mesh.indices[index_offset + v];
 
+				const ObjVertexKey key{ idx.vertex_index, normals_excluded ? -1 : idx.normal_index, texcoords_excluded ? -1 : idx.texcoord_index };
+				const auto [it, inserted] = vertex_lookup.try_emplace(key, static_cast<uint32_t>(owned_positions.size()));
+				triangle_indices[v] = it->second;
+				if (!inserted) {
+					continue;
+				}
+
 				const int x = 0;
 				const int y = 1;
 				const int z = 2;
@@ -129,14 +198,24 @@ void World::load_obj_at(std::string& file_path, glm::vec3 position, bool force_l
 					texcoords = glm::vec2(x_texcoords, y_texcoords);
 				}
 
-				triangle_verts[v] = Vertex(
-					glm::vec3(x_pos, y_pos, z_pos),
-					normals,
-					texcoords
-				);
+				owned_positions.emplace_back(x_pos, y_pos, z_pos, 0.0f);
+				owned_normals.push_back(normals);
+				owned_texcoords.push_back(texcoords);
 			}
 
-			Triangle triangle = Triangle(triangle_verts, material_id);
+			const uint32_t triangle_index = static_cast<uint32_t>(owned_material_ids.size());
+			owned_indices.insert(owned_indices.end(), std::begin(triangle_indices), std::end(triangle_indices));
+			owned_material_ids.push_back(material_id);
+
+			const auto vertex_position = [&](const uint32_t vertex) {
+				const tinybvh::bvhvec4& p = owned_positions[vertex];
+				return glm::vec3(p.x, p.y, p.z);
+			};
+			owned_face_normals.push_back(face_normal(
+				vertex_position(triangle_indices[0]),
+				vertex_position(triangle_indices[1]),
+				vertex_position(triangle_indices[2]),
+				owned_normals[triangle_indices[0]]));
 
 			// Check if the material is emissive and add to light triangles
 			if (material_id >= 0 && material_id < all_materials.size()) {
@@ -146,68 +225,836 @@ void World::load_obj_at(std::string& file_path, glm::vec3 position, bool force_l
 				bool check_emissive_texmap = mat.emissive_texname != "";
 
 				if (check_emission || check_emissive_texmap || force_light) {
-					lights.push_back(triangle + position);
+					light_triangles.push_back(triangle_index);
 					light_material_ids.push_back(material_id);
-					light_materials.push_back(mat);
+					add_light_material(material_id);
 				}
 			}
 
-			triangle_soup.push_back(triangle + position);
-			all_material_ids.push_back(material_id);
-			
-
 			index_offset += fv;
 			face_id++;
 		}
 	}
-	std::clog << "Loaded " << triangle_soup.size() << " triangles from " << file_path << std::endl;
-	std::clog << "Loaded " << all_materials.size() << " materials from " << file_path << std::endl;
-	std::clog << "Loaded " << lights.size() << " lights from " << file_path << std::endl;
+	asset.triangle_count = static_cast<uint32_t>(owned_material_ids.size()) - asset.first_triangle;
+	assets.push_back(asset);
+	update_views();
+
+	const size_t asset_lights = light_triangles.end() - std::lower_bound(light_triangles.begin(), light_triangles.end(), asset.first_triangle);
+	std::clog << "Loaded " << asset.triangle_count << " triangles from " << file_path << std::endl;
+	std::clog << "Loaded " << new_mats.size() << " materials from " << file_path << std::endl;
+	std::clog << "Loaded " << asset_lights << " lights from " << file_path << std::endl;
+
+	return static_cast<uint32_t>(assets.size() - 1);
 }
 
 World::World() {
-	triangle_soup = {};
 	all_materials = {};
 	lights = {};
 	light_materials = {};
 
-	all_material_ids = {};
 	light_material_ids = {};
 	mats_small = {};
 }
 
 void World::add_obj(std::string file_path, bool is_lights){
-	load_obj_at(file_path, glm::vec3(0.0f), is_lights);
+	place_obj(file_path, is_lights, glm::mat4(1.0f));
 }
 
-void World::place_obj(std::string file_path, bool is_lights, glm::vec3 position) {
-	load_obj_at(file_path, position, is_lights);
+uint32_t World::place_obj(std::string file_path, bool is_lights, glm::vec3 position) {
+	return place_obj(file_path, is_lights, glm::translate(glm::mat4(1.0f), position));
+}
+
+uint32_t World::place_obj(std::string file_path, bool is_lights, const glm::mat4& transform) {
+	// Forcing the triangles to be lights changes the asset, so that is part of the key
+	const std::string key = file_path + (is_lights ? "|lights" : "");
+	uint32_t asset;
+	bool new_asset = false;
+	if (const auto it = asset_lookup.find(key); it != asset_lookup.end()) {
+		asset = it->second;
+	}
+	else {
+		asset = load_obj(file_path, is_lights);
+		asset_lookup.emplace(key, asset);
+		new_asset = true;
+	}
+
+	if (assets[asset].triangle_count == 0) {
+		std::cerr << "Warning: " << file_path << " has no triangles, it is not placed" << std::endl;
+		return INVALID_INSTANCE;
+	}
+
+	instances.emplace_back(asset, transform);
+	update_views();
+	expand_lights();
+
+	if (bvh_built) {
+		if (new_asset) {
+			// The vertex arrays may have moved, so every BLAS is set up again (from the cache where possible)
+			bvh_built = false;
+			bvh();
+		}
+		else {
+			build_tlas();
+		}
+		geometry_version++;
+	}
+
+	return static_cast<uint32_t>(instances.size() - 1);
+}
+
+void World::set_instance_transform(const uint32_t instance, const glm::mat4& transform) {
+	if (instance >= instances.size()) {
+		std::cerr << "Error: Instance " << instance << " does not exist." << std::endl;
+		return;
+	}
+
+	// Instances are only ever appended, so the view of the mesh stays valid
+	instances[instance] = MeshInstance(instances[instance].asset, transform);
+	expand_lights();
+
+	if (bvh_built) {
+		build_tlas();
+	}
+	geometry_version++;
+}
+
+void World::expand_lights() {
+	// Every instance gets its own world space copy of the emissive triangles of its asset
+	lights.clear();
+	light_material_ids.clear();
+	for (uint32_t instance = 0; instance < instances.size(); instance++) {
+		const MeshAsset& asset = assets[instances[instance].asset];
+		const auto first = std::lower_bound(light_triangles.begin(), light_triangles.end(), asset.first_triangle);
+		const auto last = std::lower_bound(first, light_triangles.end(), asset.first_triangle + asset.triangle_count);
+		for (auto it = first; it != last; ++it) {
+			const Triangle triangle = mesh.triangle(instance, *it);
+			lights.push_back(triangle);
+			light_material_ids.push_back(triangle.material_id);
+		}
+	}
+}
+
+void World::add_light_material(const int material_id) {
+	// Only whether a material is emissive matters, so every material is listed once.
+	// The callers only pass ids they checked against all_materials, so the id is not negative.
+	const size_t id = static_cast<size_t>(material_id);
+	if (id >= is_light_material.size()) {
+		is_light_material.resize(id + 1, false);
+	}
+	if (!is_light_material[id]) {
+		is_light_material[id] = true;
+		light_materials.push_back(all_materials[id]);
+	}
+}
+
+void World::update_views() {
+	// A mapped scene file is viewed in place, see load_scene_file
+	if (!scene_file.is_open()) {
+		mesh.positions = owned_positions;
+		mesh.normals = owned_normals;
+		mesh.texcoords = owned_texcoords;
+		mesh.indices = owned_indices;
+		mesh.material_ids = owned_material_ids;
+		mesh.face_normals = owned_face_normals;
+	}
+	mesh.assets = assets;
+	mesh.instances = instances;
+}
+
+void World::detach_scene_file() {
+	if (!scene_file.is_open()) return;
+
+	// Copy the mapped geometry so more objects can be appended to it
+	owned_positions.assign(mesh.positions.begin(), mesh.positions.end());
+	owned_normals.assign(mesh.normals.begin(), mesh.normals.end());
+	owned_texcoords.assign(mesh.texcoords.begin(), mesh.texcoords.end());
+	owned_indices.assign(mesh.indices.begin(), mesh.indices.end());
+	owned_material_ids.assign(mesh.material_ids.begin(), mesh.material_ids.end());
+	owned_face_normals.assign(mesh.face_normals.begin(), mesh.face_normals.end());
+	scene_file.close();
+	update_views();
+}
+
+// Paths of the material libraries recorded in a mapped scene file, false if the section does not fit in the file
+static bool read_material_libraries(const MappedFile& file, const SceneFileHeader& header, std::vector<std::string>& libraries) {
+	const uint64_t size = header.material_library_count * sizeof(uint32_t);
+	const bool fits = header.material_libraries_offset % SCENE_FILE_ALIGNMENT == 0 && header.material_libraries_offset <= file.size()
+		&& size <= file.size() - header.material_libraries_offset
+		&& header.strings_offset <= file.size() && header.strings_size <= file.size() - header.strings_offset
+		&& (header.strings_size == 0 || *file.at<char>(header.strings_offset + header.strings_size - 1) == '\0');
+	if (!fits) {
+		return false;
+	}
+
+	const uint32_t* offsets = file.at<uint32_t>(header.material_libraries_offset);
+	const char* strings = file.at<char>(header.strings_offset);
+	libraries.clear();
+	for (uint32_t i = 0; i < header.material_library_count; i++) {
+		if (offsets[i] >= header.strings_size) {
+			return false;
+		}
+		libraries.emplace_back(strings + offsets[i]);
+	}
+	return true;
+}
+
+// The material libraries of a compiled scene, without loading it. False if it is not a scene file of this version.
+static bool read_scene_material_libraries(const std::string& path, std::vector<std::string>& libraries) {
+	MappedFile file;
+	if (!file.open(path) || file.size() < sizeof(SceneFileHeader)) {
+		return false;
+	}
+	const SceneFileHeader& header = *file.at<SceneFileHeader>(0);
+	if (!std::equal(std::begin(SCENE_FILE_MAGIC), std::end(SCENE_FILE_MAGIC), header.magic) || header.version != SCENE_FILE_VERSION) {
+		return false;
+	}
+	return read_material_libraries(file, header, libraries);
+}
+
+void World::load_scene(const std::vector<SceneObject>& objects, bool recompile) {
+	// The compiled file is named after the object list, its contents are checked against the sources below
+	uint64_t key = hash_bytes(&SCENE_FILE_VERSION, sizeof(SCENE_FILE_VERSION));
+	for (const SceneObject& object : objects) {
+		key = hash_bytes(object.file.data(), object.file.size(), key);
+		key = hash_bytes(&object.is_lights, sizeof(object.is_lights), key);
+		key = hash_bytes(&object.position, sizeof(object.position), key);
+	}
+
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.scene", static_cast<unsigned long long>(key));
+	const std::filesystem::path path = std::filesystem::path(SCENE_CACHE_DIR) / name;
+
+	// Recompile when an obj file or a material library it named changed after the scene was compiled
+	std::error_code ec;
+	bool up_to_date = !recompile && std::filesystem::exists(path, ec);
+	if (up_to_date) {
+		const auto compiled_time = std::filesystem::last_write_time(path, ec);
+		std::vector<std::string> sources;
+		up_to_date = read_scene_material_libraries(path.string(), sources);
+		for (const SceneObject& object : objects) {
+			sources.push_back(object.file);
+		}
+		for (const std::string& source : sources) {
+			if (std::filesystem::exists(source, ec) && std::filesystem::last_write_time(source, ec) > compiled_time) {
+				up_to_date = false;
+			}
+		}
+	}
+
+	if (up_to_date && load_scene_file(path.string())) {
+		std::clog << "Loaded " << triangle_count() << " triangles from " << path.string() << std::endl;
+		return;
+	}
+
+	for (const SceneObject& object : objects) {
+		place_obj(object.file, object.is_lights, object.position);
+	}
+
+	std::filesystem::create_directories(SCENE_CACHE_DIR, ec);
+	if (save_scene_file(path.string())) {
+		std::clog << "Compiled scene to " << path.string() << std::endl;
+	}
+}
+
+bool World::save_scene_file(const std::string& path) const {
+	SceneFileHeader header{};
+	std::copy(std::begin(SCENE_FILE_MAGIC), std::end(SCENE_FILE_MAGIC), header.magic);
+	header.version = SCENE_FILE_VERSION;
+	header.vertex_count = static_cast<uint32_t>(mesh.vertex_count());
+	header.triangle_count = static_cast<uint32_t>(triangle_count());
+	header.light_count = static_cast<uint32_t>(light_triangles.size());
+	header.material_count = static_cast<uint32_t>(all_materials.size());
+	header.asset_count = static_cast<uint32_t>(assets.size());
+	header.instance_count = static_cast<uint32_t>(instances.size());
+	header.material_library_count = static_cast<uint32_t>(material_libraries.size());
+
+	std::vector<SceneFileInstance> file_instances(instances.size());
+	for (size_t i = 0; i < instances.size(); i++) {
+		file_instances[i].asset = instances[i].asset;
+		std::memcpy(file_instances[i].transform, glm::value_ptr(instances[i].transform), sizeof(file_instances[i].transform));
+	}
+
+	// Gather the material strings
+	std::string strings;
+	std::vector<SceneFileMaterial> materials(all_materials.size());
+	const auto add_string = [&](const std::string& str) {
+		const uint32_t offset = static_cast<uint32_t>(strings.size());
+		strings.append(str);
+		strings.push_back('\0');
+		return offset;
+	};
+	for (size_t i = 0; i < all_materials.size(); i++) {
+		const tinyobj::material_t& mat = all_materials[i];
+		for (int c = 0; c < 3; c++) {
+			materials[i].ambient[c] = mat.ambient[c];
+			materials[i].diffuse[c] = mat.diffuse[c];
+			materials[i].emission[c] = mat.emission[c];
+		}
+		materials[i].name = add_string(mat.name);
+		materials[i].diffuse_texname = add_string(mat.diffuse_texname);
+		materials[i].emissive_texname = add_string(mat.emissive_texname);
+	}
+	std::vector<uint32_t> library_strings(material_libraries.size());
+	for (size_t i = 0; i < material_libraries.size(); i++) {
+		library_strings[i] = add_string(material_libraries[i]);
+	}
+
+	uint64_t offset = align_scene_offset(sizeof(SceneFileHeader));
+	const auto place = [&](uint64_t& section_offset, const uint64_t size) {
+		section_offset = offset;
+		offset = align_scene_offset(offset + size);
+	};
+	place(header.positions_offset, mesh.positions.size_bytes());
+	place(header.normals_offset, mesh.normals.size_bytes());
+	place(header.texcoords_offset, mesh.texcoords.size_bytes());
+	place(header.indices_offset, mesh.indices.size_bytes());
+	place(header.material_ids_offset, mesh.material_ids.size_bytes());
+	place(header.face_normals_offset, mesh.face_normals.size_bytes());
+	place(header.lights_offset, light_triangles.size() * sizeof(uint32_t));
+	place(header.assets_offset, assets.size() * sizeof(MeshAsset));
+	place(header.instances_offset, file_instances.size() * sizeof(SceneFileInstance));
+	place(header.materials_offset, materials.size() * sizeof(SceneFileMaterial));
+	place(header.material_libraries_offset, library_strings.size() * sizeof(uint32_t));
+	place(header.strings_offset, strings.size());
+	header.strings_size = strings.size();
+
+	// Write next to the destination first so a crash never leaves a truncated scene behind
+	const std::string tmp_path = path + ".tmp";
+	{
+		std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+		if (!out) {
+			std::cerr << "Could not write " << tmp_path << std::endl;
+			return false;
+		}
+
+		const auto write_at = [&](const uint64_t section_offset, const void* data, const size_t size) {
+			static const char padding[SCENE_FILE_ALIGNMENT] = {};
+			const uint64_t pos = static_cast<uint64_t>(out.tellp());
+			out.write(padding, static_cast<std::streamsize>(section_offset - pos));
+			out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+		};
+		write_at(0, &header, sizeof(header));
+		write_at(header.positions_offset, mesh.positions.data(), mesh.positions.size_bytes());
+		write_at(header.normals_offset, mesh.normals.data(), mesh.normals.size_bytes());
+		write_at(header.texcoords_offset, mesh.texcoords.data(), mesh.texcoords.size_bytes());
+		write_at(header.indices_offset, mesh.indices.data(), mesh.indices.size_bytes());
+		write_at(header.material_ids_offset, mesh.material_ids.data(), mesh.material_ids.size_bytes());
+		write_at(header.face_normals_offset, mesh.face_normals.data(), mesh.face_normals.size_bytes());
+		write_at(header.lights_offset, light_triangles.data(), light_triangles.size() * sizeof(uint32_t));
+		write_at(header.assets_offset, assets.data(), assets.size() * sizeof(MeshAsset));
+		write_at(header.instances_offset, file_instances.data(), file_instances.size() * sizeof(SceneFileInstance));
+		write_at(header.materials_offset, materials.data(), materials.size() * sizeof(SceneFileMaterial));
+		write_at(header.material_libraries_offset, library_strings.data(), library_strings.size() * sizeof(uint32_t));
+		write_at(header.strings_offset, strings.data(), strings.size());
+
+		if (!out) {
+			std::cerr << "Could not write " << tmp_path << std::endl;
+			return false;
+		}
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(tmp_path, path, ec);
+	if (ec) {
+		std::cerr << "Could not write " << path << ": " << ec.message() << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool World::load_scene_file(const std::string& path) {
+	if (triangle_count() > 0) {
+		std::cerr << "Error: A scene file can only be loaded into an empty world." << std::endl;
+		return false;
+	}
+
+	MappedFile file;
+	if (!file.open(path)) {
+		return false;
+	}
+
+	if (file.size() < sizeof(SceneFileHeader)) {
+		std::cerr << "Scene file " << path << " is truncated" << std::endl;
+		return false;
+	}
+	const SceneFileHeader& header = *file.at<SceneFileHeader>(0);
+	if (!std::equal(std::begin(SCENE_FILE_MAGIC), std::end(SCENE_FILE_MAGIC), header.magic) || header.version != SCENE_FILE_VERSION) {
+		std::cerr << "Scene file " << path << " has an unsupported format" << std::endl;
+		return false;
+	}
+
+	const uint64_t vertex_count = header.vertex_count;
+	const uint64_t triangle_count = header.triangle_count;
+	const auto section_fits = [&](const uint64_t offset, const uint64_t size) {
+		return offset % SCENE_FILE_ALIGNMENT == 0 && offset <= file.size() && size <= file.size() - offset;
+	};
+	const bool fits = section_fits(header.positions_offset, vertex_count * sizeof(tinybvh::bvhvec4))
+		&& section_fits(header.normals_offset, vertex_count * sizeof(glm::vec3))
+		&& section_fits(header.texcoords_offset, vertex_count * sizeof(glm::vec2))
+		&& section_fits(header.indices_offset, 3 * triangle_count * sizeof(uint32_t))
+		&& section_fits(header.material_ids_offset, triangle_count * sizeof(int32_t))
+		&& section_fits(header.face_normals_offset, triangle_count * sizeof(glm::vec3))
+		&& section_fits(header.lights_offset, header.light_count * sizeof(uint32_t))
+		&& section_fits(header.assets_offset, header.asset_count * sizeof(MeshAsset))
+		&& section_fits(header.instances_offset, header.instance_count * sizeof(SceneFileInstance))
+		&& section_fits(header.materials_offset, header.material_count * sizeof(SceneFileMaterial))
+		&& section_fits(header.strings_offset, header.strings_size)
+		&& (header.strings_size == 0 || *file.at<char>(header.strings_offset + header.strings_size - 1) == '\0')
+		&& read_material_libraries(file, header, material_libraries);
+	if (!fits) {
+		std::cerr << "Scene file " << path << " is truncated" << std::endl;
+		return false;
+	}
+
+	const char* strings = file.at<char>(header.strings_offset);
+	const auto get_string = [&](const uint32_t offset) {
+		return offset < header.strings_size ? std::string(strings + offset) : std::string();
+	};
+	const SceneFileMaterial* materials = file.at<SceneFileMaterial>(header.materials_offset);
+	for (uint32_t i = 0; i < header.material_count; i++) {
+		tinyobj::material_t mat;
+		for (int c = 0; c < 3; c++) {
+			mat.ambient[c] = materials[i].ambient[c];
+			mat.diffuse[c] = materials[i].diffuse[c];
+			mat.emission[c] = materials[i].emission[c];
+		}
+		mat.name = get_string(materials[i].name);
+		mat.diffuse_texname = get_string(materials[i].diffuse_texname);
+		mat.emissive_texname = get_string(materials[i].emissive_texname);
+		all_materials.push_back(mat);
+	}
+
+	// Out of range indices would make the BVH and every hit read outside the mapping
+	const uint32_t* indices = file.at<uint32_t>(header.indices_offset);
+	for (uint64_t i = 0; i < 3 * triangle_count; i++) {
+		if (indices[i] >= vertex_count) {
+			std::cerr << "Scene file " << path << " has an invalid vertex index" << std::endl;
+			return false;
+		}
+	}
+
+	const MeshAsset* file_assets = file.at<MeshAsset>(header.assets_offset);
+	for (uint32_t i = 0; i < header.asset_count; i++) {
+		if (file_assets[i].first_triangle > triangle_count || file_assets[i].triangle_count > triangle_count - file_assets[i].first_triangle) {
+			std::cerr << "Scene file " << path << " has an invalid asset" << std::endl;
+			return false;
+		}
+	}
+	const SceneFileInstance* file_instances = file.at<SceneFileInstance>(header.instances_offset);
+	for (uint32_t i = 0; i < header.instance_count; i++) {
+		if (file_instances[i].asset >= header.asset_count) {
+			std::cerr << "Scene file " << path << " has an invalid instance" << std::endl;
+			return false;
+		}
+	}
+
+	mesh.positions = { file.at<tinybvh::bvhvec4>(header.positions_offset), vertex_count };
+	mesh.normals = { file.at<glm::vec3>(header.normals_offset), vertex_count };
+	mesh.texcoords = { file.at<glm::vec2>(header.texcoords_offset), vertex_count };
+	mesh.indices = { indices, 3 * triangle_count };
+	mesh.material_ids = { file.at<int32_t>(header.material_ids_offset), triangle_count };
+	mesh.face_normals = { file.at<glm::vec3>(header.face_normals_offset), triangle_count };
+
+	const uint32_t* light_indices = file.at<uint32_t>(header.lights_offset);
+	for (uint32_t i = 0; i < header.light_count; i++) {
+		const uint32_t prim = light_indices[i];
+		if (prim >= header.triangle_count) continue;
+		// expand_lights looks the triangles up by range
+		if (!light_triangles.empty() && prim <= light_triangles.back()) continue;
+
+		const int32_t material_id = mesh.material_ids[prim];
+		if (material_id < 0 || static_cast<size_t>(material_id) >= all_materials.size()) continue;
+
+		add_light_material(material_id);
+		light_triangles.push_back(prim);
+	}
+
+	assets.assign(file_assets, file_assets + header.asset_count);
+	for (uint32_t i = 0; i < header.instance_count; i++) {
+		instances.emplace_back(file_instances[i].asset, glm::make_mat4(file_instances[i].transform));
+	}
+
+	scene_file = std::move(file);
+	update_views();
+	expand_lights();
+	return true;
 }
 
 void World::spawn_vpl(glm::vec3 position, glm::vec3 normal, glm::vec3 color, float intensity) {
-	vpls.push_back(std::make_shared<PointLight>(PointLight(color, intensity, position, normal)));
+	vpls.push_back(position, normal, color, intensity);
+}
+
+uint32_t World::spawn_point_light(glm::vec3 position, glm::vec3 normal, glm::vec3 color, float intensity) {
+	// The scene lights come first, spawning into an empty table would stop them from being generated
+	get_lights();
+
+	LightTable added;
+	added.push_back(position, normal, color, intensity);
+	PhotonHits photons;
+	if (!DISABLE_GI && N_INDIRECT_PHOTONS > 0) {
+		// Blocks of spawned lights start far past the ones of the scene, each light gets its own range
+		const uint32_t first_block = (next_spawned_id + 1) << 16;
+		if (PHOTON_MAP_GI) {
+			trace_photon_map(added, SPAWNED_LIGHT_VPLS, first_block, photons);
+		}
+		else {
+			trace_photons(added, SPAWNED_LIGHT_VPLS, first_block, 1.0f / SPAWNED_LIGHT_VPLS, added);
+		}
+	}
+
+	std::vector<float> weights(added.size());
+	for (size_t i = 0; i < added.size(); i++) {
+		weights[i] = luminance(added.emission[i]);
+	}
+	light_distribution.append(weights);
+
+	point_light_cloud.append({ position });
+	std::vector<glm::vec3> vpl_positions(added.position.begin() + 1, added.position.end());
+	if (!vpl_positions.empty()) {
+		vpl_cloud.append(vpl_positions);
+	}
+	photon_map.append(photons, 1.0f / SPAWNED_LIGHT_VPLS);
+
+	const size_t first = point_lights.size();
+	point_lights.append(added);
+	light_tree.append(point_lights, first);
+	spawned_lights.push_back({ next_spawned_id, static_cast<uint32_t>(added.size() - 1), static_cast<uint32_t>(photons.size()) });
+	return next_spawned_id++;
+}
+
+LightRemap World::remove_point_light(const uint32_t id) {
+	if (spawned_lights.empty()) {
+		return LightRemap();
+	}
+
+	// Find the range of the light, and where its point and VPLs are in the sphere clouds (after those of the scene)
+	uint32_t first = scene_light_count;
+	size_t first_point = point_light_cloud.size() - spawned_lights.size();
+	size_t first_vpl = vpl_cloud.size();
+	size_t first_photon = photon_map.size();
+	for (const SpawnedLight& spawned : spawned_lights) {
+		first_vpl -= spawned.vpl_count;
+		first_photon -= spawned.photon_count;
+	}
+
+	for (size_t s = 0; s < spawned_lights.size(); s++) {
+		const SpawnedLight spawned = spawned_lights[s];
+		if (spawned.id != id) {
+			first += 1 + spawned.vpl_count;
+			first_point++;
+			first_vpl += spawned.vpl_count;
+			first_photon += spawned.photon_count;
+			continue;
+		}
+
+		LightRemap remap;
+		remap.first = first;
+		remap.count = 1 + spawned.vpl_count;
+
+		point_lights.erase(remap.first, remap.count);
+		light_distribution.erase(remap.first, remap.count);
+		light_tree.erase(point_lights, remap.first, remap.count);
+		point_light_cloud.erase(first_point, 1);
+		if (spawned.vpl_count > 0) {
+			vpl_cloud.erase(first_vpl, spawned.vpl_count);
+		}
+		photon_map.erase(first_photon, spawned.photon_count);
+		spawned_lights.erase(spawned_lights.begin() + s);
+		return remap;
+	}
+
+	return LightRemap();
+}
+
+LightRemap World::remove_last_point_light() {
+	if (spawned_lights.empty()) {
+		return LightRemap();
+	}
+	return remove_point_light(spawned_lights.back().id);
 }
 
-void World::spawn_point_light(glm::vec3 position, glm::vec3 normal, glm::vec3 color, float intensity) {
-	point_lights.push_back(std::make_shared<PointLight>(PointLight(color, intensity, position, normal)));
+void World::clear_lights() {
+	point_lights.clear();
+	vpls.clear();
+	spawned_lights.clear();
+	scene_light_count = 0;
+	light_distribution.clear();
+	light_tree.clear();
+	photon_map.clear();
+}
+
+// Pick the widest layout that both this build and the CPU running it support
+static TraversalLayout select_traversal_layout() {
+	if constexpr (!ENABLE_WIDE_BVH) {
+		return TraversalLayout::Binary;
+	}
+#ifdef BVH_USEAVX2
+	if (cpu_supports_avx2_fma()) {
+		return TraversalLayout::Wide8;
+	}
+#endif
+#ifdef BVH_USESSE
+	if (cpu_supports_sse42()) {
+		return TraversalLayout::Wide4;
+	}
+#endif
+	// tinybvh's NEON kernels (BVH_SoA) ignore index buffers, so ARM stays on the binary BVH
+	return TraversalLayout::Binary;
 }
 
 tinybvh::BVH& World::bvh(){
-	// Check if this->bvhInstance is already built
 	if (bvh_built) {
-		return this->bvhInstance;
+		return tlas;
 	}
 	bvh_built = true;
 
-	raw_bvh_data = toBVHVec(triangle_soup);
+	traversal = select_traversal_layout();
+	switch (traversal) {
+	case TraversalLayout::Wide8:
+		std::clog << "Tracing with 8 wide BVHs (AVX2)" << std::endl;
+		break;
+	case TraversalLayout::Wide4:
+		std::clog << "Tracing with 4 wide BVHs (SSE)" << std::endl;
+		break;
+	default:
+		std::clog << "Tracing with binary BVHs" << std::endl;
+		break;
+	}
+
+	blas.clear();
+	blas4.clear();
+	blas8.clear();
+	blas_list.clear();
+	for (uint32_t asset = 0; asset < assets.size(); asset++) {
+		build_blas(asset);
+	}
+	build_tlas();
 
-#if defined(__AVX__) || defined(__AVX2__)
-	bvhInstance.BuildHQ(raw_bvh_data.data(), triangle_soup.size());
-#else
-	bvhInstance.BuildHQ(raw_bvh_data.data(), triangle_soup.size());
-#endif
+	return tlas;
+}
+
+// The mesh the binary BLASes read their triangles from. tinybvh hands custom geometry only the ray and primitive.
+static const Mesh* binary_blas_mesh = nullptr;
+
+// Moller-Trumbore against triangle prim of the instance the ray is in, in its object space.
+// tinybvh's own watertight test has no lower bound on t, so a triangle behind the origin could replace a real hit.
+static bool intersect_blas_triangle(const tinybvh::Ray& ray, const unsigned prim, float& t, float& u, float& v) {
+	const Mesh& mesh = *binary_blas_mesh;
+	const uint32_t first = mesh.assets[mesh.instances[ray.instIdx].asset].first_triangle;
+	const uint32_t* tri = mesh.indices.data() + 3 * (static_cast<size_t>(first) + prim);
+	const tinybvh::bvhvec3 v0 = mesh.positions[tri[0]];
+	const tinybvh::bvhvec3 edge1 = tinybvh::bvhvec3(mesh.positions[tri[1]]) - v0;
+	const tinybvh::bvhvec3 edge2 = tinybvh::bvhvec3(mesh.positions[tri[2]]) - v0;
+	const tinybvh::bvhvec3 h = tinybvh::tinybvh_cross(ray.D, edge2);
+	const float a = tinybvh::tinybvh_dot(edge1, h);
+	if (std::fabs(a) < 0.0000001f) {
+		return false; // Ray parallel to the triangle
+	}
+	const float f = 1.0f / a;
+	const tinybvh::bvhvec3 s = ray.O - v0;
+	u = f * tinybvh::tinybvh_dot(s, h);
+	if (u < 0.0f || u > 1.0f) {
+		return false;
+	}
+	const tinybvh::bvhvec3 q = tinybvh::tinybvh_cross(s, edge1);
+	v = f * tinybvh::tinybvh_dot(ray.D, q);
+	if (v < 0.0f || u + v > 1.0f) {
+		return false;
+	}
+	t = f * tinybvh::tinybvh_dot(edge2, q);
+	return t >= 0.0f;
+}
+
+static bool intersect_binary_blas(tinybvh::Ray& ray, const unsigned prim) {
+	float t, u, v;
+	if (!intersect_blas_triangle(ray, prim, t, u, v) || t >= ray.hit.t) {
+		return false;
+	}
+	ray.hit.t = t;
+	ray.hit.u = u;
+	ray.hit.v = v;
+	ray.hit.prim = prim;
+	return true;
+}
+
+static bool occluded_binary_blas(const tinybvh::Ray& ray, const unsigned prim) {
+	float t, u, v;
+	return intersect_blas_triangle(ray, prim, t, u, v) && t < ray.hit.t;
+}
+
+void World::build_blas(const uint32_t asset_index) {
+	const MeshAsset& asset = assets[asset_index];
+	const tinybvh::bvhvec4slice vertices(mesh.positions.data(), static_cast<uint32_t>(mesh.vertex_count()), sizeof(tinybvh::bvhvec4));
+	const uint32_t* indices = mesh.indices.data() + 3 * static_cast<size_t>(asset.first_triangle);
+
+	// The wide BVHs are collapsed from a binary one of their own, which is changed during the conversion.
+	// So the binary tree is loaded or built in place and cached before that happens.
+	std::unique_ptr<tinybvh::BVH> binary;
+	std::unique_ptr<tinybvh::BVH4_CPU> wide4;
+	std::unique_ptr<tinybvh::BVH8_CPU> wide8;
+	tinybvh::BVH* target;
+	switch (traversal) {
+	case TraversalLayout::Wide8:
+		wide8 = std::make_unique<tinybvh::BVH8_CPU>();
+		target = &wide8->bvh8.bvh;
+		break;
+	case TraversalLayout::Wide4:
+		wide4 = std::make_unique<tinybvh::BVH4_CPU>();
+		target = &wide4->bvh4.bvh;
+		break;
+	default:
+		binary = std::make_unique<tinybvh::BVH>();
+		target = binary.get();
+		break;
+	}
+
+	std::string cache_path;
+	bool cached = false;
+	if constexpr (ENABLE_BVH_CACHE) {
+		cache_path = bvh_cache_path(asset);
+		cached = load_cached_bvh(cache_path, asset, *target);
+		if (cached) {
+			std::clog << "Loaded BVH from " << cache_path << std::endl;
+		}
+	}
+
+	if (!cached) {
+		target->BuildHQ(vertices, indices, asset.triangle_count);
+
+		if constexpr (ENABLE_BVH_CACHE) {
+			save_cached_bvh(cache_path, *target);
+		}
+	}
+
+	if (wide8) {
+		wide8->ConvertFrom(wide8->bvh8);
+		blas_list.push_back(wide8.get());
+		blas8.push_back(std::move(wide8));
+	}
+	else if (wide4) {
+		wide4->ConvertFrom(wide4->bvh4);
+		blas_list.push_back(wide4.get());
+		blas4.push_back(std::move(wide4));
+	}
+	else {
+		// Trace the binary tree through the callbacks above instead of tinybvh's triangle test.
+		// The tree was built and cached over the index buffer, which is not needed after that.
+		binary_blas_mesh = &mesh;
+		binary->vertIdx = nullptr;
+		binary->customIntersect = intersect_binary_blas;
+		binary->customIsOccluded = occluded_binary_blas;
+		blas_list.push_back(binary.get());
+		blas.push_back(std::move(binary));
+	}
+}
+
+void World::build_tlas() {
+	// tinybvh refuses to build over nothing, tracing an empty scene never reaches the TLAS
+	if (instances.empty()) {
+		return;
+	}
+
+	blas_instances.resize(instances.size());
+	for (size_t i = 0; i < instances.size(); i++) {
+		tinybvh::BLASInstance& instance = blas_instances[i];
+		instance.blasIdx = instances[i].asset;
+		// tinybvh stores the transform row-major, glm column-major
+		for (int row = 0; row < 4; row++) {
+			for (int col = 0; col < 4; col++) {
+				instance.transform[row * 4 + col] = instances[i].transform[col][row];
+			}
+		}
+	}
 
-	return bvhInstance;
+	// Also refits the instance bounds to their new transforms
+	tlas.Build(blas_instances.data(), static_cast<uint32_t>(blas_instances.size()), blas_list.data(), static_cast<uint32_t>(blas_list.size()));
+}
+
+// Bump whenever the vertex layout handed to tinybvh changes, so stale caches are not picked up
+constexpr uint32_t BVH_CACHE_FORMAT = 3;
+
+std::string World::bvh_cache_path(const MeshAsset& asset) const {
+	uint64_t key = hash_bytes(&BVH_CACHE_FORMAT, sizeof(BVH_CACHE_FORMAT), asset.source_hash);
+	key = hash_bytes(&asset.triangle_count, sizeof(asset.triangle_count), key);
+
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bvh", static_cast<unsigned long long>(key));
+	return (std::filesystem::path(BVH_CACHE_DIR) / name).string();
+}
+
+bool World::load_cached_bvh(const std::string& path, const MeshAsset& asset, tinybvh::BVH& target) {
+	if (!std::filesystem::exists(path)) {
+		return false;
+	}
+
+	// Load checks the tinybvh version, the layout and the triangle count
+	const tinybvh::bvhvec4slice vertices(mesh.positions.data(), static_cast<uint32_t>(mesh.vertex_count()), sizeof(tinybvh::bvhvec4));
+	const uint32_t* indices = mesh.indices.data() + 3 * static_cast<size_t>(asset.first_triangle);
+	if (!target.Load(path.c_str(), vertices, indices, asset.triangle_count)) {
+		std::cerr << "BVH cache " << path << " is incompatible, rebuilding" << std::endl;
+		return false;
+	}
+
+	// The file could still be truncated or belong to different geometry with a colliding hash,
+	// so walk the tree to check that every index is in range and the root bounds match the triangles
+	bool valid = target.usedNodes > 0 && target.triCount == asset.triangle_count;
+	std::vector<uint32_t> stack = { 0 };
+	while (valid && !stack.empty()) {
+		const uint32_t node_index = stack.back();
+		stack.pop_back();
+		if (node_index >= target.usedNodes) {
+			valid = false;
+			break;
+		}
+
+		const tinybvh::BVH::BVHNode& node = target.bvhNode[node_index];
+		if (!node.isLeaf()) {
+			stack.push_back(node.leftFirst);
+			stack.push_back(node.leftFirst + 1);
+			valid = stack.size() <= target.usedNodes;
+			continue;
+		}
+
+		valid = node.leftFirst + node.triCount <= target.idxCount;
+		for (uint32_t i = 0; valid && i < node.triCount; i++) {
+			valid = target.primIdx[node.leftFirst + i] < target.triCount;
+		}
+	}
+
+	if (valid) {
+		tinybvh::bvhvec3 bmin(1e30f), bmax(-1e30f);
+		for (uint32_t i = 0; i < 3 * asset.triangle_count; i++) {
+			const tinybvh::bvhvec3 v(mesh.positions[indices[i]]);
+			bmin = tinybvh::tinybvh_min(bmin, v);
+			bmax = tinybvh::tinybvh_max(bmax, v);
+		}
+		const tinybvh::BVH::BVHNode& root = target.bvhNode[0];
+		for (int a = 0; a < 3; a++) {
+			const float eps = 1e-4f * (1.0f + bmax[a] - bmin[a]);
+			valid = valid && fabs(root.aabbMin[a] - bmin[a]) <= eps && fabs(root.aabbMax[a] - bmax[a]) <= eps;
+		}
+	}
+
+	if (!valid) {
+		std::cerr << "BVH cache " << path << " is corrupt, rebuilding" << std::endl;
+		// A loaded BVH has no fragment buffer, make the next build allocate everything again
+		target.allocatedNodes = 0;
+		return false;
+	}
+
+	return true;
+}
+
+void World::save_cached_bvh(const std::string& path, tinybvh::BVH& source) {
+	std::error_code ec;
+	std::filesystem::create_directories(BVH_CACHE_DIR, ec);
+	if (ec) {
+		std::cerr << "Could not create " << BVH_CACHE_DIR << ": " << ec.message() << std::endl;
+		return;
+	}
+
+	source.Save(path.c_str());
+	std::clog << "Saved BVH to " << path << std::endl;
 }
 
 bool World::intersect(Ray& ray, HitInfo& hit) {
@@ -216,83 +1063,159 @@ bool World::intersect(Ray& ray, HitInfo& hit) {
 		std::cerr << "Error: BVH not built. Call bvh() before intersect()." << std::endl;
 		return false;
 	}
-	bvhInstance.Intersect(r);
+	if (instances.empty()) {
+		return false;
+	}
+
+	tlas.Intersect(r);
+	return resolve_hit(ray, r, hit);
+}
+
+bool World::resolve_hit(const Ray& ray, const tinybvh::Ray& r, HitInfo& hit) {
 	if (r.hit.t == 1E30f) {
 		return false; // No intersection
 	}
 
+	// The BLAS reports the triangle relative to the start of its asset
+	const uint32_t instance = r.hit.inst;
+	const uint32_t prim = assets[instances[instance].asset].first_triangle + r.hit.prim;
+
 	hit.t = r.hit.t;
 	hit.r = ray;
-	const Triangle& triangle = triangle_soup[r.hit.prim];
+	hit.prim = prim;
+	hit.instance = instance;
+	hit.mesh = &mesh;
 
-	hit.triangle = triangle;
-
-	int m_id = bvhInstance.verts[r.hit.prim * 3][3];
+	int m_id = mesh.material_ids[prim];
 	if (m_id < 0 || m_id >= all_materials.size()) {
 		std::cerr << "Error: Material ID out of range." << std::endl;
+		hit.prim = INVALID_PRIM;
 		return false;
 	}
 
-	hit.mat_ptr = get_materials()[m_id];
+	hit.material = get_material_table()[m_id];
 
-	hit.uv = glm::vec2(r.hit.u, r.hit.v);
+	// Both the wide kernels and the binary BLAS callbacks measure the barycentrics from the second corner
+	hit.uv = glm::vec2(1.0f - r.hit.u - r.hit.v, r.hit.u);
 
 	return true;
 }
 
 bool World::is_occluded(const Ray &ray, float dist) {
+	if (instances.empty()) {
+		return false;
+	}
 	tinybvh::Ray r = toBVHRay(ray, dist);
-	return this->bvhInstance.IsOccluded(r);
+	return tlas.IsOccluded(r);
+}
+
+void World::intersect(std::span<const Ray> rays, std::span<HitInfo> hits) {
+	if (!bvh_built) {
+		std::cerr << "Error: BVH not built. Call bvh() before intersect()." << std::endl;
+		return;
+	}
+	if (instances.empty()) {
+		for (HitInfo& hit : hits.first(rays.size())) {
+			hit.prim = INVALID_PRIM;
+		}
+		return;
+	}
+
+	// Batches are small (a tile or a row), so the tinybvh rays live on the stack
+	constexpr size_t CHUNK = 64;
+	std::array<tinybvh::Ray, CHUNK> bvh_rays;
+
+	for (size_t first = 0; first < rays.size(); first += CHUNK) {
+		const size_t count = std::min(CHUNK, rays.size() - first);
+		for (size_t k = 0; k < count; k++) {
+			bvh_rays[k] = toBVHRay(rays[first + k]);
+			tlas.Intersect(bvh_rays[k]);
+		}
+
+		for (size_t k = 0; k < count; k++) {
+			HitInfo& hit = hits[first + k];
+			if (!resolve_hit(rays[first + k], bvh_rays[k], hit)) {
+				hit.prim = INVALID_PRIM;
+			}
+		}
+	}
+}
+
+void World::is_occluded(std::span<const Ray> rays, std::span<const float> dists, std::span<uint8_t> occluded) {
+	if (instances.empty()) {
+		std::fill_n(occluded.begin(), rays.size(), uint8_t(0));
+		return;
+	}
+
+	// Staged like intersect, the rays of a chunk are converted first and then traced back to back
+	constexpr size_t CHUNK = 64;
+	std::array<tinybvh::Ray, CHUNK> bvh_rays;
+
+	for (size_t first = 0; first < rays.size(); first += CHUNK) {
+		const size_t count = std::min(CHUNK, rays.size() - first);
+		for (size_t k = 0; k < count; k++) {
+			bvh_rays[k] = toBVHRay(rays[first + k], dists[first + k]);
+		}
+
+		for (size_t k = 0; k < count; k++) {
+			occluded[first + k] = tlas.IsOccluded(bvh_rays[k]);
+		}
+	}
 }
 
-std::vector <std::weak_ptr<PointLight>> World::get_lights() {
+const LightTable& World::get_lights() {
 	if (point_lights.empty()) {
 		point_lights = generate_point_lights();
 
 		// Convert point lights to glm::vec3
-		auto point_light_positions = std::make_unique<std::vector<glm::vec3>>();
-		point_light_positions->reserve(point_lights.size());
-		for (const auto& pl : point_lights) {
-			glm::vec3 pos = pl->position;
+		std::vector<glm::vec3> point_light_positions;
+		point_light_positions.reserve(point_lights.size());
+		for (const glm::vec3& pos : point_lights.position) {
 			if (std::isnan(pos.x) || std::isnan(pos.y) || std::isnan(pos.z)) {
 				std::cerr << "Error: Point light position is NaN!" << std::endl;
 			}
 			else {
-				point_light_positions->push_back(pos);
+				point_light_positions.push_back(pos);
 			}
 		}
 
-		point_light_cloud.points = std::move(point_light_positions);
-		point_light_cloud.build_index();
+		point_light_cloud.build(std::move(point_light_positions));
 
 		// Add all the vpls
-		for (const auto& vpl : vpls) {
-			point_lights.push_back(vpl);
-		}
+		point_lights.append(vpls);
+		scene_light_count = static_cast<uint32_t>(point_lights.size());
 
 		// Convert vpls to points glm::vec3
-		auto vpl_positions = std::make_unique<std::vector<glm::vec3>>();
-		vpl_positions->reserve(vpls.size());
-		for (const auto& vpl : vpls) {
-			glm::vec3 pos = vpl->position;
+		std::vector<glm::vec3> vpl_positions;
+		vpl_positions.reserve(vpls.size());
+		for (const glm::vec3& pos : vpls.position) {
 			if (std::isnan(pos.x) || std::isnan(pos.y) || std::isnan(pos.z)) {
 				std::cerr << "Error: VPL position is NaN!" << std::endl;
 			}
 			else {
-				vpl_positions->push_back(pos);
+				vpl_positions.push_back(pos);
 			}
 		}
-		vpl_cloud.points = std::move(vpl_positions);
-		vpl_cloud.build_index();
+		vpl_cloud.build(std::move(vpl_positions));
+
+		light_distribution.clear();
+		light_tree.clear();
 	}
 
-	const int num_lights = point_lights.size();
-	std::vector<std::weak_ptr<PointLight>> weak_lights(num_lights);
-	for (size_t i = 0; i < num_lights; i++) {
-		std::shared_ptr<PointLight> light = point_lights[i];
-		weak_lights[i] = std::weak_ptr<PointLight>(light);
+	if (light_distribution.size() != point_lights.size()) {
+		// Weight every light by its power
+		std::vector<float> weights(point_lights.size());
+		for (size_t i = 0; i < point_lights.size(); i++) {
+			weights[i] = luminance(point_lights.emission[i]);
+		}
+		light_distribution.build(weights);
 	}
-	return weak_lights;
+
+	if (light_tree.size() != point_lights.size()) {
+		light_tree.build(point_lights);
+	}
+
+	return point_lights;
 }
 
 std::vector<std::shared_ptr<TriangularLight>> World::get_triangular_lights() {
@@ -314,33 +1237,180 @@ std::vector<std::shared_ptr<TriangularLight>> World::get_triangular_lights() {
 	return scene_lights;
 }
 
-thread_local std::mt19937 rng2(std::random_device{}());
-std::uniform_real_distribution<float> dist2(0.0f, 1.0f);
+// Start a GI photon from a random point light of sources. Returns false if the photon carries no usable flux.
+static bool emit_photon(const LightTable& sources, Sampler& sampler, const float vpl_intensity, Photon& photon) {
+	// Generate photon from existing point light in the scene
+	const size_t idx = std::min(static_cast<size_t>(sampler.get_1d(EMISSION_SEQUENCE) * sources.size()), sources.size() - 1);
 
-static int sample_light_index(const int num_lights) {
-	// Thread-local pair to track last used upper bound and distribution
-	thread_local int cached_num_lights = -1;
+	float pdf_pt = 1.0f;
+	const glm::vec3 emit_pos = sources.position[idx]; // Use the position of the point light directly (more optimized)
 
+	// Offset the random point slightly in the direction of the normal to avoid self-occlusion
+	const glm::vec3 normal = sources.normal[idx];
+	const glm::vec3 offset_pt = emit_pos + 1e-4f * normal;
 
-	if (cached_num_lights != num_lights) {
-		cached_num_lights = num_lights;
+	// Sample a random direction from the hemisphere above the light source
+	float pdf_dir;
+	const glm::vec3 random_dir = cosine_weighted_hemisphere_sample(normal, sampler.get_2d(EMISSION_SEQUENCE), pdf_dir);
+
+	if (pdf_dir <= 0.0f) {
+		// If the PDF is zero or negative, skip this photon
+		return false;
 	}
 
-	const int out = static_cast<int>(dist2(rng2) * cached_num_lights);
+	const float cos_theta = glm::dot(normal, random_dir); // Cosine of the angle between the light normal and the random direction
+	if (cos_theta <= 0.0f) {
+		// If the cosine is zero or negative, skip this photon
+		return false;
+	}
 
-	return out;
+	const glm::vec3 per_photon_flux = sources.emission[idx] * cos_theta / (pdf_pt * pdf_dir);
+
+	// check if the intensity is valid
+	if (any(glm::isnan(per_photon_flux)) || any(glm::isinf(per_photon_flux))) {
+		std::cerr << "Error: per_photon_flux is NaN or Inf!" << std::endl;
+		return false; // Skip this photon if the intensity is invalid
+	}
+
+	// Create a photon with the random point and direction
+	photon = Photon(offset_pt, random_dir, per_photon_flux);
+	photon.vpl_intensity = vpl_intensity;
+	return true;
+}
+
+void World::trace_photons(const LightTable& sources, const size_t quota, const uint32_t first_block, const float vpl_intensity, LightTable& out) {
+	// The VPLs are split into blocks of PHOTON_BLOCK_SIZE that are traced in parallel, every photon draws its random
+	// numbers from a stream keyed by its block and index. So the VPLs do not depend on the number of threads or on
+	// which thread traced which block.
+	get_material_table(); // Built on first use, which must not happen inside the parallel region
+	const int64_t block_count = static_cast<int64_t>((quota + PHOTON_BLOCK_SIZE - 1) / PHOTON_BLOCK_SIZE);
+	std::vector<LightTable> block_vpls(block_count);
+
+#pragma omp parallel
+	{
+		// Per thread scratch space of the wavefront mode
+		std::vector<Photon> photons;
+		std::vector<Rng> photon_rngs;
+		std::vector<Ray> rays;
+		std::vector<HitInfo> hits;
+
+#pragma omp for schedule(dynamic)
+		for (int64_t block = 0; block < block_count; block++) {
+			const size_t block_quota = std::min<size_t>(PHOTON_BLOCK_SIZE, quota - static_cast<size_t>(block) * PHOTON_BLOCK_SIZE);
+			const uint32_t block_key = first_block + static_cast<uint32_t>(block);
+			LightTable& local_vpls = block_vpls[block];
+			local_vpls.reserve(block_quota);
+
+			// Emission is stratified over the photons of the block, their bounces use independent numbers
+			Sampler emission(rng_key(block_key, 0, RNG_STREAM_PHOTON), 0);
+
+			// Photons that leave the scene leave no VPLs, so a light facing the void could emit forever
+			const uint32_t max_emitted = static_cast<uint32_t>(block_quota) * MAX_PHOTONS_PER_VPL;
+			uint32_t emitted = 0;
+			size_t generated = 0;
+			if constexpr (WAVEFRONT_PHOTONS) {
+				// Trace one bounce of every photon in flight as a batch, then move the survivors to the front
+				// and fill the free slots with new photons
+				photons.clear();
+				photon_rngs.clear();
+				rays.resize(PHOTON_BATCH_SIZE);
+				hits.resize(PHOTON_BATCH_SIZE);
+
+				while (generated < block_quota && (emitted < max_emitted || !photons.empty())) {
+					const size_t in_flight = std::min(static_cast<size_t>(PHOTON_BATCH_SIZE), block_quota - generated);
+					while (photons.size() < in_flight && emitted < max_emitted) {
+						Photon photon;
+						Rng rng(emitted, block_key, RNG_STREAM_PHOTON);
+						emission.start_sample(emitted++);
+						if (emit_photon(sources, emission, vpl_intensity, photon)) {
+							photons.push_back(photon);
+							photon_rngs.push_back(rng);
+						}
+					}
+
+					const size_t count = photons.size();
+					for (size_t k = 0; k < count; k++) {
+						rays[k] = Ray(photons[k].position, photons[k].direction);
+					}
+					intersect(std::span<const Ray>(rays.data(), count), std::span<HitInfo>(hits.data(), count));
+
+					size_t alive = 0;
+					for (size_t k = 0; k < count && generated < block_quota; k++) {
+						if (hits[k].prim == INVALID_PRIM) {
+							continue; // The photon left the scene
+						}
+
+						const size_t before = local_vpls.size();
+						const bool scattered = photons[k].scatter(rays[k], hits[k], photon_rngs[k], local_vpls);
+						generated += local_vpls.size() - before;
+
+						if (scattered && photons[k].bounces < MAX_BOUNCES) {
+							photons[alive] = photons[k];
+							photon_rngs[alive] = photon_rngs[k];
+							alive++;
+						}
+					}
+					photons.resize(alive);
+					photon_rngs.resize(alive);
+				}
+			}
+			else {
+				while (generated < block_quota && emitted < max_emitted) {
+					Photon photon;
+					Rng rng(emitted, block_key, RNG_STREAM_PHOTON);
+					emission.start_sample(emitted++);
+					if (emit_photon(sources, emission, vpl_intensity, photon)) {
+						generated += photon.shoot(*this, MAX_BOUNCES, block_quota - generated, rng, local_vpls);
+					}
+				}
+			}
+		}
+	}
+
+	for (const LightTable& local_vpls : block_vpls) {
+		out.append(local_vpls);
+	}
 }
 
-static std::shared_ptr<TriangularLight> pick_triangular_light(std::vector<std::shared_ptr<TriangularLight>>& lights) {
-	// Pick a random light source uniformly (regardless of its area)
-	// FUTURE: Implement importance sampling based on the area and intensity of the light source
-	const int index = sample_light_index(lights.size());
-	return lights[index];
+void World::trace_photon_map(const LightTable& sources, const size_t count, const uint32_t first_block, PhotonHits& out) {
+	// Blocks of PHOTON_BLOCK_SIZE photons are traced in parallel with the same keys as in trace_photons. Unlike VPLs
+	// the number of photons emitted is fixed, which is what their flux is normalized by.
+	get_material_table(); // Built on first use, which must not happen inside the parallel region
+	const int64_t block_count = static_cast<int64_t>((count + PHOTON_BLOCK_SIZE - 1) / PHOTON_BLOCK_SIZE);
+	std::vector<PhotonHits> block_photons(block_count);
+
+#pragma omp parallel for schedule(dynamic)
+	for (int64_t block = 0; block < block_count; block++) {
+		const uint32_t block_size = static_cast<uint32_t>(std::min<size_t>(PHOTON_BLOCK_SIZE, count - static_cast<size_t>(block) * PHOTON_BLOCK_SIZE));
+		const uint32_t block_key = first_block + static_cast<uint32_t>(block);
+		Sampler emission(rng_key(block_key, 0, RNG_STREAM_PHOTON), 0);
+
+		for (uint32_t i = 0; i < block_size; i++) {
+			Photon photon;
+			Rng rng(i, block_key, RNG_STREAM_PHOTON);
+			emission.start_sample(i);
+			if (!emit_photon(sources, emission, 1.0f, photon)) {
+				continue;
+			}
+
+			// Russian roulette goes by the flux, so the photon carries its color and is stored with its power
+			const float power = glm::max(glm::max(photon.flux.r, photon.flux.g), photon.flux.b);
+			if (power > 0.0f) {
+				photon.flux /= power;
+				photon.vpl_intensity = power;
+				photon.shoot(*this, MAX_BOUNCES, rng, block_photons[block]);
+			}
+		}
+	}
+
+	for (const PhotonHits& photons : block_photons) {
+		out.append(photons);
+	}
 }
 
-std::vector<std::shared_ptr<PointLight>> World::generate_point_lights() {
+LightTable World::generate_point_lights() {
 	constexpr size_t num_photons = N_PHOTONS;
-	std::vector<std::shared_ptr<PointLight>> out;
+	LightTable out;
 	out.reserve(num_photons);
 
 	// 1) For every triangular light in the scene, randomly generate point lights on it, similarly to how random light samples were generated.
@@ -354,21 +1424,22 @@ std::vector<std::shared_ptr<PointLight>> World::generate_point_lights() {
 
 	// Per light, sample a number of photons proportional to its area and intensity
 	size_t j = 0;
+	Sampler light_points(rng_key(0, 0, RNG_STREAM_LIGHT), 0);
 	for (auto& light : scene_lights) {
 		float weight = light->intensity * light->area() / total_weight;
 		int num_dl = static_cast<int>(weight * num_photons);
 
 		for (int i = 0; i < num_dl; ++i) {
 			float pdf_pt;
-			glm::vec3 pos = light->sample_on_light(pdf_pt);
+			light_points.start_sample(static_cast<uint32_t>(j++));
+			glm::vec3 pos = light->sample_on_light(light_points.get_2d(EMISSION_SEQUENCE), pdf_pt);
 			glm::vec3 norm = light->normal(pos);
 			float area = light->area();
 
 			// Direct light emitted flux per photon = (intensity * area) / total_photons
 			float per_photon_flux = (light->intensity * area) / float(num_photons);
 
-			auto pl = std::make_shared<PointLight>(light->c, per_photon_flux, pos, norm);
-			out.push_back(pl);
+			out.push_back(pos, norm, light->c, per_photon_flux);
 		}
 	}
 
@@ -382,55 +1453,18 @@ std::vector<std::shared_ptr<PointLight>> World::generate_point_lights() {
 		return out;
 	}
 
-	// 2) Generate indirect VPLs for GI via photon tracing
-	size_t generated = 0;
-	while (generated < N_INDIRECT_PHOTONS) {
-		// Generate photon from existing point light in the scene
-		const int idx = dist2(rng2) * out.size();
-		const auto& base = out[idx];
-		//if (!base) {
-		//	// Error
-		//	std::cerr << "Error: Light is null at index " << idx << std::endl;
-		//}
-
-		float pdf_pt = 1.0f;
-		//const glm::vec3 emit_pos = base->sample_on_light(pdf_pt);
-		const glm::vec3 emit_pos = base->position; // Use the position of the point light directly (more optimized)
-
-		// Offset the random point slightly in the direction of the normal to avoid self-occlusion
-		const glm::vec3 normal = base->normal(emit_pos);
-		const glm::vec3 offset_pt = emit_pos + 1e-4f * normal;
-
-		// Sample a random direction from the hemisphere above the light source
-		float pdf_dir;
-		const glm::vec3 random_dir = base->sample_direction(emit_pos, pdf_dir);
-
-		if (pdf_dir <= 0.0f) {
-			// If the PDF is zero or negative, skip this photon
-			continue;
-		}
-
-		const float cos_theta = glm::dot(normal, random_dir); // Cosine of the angle between the light normal and the random direction
-		if (cos_theta <= 0.0f) {
-			// If the cosine is zero or negative, skip this photon
-			continue;
-		}
-
-		const float raw_flux = base->intensity * cos_theta / (pdf_pt * pdf_dir);
-		const float per_photon_flux = raw_flux;
-
-		// check if the intensity is valid
-		if (!std::isfinite(per_photon_flux)) {
-			std::cerr << "Error: per_photon_flux is NaN or Inf!" << std::endl;
-			// print base->intensity, cos_theta, pdf_pt and pdf_dir
-			continue; // Skip this photon if the intensity is invalid
-		}
-
-		// Create a photon with the random point and direction
-		Photon photon(offset_pt, random_dir, base->c, per_photon_flux);
+	if (out.empty()) {
+		return out;
+	}
 
-		// Shoot the photon into the scene
-		photon.shoot(*this, MAX_BOUNCES, generated, N_INDIRECT_PHOTONS);
+	// 2) Generate indirect VPLs for GI via photon tracing, or the photon map
+	if (PHOTON_MAP_GI) {
+		PhotonHits photons;
+		trace_photon_map(out, N_MAP_PHOTONS, 0, photons);
+		photon_map.append(photons, static_cast<float>(out.size()) / N_MAP_PHOTONS);
+	}
+	else {
+		trace_photons(out, N_INDIRECT_PHOTONS, 0, N_PHOTONS / float(N_INDIRECT_PHOTONS), vpls);
 	}
 
 	// 3) Return the generated point lights
@@ -482,5 +1516,18 @@ std::vector<std::weak_ptr<Material>> World::get_materials(bool ignore_textures){
 		std::shared_ptr<Material> mat = mats_small[i];
 		weak_mats[i] = std::weak_ptr<Material>(mat);
 	}
+
+	// Hits point straight at the materials, the world keeps them alive
+	material_table.resize(num_mats);
+	for (size_t i = 0; i < num_mats; i++) {
+		material_table[i] = mats_small[i].get();
+	}
 	return weak_mats;
 }
+
+std::span<const Material* const> World::get_material_table() {
+	if (material_table.empty()) {
+		get_materials();
+	}
+	return material_table;
+}
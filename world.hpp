@@ -10,58 +10,173 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <cstdint>
+#include <span>
+#include <unordered_map>
 
 #include "light.hpp"
 #include "material.hpp"
 #include "spheres.hpp"
+#include "photon_map.hpp"
+#include "alias_table.hpp"
+#include "light_tree.hpp"
+#include "geometry.hpp"
+#include "mesh.hpp"
+#include "aligned_allocator.hpp"
+#include "scene_file.hpp"
+
+// Acceleration structure the rays are traced through, chosen at runtime by World::bvh
+enum class TraversalLayout {
+	Binary, // tinybvh::BVH, always available
+	Wide4,  // tinybvh::BVH4_CPU, needs SSE4.2
+	Wide8,  // tinybvh::BVH8_CPU, needs AVX2 and FMA
+};
+
+// An obj file and where to put it in the scene
+struct SceneObject {
+	std::string file;
+	bool is_lights;
+	glm::vec3 position;
+};
 
 class World
 {
 	public:
-	std::vector<Triangle> triangle_soup;
+	// Indexed scene geometry. It views either the arrays filled by place_obj or a mapped compiled
+	// scene. Every asset gets its own BVH, the instances are combined by a top level BVH.
+	Mesh mesh;
+
 	std::vector<tinyobj::material_t> all_materials;
 	std::vector<Triangle> lights;
 	std::vector<tinyobj::material_t> light_materials;
-	std::vector<std::shared_ptr<PointLight>> point_lights;
+	LightTable point_lights; // Flat light table the sampler and shading index into
 	
 	
 	World(); // constructor makes an empty world
 
 	void add_obj(std::string file, bool is_lights); // Add an obj, indicate if it is all lights
-	void place_obj(std::string file, bool is_lights, glm::vec3 position);
+	// Place an obj in the scene, an obj that was placed before is shared instead of loaded again. Returns the instance index.
+	uint32_t place_obj(std::string file, bool is_lights, glm::vec3 position);
+	uint32_t place_obj(std::string file, bool is_lights, const glm::mat4& transform);
 
-	void spawn_point_light(glm::vec3 position, glm::vec3 normal, glm::vec3 color, float intensity);
-	void spawn_vpl(glm::vec3 position, glm::vec3 normal, glm::vec3 color, float intensity);
-	inline void remove_last_point_light() {
-		point_lights.pop_back();
+	// Move an instance. Only the top level BVH is rebuilt; the triangle lights follow, but point lights
+	// already generated from them keep their positions.
+	void set_instance_transform(const uint32_t instance, const glm::mat4& transform);
+
+	// Incremented whenever geometry moves, so cached hits can be invalidated
+	inline uint64_t get_geometry_version() const {
+		return geometry_version;
 	}
 
+	// Load a list of objects through the compiled scene in SCENE_CACHE_DIR, compiling it first if it is missing or out of date
+	void load_scene(const std::vector<SceneObject>& objects, bool recompile = false);
+	bool save_scene_file(const std::string& path) const;
+	bool load_scene_file(const std::string& path);
+
+	inline size_t triangle_count() const {
+		return mesh.triangle_count(); // Unique triangles, instances share them
+	}
+
+	// Point lights spawned at runtime. Spawning one traces SPAWNED_LIGHT_VPLS GI VPLs from it alone (or as many
+	// photons into the photon map) and appends the light and its VPLs to point_lights as one range, so the indices of every other light stay the same.
+	// Removing it drops just that range. The light distribution, the light tree and the sphere clouds are updated
+	// along with the table; the returned remap tells how the indices of the lights after the range moved.
+	uint32_t spawn_point_light(glm::vec3 position, glm::vec3 normal, glm::vec3 color, float intensity); // Returns an id for remove_point_light
+	LightRemap remove_point_light(const uint32_t id);
+	LightRemap remove_last_point_light();
+	void spawn_vpl(glm::vec3 position, glm::vec3 normal, glm::vec3 color, float intensity);
+
+	// Drop every light, the scene lights are generated again by the next get_lights
+	void clear_lights();
+
 	bool intersect(Ray& ray, HitInfo& hit);
 	bool is_occluded(const Ray &ray, float dist);
 
-	tinybvh::BVH& bvh(); // Build the bvh
+	// Batched versions of the above, neighbouring rays should be coherent. Misses are left with prim == INVALID_PRIM.
+	void intersect(std::span<const Ray> rays, std::span<HitInfo> hits);
+	void is_occluded(std::span<const Ray> rays, std::span<const float> dists, std::span<uint8_t> occluded);
+
+	tinybvh::BVH& bvh(); // Build the bvh, returns the top level BVH
+
+	inline TraversalLayout get_traversal_layout() const {
+		return traversal;
+	}
 
-	std::vector<std::weak_ptr<PointLight>> get_lights();
+	const LightTable& get_lights();
 	std::vector<std::weak_ptr<Material>> get_materials(bool ignore_textures = true);
+	std::span<const Material* const> get_material_table(); // Indexed by material id
 
-	std::vector<std::shared_ptr<PointLight>> vpls; // Virtual point lights
+	LightTable vpls; // Virtual point lights
+
+	AliasTable light_distribution; // Power-proportional distribution over point_lights
+	LightTree light_tree; // Spatial light hierarchy over point_lights
 
 	SphereCloud point_light_cloud; // Sphere cloud for point lights
 	SphereCloud vpl_cloud; // Sphere cloud for VPLs
+	PhotonMap photon_map; // GI photons in place of the VPLs when PHOTON_MAP_GI is set
 
 	private:
-	std::vector<int> all_material_ids;
+	// A spawned point light and its VPLs, stored in point_lights after the scene lights in the order they were spawned
+	struct SpawnedLight {
+		uint32_t id;
+		uint32_t vpl_count;
+		uint32_t photon_count; // Photons it left in photon_map
+	};
+
+	std::vector<SpawnedLight> spawned_lights;
+	uint32_t next_spawned_id = 0;
+	uint32_t scene_light_count = 0; // Lights generated from the scene at the start of point_lights
+
 	std::vector<int> light_material_ids;
+	std::vector<uint32_t> light_triangles; // Index of every emissive triangle, in increasing order
+	std::vector<bool> is_light_material;
 	std::vector<std::shared_ptr<Material>> mats_small;
 	std::vector<std::weak_ptr<Material>> weak_mats;
-	tinybvh::BVH bvhInstance;
+	std::vector<const Material*> material_table;
+	// tinybvh structures own raw buffers and must not be copied, so they are kept behind pointers
+	std::vector<std::unique_ptr<tinybvh::BVH>> blas; // One per asset
+	std::vector<std::unique_ptr<tinybvh::BVH4_CPU>> blas4;
+	std::vector<std::unique_ptr<tinybvh::BVH8_CPU>> blas8;
+	std::vector<tinybvh::BVHBase*> blas_list; // The BLAS of every asset in the traversal layout
+	std::vector<tinybvh::BLASInstance> blas_instances; // One per instance, same order
+	tinybvh::BVH tlas;
+	TraversalLayout traversal = TraversalLayout::Binary;
 	bool bvh_built = false;
-	std::vector<tinybvh::bvhvec4> raw_bvh_data;
+	uint64_t geometry_version = 0;
+	aligned_vector<tinybvh::bvhvec4> owned_positions;
+	aligned_vector<glm::vec3> owned_normals;
+	aligned_vector<glm::vec2> owned_texcoords;
+	aligned_vector<uint32_t> owned_indices;
+	aligned_vector<int32_t> owned_material_ids;
+	aligned_vector<glm::vec3> owned_face_normals;
+	std::vector<MeshAsset> assets; // Always owned, they are small and instances may be added later
+	std::vector<MeshInstance> instances;
+	std::unordered_map<std::string, uint32_t> asset_lookup; // Asset of every obj file loaded this session
+	MappedFile scene_file;
+	std::vector<std::string> material_libraries; // mtl files named by the obj files of the scene, as they were opened
+
+	uint32_t load_obj(std::string& file_path, bool force_light = false); // Returns the asset index
+	void add_light_material(int material_id);
+	void expand_lights();
+	void update_views();
+	void detach_scene_file();
+
+	std::string bvh_cache_path(const MeshAsset& asset) const;
+	bool load_cached_bvh(const std::string& path, const MeshAsset& asset, tinybvh::BVH& target);
+	void save_cached_bvh(const std::string& path, tinybvh::BVH& source);
+	void build_blas(const uint32_t asset);
+	void build_tlas();
+	bool resolve_hit(const Ray& ray, const tinybvh::Ray& r, HitInfo& hit);
 
-	void load_obj_at(std::string& file_path, glm::vec3 position, bool force_light = false);
+	LightTable generate_point_lights();
 
-	std::vector<std::shared_ptr<PointLight>> generate_point_lights();
+	// Trace GI photons from lights picked uniformly from sources until quota VPLs are left in out. Photons are
+	// keyed by block starting at first_block, so calls with blocks that do not overlap draw different photons.
+	void trace_photons(const LightTable& sources, const size_t quota, const uint32_t first_block, const float vpl_intensity, LightTable& out);
+	// Emit count photons from lights picked uniformly from sources and store them in out where they bounce, keyed like
+	// trace_photons. Their flux is that of a single photon, the caller scales it by sources.size() / count.
+	void trace_photon_map(const LightTable& sources, const size_t count, const uint32_t first_block, PhotonHits& out);
 	std::vector<std::shared_ptr<TriangularLight>> get_triangular_lights();
 };
 
-World load_world();
\ No newline at end of file
+World load_world(bool recompile = false);
\ No newline at end of file